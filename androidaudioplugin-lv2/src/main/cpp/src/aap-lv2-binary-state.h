@@ -0,0 +1,569 @@
+#ifndef AAP_LV2_BINARY_STATE_INCLUDED
+#define AAP_LV2_BINARY_STATE_INCLUDED 1
+
+// Binary encoding of a plugin state, as an alternative to the Turtle one (lilv_state_to_string()).
+//
+// The layout follows the plugin descriptor (aap-lv2-descriptor.h): a header with a magic and
+// a version, then arrays that refer to a string table by offset. ControlPort values are stored
+// as (symbol, float) pairs, and properties as the raw values that the plugin's save() stored,
+// keyed by the URI strings of the key and the type (not URIDs, so that a state can be loaded by
+// another process). The magic tells it from Turtle states, which are still loaded as before.
+// Values are in the native byte order (which is little endian on all Android ABIs).
+//
+// A delta state (AAP_LV2_BINARY_STATE_DELTA) has only the ports and the properties that changed
+// since a full state (its `base_id` is the hash of that full state), and the properties that were
+// removed since then (AAP_LV2_BINARY_STATE_PROPERTY_REMOVED). It is restored on top of the base.
+//
+// Atoms such as atom:URID, atom:Object and atom:Sequence have URIDs in their bodies, which are only
+// valid in the process that mapped them. Such values (AAP_LV2_BINARY_STATE_PROPERTY_URIDS) are stored
+// with each URID replaced by the offset of its URI in the string table plus one (0 stays 0, "no URID"),
+// and mapped back when they are restored (see aap_lv2_binary_state_rewrite_urids()).
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#define AAP_LV2_BINARY_STATE_MAGIC "AAPLV2ST"
+// 2: delta states, and rewritten URIDs (see above). Version 1 states are upgraded when they are loaded.
+#define AAP_LV2_BINARY_STATE_VERSION 2
+
+// header flags
+#define AAP_LV2_BINARY_STATE_DELTA 1
+// property flags (in addition to LV2_State_Flags)
+#define AAP_LV2_BINARY_STATE_PROPERTY_REMOVED 0x80000000u
+#define AAP_LV2_BINARY_STATE_PROPERTY_URIDS 0x40000000u
+#define AAP_LV2_BINARY_STATE_PROPERTY_FLAGS (AAP_LV2_BINARY_STATE_PROPERTY_REMOVED | AAP_LV2_BINARY_STATE_PROPERTY_URIDS)
+
+typedef struct aap_lv2_binary_state_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t flags;
+    uint32_t reserved;
+    // for a delta state, aap_lv2_binary_state_hash() of the full state that it is relative to.
+    uint64_t base_id;
+    uint32_t num_ports;
+    uint32_t ports_offset;
+    uint32_t num_properties;
+    uint32_t properties_offset;
+    // property values, each aligned to 8 bytes.
+    uint32_t values_offset;
+    uint32_t values_size;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} aap_lv2_binary_state_header_t;
+
+// The header of version 1 (no delta states). The rest of the layout is the same.
+typedef struct aap_lv2_binary_state_header_v1_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t num_ports;
+    uint32_t ports_offset;
+    uint32_t num_properties;
+    uint32_t properties_offset;
+    uint32_t values_offset;
+    uint32_t values_size;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} aap_lv2_binary_state_header_v1_t;
+
+typedef struct aap_lv2_binary_state_port_t {
+    uint32_t symbol;
+    float value;
+} aap_lv2_binary_state_port_t;
+
+typedef struct aap_lv2_binary_state_property_t {
+    uint32_t key;
+    uint32_t type;
+    uint32_t flags;
+    // relative to values_offset.
+    uint32_t value;
+    uint32_t size;
+} aap_lv2_binary_state_property_t;
+
+// FNV-1a, to identify a full state.
+static inline uint64_t aap_lv2_binary_state_hash(const void* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+// Returns true if `data` starts with the magic (of any version).
+static inline bool aap_lv2_binary_state_has_magic(const void* data, size_t size) {
+    return size >= 8 && memcmp(data, AAP_LV2_BINARY_STATE_MAGIC, 8) == 0;
+}
+
+// The part of the layout that all the versions share.
+struct AAPLV2BinaryStateLayout {
+    uint32_t num_ports;
+    uint32_t ports_offset;
+    uint32_t num_properties;
+    uint32_t properties_offset;
+    uint32_t values_offset;
+    uint32_t values_size;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+};
+
+// Returns true if every offset and count in the layout is within `size`, and the string table is terminated.
+static inline bool aap_lv2_binary_state_validate_layout(const void* data, size_t size, const AAPLV2BinaryStateLayout& layout) {
+    if (layout.ports_offset % 4 || layout.properties_offset % 4 || layout.values_offset % 8)
+        return false;
+    if ((uint64_t) layout.ports_offset + (uint64_t) layout.num_ports * sizeof(aap_lv2_binary_state_port_t) > size)
+        return false;
+    if ((uint64_t) layout.properties_offset + (uint64_t) layout.num_properties * sizeof(aap_lv2_binary_state_property_t) > size)
+        return false;
+    if ((uint64_t) layout.values_offset + layout.values_size > size)
+        return false;
+    if (layout.strings_size == 0 || (uint64_t) layout.strings_offset + layout.strings_size > size)
+        return false;
+    auto strings = (const char*) data + layout.strings_offset;
+    if (strings[layout.strings_size - 1] != '\0')
+        return false;
+    auto ports = (const aap_lv2_binary_state_port_t*) ((const uint8_t*) data + layout.ports_offset);
+    for (uint32_t i = 0; i < layout.num_ports; i++)
+        if (ports[i].symbol >= layout.strings_size)
+            return false;
+    auto properties = (const aap_lv2_binary_state_property_t*) ((const uint8_t*) data + layout.properties_offset);
+    for (uint32_t i = 0; i < layout.num_properties; i++) {
+        auto& property = properties[i];
+        if (property.key >= layout.strings_size || property.type >= layout.strings_size)
+            return false;
+        if ((uint64_t) property.value + property.size > layout.values_size)
+            return false;
+    }
+    return true;
+}
+
+// Returns true if `data` is a binary state of the current version that can be safely accessed.
+static inline bool aap_lv2_binary_state_validate(const void* data, size_t size) {
+    if (!aap_lv2_binary_state_has_magic(data, size) || size < sizeof(aap_lv2_binary_state_header_t))
+        return false;
+    auto header = (const aap_lv2_binary_state_header_t*) data;
+    if (header->version != AAP_LV2_BINARY_STATE_VERSION || header->total_size > size)
+        return false;
+    return aap_lv2_binary_state_validate_layout(data, size, AAPLV2BinaryStateLayout{
+            header->num_ports, header->ports_offset, header->num_properties, header->properties_offset,
+            header->values_offset, header->values_size, header->strings_offset, header->strings_size});
+}
+
+// URIDs in atom bodies
+
+// How an atom body is laid out, as far as its URIDs are concerned.
+enum AAPLV2AtomBodyKind {
+    // no URIDs (or not an atom type that we know).
+    AAP_LV2_ATOM_BODY_OPAQUE,
+    AAP_LV2_ATOM_BODY_URID,
+    AAP_LV2_ATOM_BODY_LITERAL,
+    AAP_LV2_ATOM_BODY_OBJECT,
+    AAP_LV2_ATOM_BODY_PROPERTY,
+    AAP_LV2_ATOM_BODY_SEQUENCE,
+    AAP_LV2_ATOM_BODY_TUPLE,
+    AAP_LV2_ATOM_BODY_VECTOR,
+};
+
+#define AAP_LV2_BINARY_STATE_ATOM_PREFIX "http://lv2plug.in/ns/ext/atom#"
+// nesting deeper than this is rejected.
+#define AAP_LV2_BINARY_STATE_MAX_ATOM_DEPTH 32
+
+static inline AAPLV2AtomBodyKind aap_lv2_atom_body_kind(const char* typeUri) {
+    auto prefixLength = sizeof(AAP_LV2_BINARY_STATE_ATOM_PREFIX) - 1;
+    if (strncmp(typeUri, AAP_LV2_BINARY_STATE_ATOM_PREFIX, prefixLength) != 0)
+        return AAP_LV2_ATOM_BODY_OPAQUE;
+    auto name = typeUri + prefixLength;
+    if (!strcmp(name, "URID"))
+        return AAP_LV2_ATOM_BODY_URID;
+    if (!strcmp(name, "Literal"))
+        return AAP_LV2_ATOM_BODY_LITERAL;
+    if (!strcmp(name, "Object") || !strcmp(name, "Resource") || !strcmp(name, "Blank"))
+        return AAP_LV2_ATOM_BODY_OBJECT;
+    if (!strcmp(name, "Property"))
+        return AAP_LV2_ATOM_BODY_PROPERTY;
+    if (!strcmp(name, "Sequence"))
+        return AAP_LV2_ATOM_BODY_SEQUENCE;
+    if (!strcmp(name, "Tuple"))
+        return AAP_LV2_ATOM_BODY_TUPLE;
+    if (!strcmp(name, "Vector"))
+        return AAP_LV2_ATOM_BODY_VECTOR;
+    return AAP_LV2_ATOM_BODY_OPAQUE;
+}
+
+// Rewrites every URID in an atom body in place: `toUri(value)` returns the URI that a value stands
+// for (or nullptr), and `fromUri(uri)` returns the value to replace it with (or 0 on failure).
+// The type of each nested atom is rewritten too, and its layout is determined by the URI.
+// Returns false if the body is malformed or a URID could not be rewritten.
+template <typename ToUri, typename FromUri>
+class AAPLV2AtomUridRewriter {
+    ToUri &to_uri;
+    FromUri &from_uri;
+
+    static uint32_t padded(uint32_t size) { return (size + 7) / 8 * 8; }
+
+    // 0 (no URID) is kept as is.
+    bool urid(uint8_t* field, const char** uri = nullptr) {
+        uint32_t value;
+        memcpy(&value, field, sizeof(value));
+        if (value == 0) {
+            if (uri)
+                *uri = "";
+            return true;
+        }
+        auto s = to_uri(value);
+        if (!s)
+            return false;
+        value = from_uri(s);
+        if (value == 0)
+            return false;
+        memcpy(field, &value, sizeof(value));
+        if (uri)
+            *uri = s;
+        return true;
+    }
+
+    // an atom header (size, type) and its body, within `available` bytes. `consumed` is its padded size.
+    bool atom(uint8_t* p, uint32_t available, int depth, uint32_t* consumed) {
+        if (available < 8)
+            return false;
+        uint32_t size;
+        memcpy(&size, p, sizeof(size));
+        if (size > available - 8)
+            return false;
+        const char* type;
+        if (!urid(p + 4, &type) || !body(aap_lv2_atom_body_kind(type), p + 8, size, depth + 1))
+            return false;
+        *consumed = std::min(8 + padded(size), available);
+        return true;
+    }
+
+    bool property(uint8_t* p, uint32_t size, int depth, uint32_t* consumed) {
+        // key, context, then the value atom.
+        if (size < 8 || !urid(p) || !urid(p + 4))
+            return false;
+        uint32_t valueSize;
+        if (!atom(p + 8, size - 8, depth, &valueSize))
+            return false;
+        *consumed = 8 + valueSize;
+        return true;
+    }
+
+public:
+    AAPLV2AtomUridRewriter(ToUri& toUri, FromUri& fromUri) : to_uri(toUri), from_uri(fromUri) {}
+
+    bool body(AAPLV2AtomBodyKind kind, uint8_t* p, uint32_t size, int depth = 0) {
+        if (depth > AAP_LV2_BINARY_STATE_MAX_ATOM_DEPTH)
+            return false;
+        uint32_t offset = 0, consumed = 0;
+        switch (kind) {
+        case AAP_LV2_ATOM_BODY_OPAQUE:
+            return true;
+        case AAP_LV2_ATOM_BODY_URID:
+            return size >= 4 && urid(p);
+        case AAP_LV2_ATOM_BODY_LITERAL:
+            // datatype, lang, then the string.
+            return size >= 8 && urid(p) && urid(p + 4);
+        case AAP_LV2_ATOM_BODY_PROPERTY:
+            return property(p, size, depth, &consumed);
+        case AAP_LV2_ATOM_BODY_OBJECT:
+            // id, otype, then the properties.
+            if (size < 8 || !urid(p) || !urid(p + 4))
+                return false;
+            for (offset = 8; offset < size; offset += consumed)
+                if (!property(p + offset, size - offset, depth, &consumed))
+                    return false;
+            return true;
+        case AAP_LV2_ATOM_BODY_SEQUENCE:
+            // unit, pad, then the events (each a 64-bit time and an atom).
+            if (size < 8 || !urid(p))
+                return false;
+            for (offset = 8; offset < size; offset += 8 + consumed)
+                if (size - offset < 8 || !atom(p + offset + 8, size - offset - 8, depth, &consumed))
+                    return false;
+            return true;
+        case AAP_LV2_ATOM_BODY_TUPLE:
+            for (offset = 0; offset < size; offset += consumed)
+                if (!atom(p + offset, size - offset, depth, &consumed))
+                    return false;
+            return true;
+        case AAP_LV2_ATOM_BODY_VECTOR: {
+            // child_size, child_type, then the bodies of the children.
+            const char* childType;
+            if (size < 8 || !urid(p + 4, &childType))
+                return false;
+            auto childKind = aap_lv2_atom_body_kind(childType);
+            if (childKind == AAP_LV2_ATOM_BODY_OPAQUE)
+                return true;
+            uint32_t childSize;
+            memcpy(&childSize, p, sizeof(childSize));
+            if (childKind != AAP_LV2_ATOM_BODY_URID || childSize != 4)
+                return false;
+            for (offset = 8; offset + 4 <= size; offset += 4)
+                if (!urid(p + offset))
+                    return false;
+            return true;
+        }
+        }
+        return false;
+    }
+};
+
+// Rewrites the URIDs in a value of the type (see AAPLV2AtomUridRewriter).
+template <typename ToUri, typename FromUri>
+static inline bool aap_lv2_binary_state_rewrite_urids(const char* typeUri, void* value, uint32_t size,
+                                                      ToUri&& toUri, FromUri&& fromUri) {
+    AAPLV2AtomUridRewriter<ToUri, FromUri> rewriter{toUri, fromUri};
+    return rewriter.body(aap_lv2_atom_body_kind(typeUri), (uint8_t*) value, size);
+}
+
+// Read access to a validated binary state.
+class AAPLV2BinaryState {
+    const uint8_t* data;
+
+public:
+    explicit AAPLV2BinaryState(const void* state) : data((const uint8_t*) state) {}
+
+    const aap_lv2_binary_state_header_t* header() const { return (const aap_lv2_binary_state_header_t*) data; }
+    bool isDelta() const { return header()->flags & AAP_LV2_BINARY_STATE_DELTA; }
+    uint32_t numPorts() const { return header()->num_ports; }
+    const aap_lv2_binary_state_port_t* port(uint32_t index) const {
+        return (const aap_lv2_binary_state_port_t*) (data + header()->ports_offset) + index;
+    }
+    uint32_t numProperties() const { return header()->num_properties; }
+    const aap_lv2_binary_state_property_t* property(uint32_t index) const {
+        return (const aap_lv2_binary_state_property_t*) (data + header()->properties_offset) + index;
+    }
+    const void* value(const aap_lv2_binary_state_property_t* property) const {
+        return data + header()->values_offset + property->value;
+    }
+    const char* string(uint32_t offset) const {
+        return (const char*) data + header()->strings_offset + offset;
+    }
+    // the URI that a rewritten URID in a property value stands for, or nullptr if it is out of range.
+    const char* uridString(uint32_t encoded) const {
+        return encoded <= header()->strings_size ? string(encoded - 1) : nullptr;
+    }
+
+    // Copies the value of the property into `result`, with the URIDs in it mapped by `map(uri)`
+    // (if it has any). Returns false if they could not be mapped.
+    template <typename Map>
+    bool copyValue(const aap_lv2_binary_state_property_t* property, std::vector<uint8_t>& result, Map&& map) const {
+        auto bytes = (const uint8_t*) value(property);
+        result.assign(bytes, bytes + property->size);
+        if (!(property->flags & AAP_LV2_BINARY_STATE_PROPERTY_URIDS))
+            return true;
+        return aap_lv2_binary_state_rewrite_urids(string(property->type), result.data(), property->size,
+                                                  [&](uint32_t encoded) { return uridString(encoded); }, map);
+    }
+};
+
+// Builds a binary state.
+class AAPLV2BinaryStateWriter {
+    std::vector<aap_lv2_binary_state_port_t> ports{};
+    std::vector<aap_lv2_binary_state_property_t> properties{};
+    std::vector<uint8_t> values{};
+    std::string strings{};
+    std::map<std::string, uint32_t> string_offsets{};
+    uint32_t flags{0};
+    uint64_t base_id{0};
+
+    static uint32_t align(uint32_t offset, uint32_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    uint32_t addString(const char* s) {
+        auto existing = string_offsets.find(s);
+        if (existing != string_offsets.end())
+            return existing->second;
+        auto offset = (uint32_t) strings.size();
+        strings.append(s);
+        strings.push_back('\0');
+        string_offsets[s] = offset;
+        return offset;
+    }
+
+public:
+    // makes it a delta state relative to the full state of `baseId`.
+    void setDelta(uint64_t baseId) {
+        flags |= AAP_LV2_BINARY_STATE_DELTA;
+        base_id = baseId;
+    }
+
+    size_t numPorts() const { return ports.size(); }
+    size_t numProperties() const { return properties.size(); }
+
+    void addPort(const char* symbol, float value) {
+        ports.emplace_back(aap_lv2_binary_state_port_t{addString(symbol), value});
+    }
+
+    void addProperty(const char* key, const char* type, uint32_t propertyFlags, const void* value, uint32_t size) {
+        auto offset = align((uint32_t) values.size(), 8);
+        values.resize(offset + size);
+        memcpy(values.data() + offset, value, size);
+        properties.emplace_back(aap_lv2_binary_state_property_t{addString(key), addString(type), propertyFlags, offset, size});
+    }
+
+    // Adds a property whose value may have URIDs in it, which are rewritten into the string table
+    // (by their URIs that `unmap(urid)` returns). Nothing is added and it returns false if the value is
+    // malformed or a URID could not be unmapped.
+    template <typename Unmap>
+    bool addPropertyWithUrids(const char* key, const char* type, uint32_t propertyFlags, const void* value, uint32_t size, Unmap&& unmap) {
+        if (aap_lv2_atom_body_kind(type) == AAP_LV2_ATOM_BODY_OPAQUE) {
+            addProperty(key, type, propertyFlags, value, size);
+            return true;
+        }
+        return addRewrittenProperty(key, type, propertyFlags, value, size, unmap);
+    }
+
+    // Adds a property of another binary state, with its URIDs (if any) rewritten into this string table.
+    bool addPropertyOf(const AAPLV2BinaryState& source, const aap_lv2_binary_state_property_t* property) {
+        auto key = source.string(property->key);
+        auto type = source.string(property->type);
+        if (!(property->flags & AAP_LV2_BINARY_STATE_PROPERTY_URIDS)) {
+            addProperty(key, type, property->flags, source.value(property), property->size);
+            return true;
+        }
+        return addRewrittenProperty(key, type, property->flags & ~AAP_LV2_BINARY_STATE_PROPERTY_URIDS,
+                                    source.value(property), property->size,
+                                    [&](uint32_t encoded) { return source.uridString(encoded); });
+    }
+
+private:
+    template <typename ToUri>
+    bool addRewrittenProperty(const char* key, const char* type, uint32_t propertyFlags, const void* value, uint32_t size, ToUri&& toUri) {
+        auto numStrings = strings.size();
+        auto numStringOffsets = string_offsets.size();
+        auto offset = align((uint32_t) values.size(), 8);
+        values.resize(offset + size);
+        memcpy(values.data() + offset, value, size);
+        if (!aap_lv2_binary_state_rewrite_urids(type, values.data() + offset, size, toUri,
+                                                [&](const char* uri) { return addString(uri) + 1; })) {
+            values.resize(offset);
+            // (drop the strings that it added)
+            if (string_offsets.size() != numStringOffsets) {
+                for (auto it = string_offsets.begin(); it != string_offsets.end();)
+                    it = it->second >= numStrings ? string_offsets.erase(it) : std::next(it);
+                strings.resize(numStrings);
+            }
+            return false;
+        }
+        properties.emplace_back(aap_lv2_binary_state_property_t{addString(key), addString(type),
+                                                                propertyFlags | AAP_LV2_BINARY_STATE_PROPERTY_URIDS, offset, size});
+        return true;
+    }
+
+public:
+
+    // (in a delta state) the property has been removed since the base.
+    void addRemovedProperty(const char* key) {
+        properties.emplace_back(aap_lv2_binary_state_property_t{addString(key), addString(""),
+                                                                AAP_LV2_BINARY_STATE_PROPERTY_REMOVED, 0, 0});
+    }
+
+    size_t size() const {
+        auto header = (uint32_t) sizeof(aap_lv2_binary_state_header_t);
+        auto portsEnd = header + (uint32_t) (ports.size() * sizeof(aap_lv2_binary_state_port_t));
+        auto propertiesEnd = portsEnd + (uint32_t) (properties.size() * sizeof(aap_lv2_binary_state_property_t));
+        auto valuesEnd = align(propertiesEnd, 8) + (uint32_t) values.size();
+        return valuesEnd + strings.size() + 1;
+    }
+
+    // `destination` must have size() bytes.
+    void writeTo(void* destination) const {
+        auto dst = (uint8_t*) destination;
+        auto header = (aap_lv2_binary_state_header_t*) dst;
+        memset(dst, 0, size());
+        memcpy(header->magic, AAP_LV2_BINARY_STATE_MAGIC, 8);
+        header->version = AAP_LV2_BINARY_STATE_VERSION;
+        header->total_size = (uint32_t) size();
+        header->flags = flags;
+        header->base_id = base_id;
+        header->num_ports = (uint32_t) ports.size();
+        header->ports_offset = sizeof(aap_lv2_binary_state_header_t);
+        header->num_properties = (uint32_t) properties.size();
+        header->properties_offset = header->ports_offset + (uint32_t) (ports.size() * sizeof(aap_lv2_binary_state_port_t));
+        header->values_offset = align(header->properties_offset + (uint32_t) (properties.size() * sizeof(aap_lv2_binary_state_property_t)), 8);
+        header->values_size = (uint32_t) values.size();
+        header->strings_offset = header->values_offset + header->values_size;
+        // (the extra terminator keeps the table non-empty)
+        header->strings_size = (uint32_t) strings.size() + 1;
+        if (!ports.empty())
+            memcpy(dst + header->ports_offset, ports.data(), ports.size() * sizeof(aap_lv2_binary_state_port_t));
+        if (!properties.empty())
+            memcpy(dst + header->properties_offset, properties.data(), properties.size() * sizeof(aap_lv2_binary_state_property_t));
+        if (!values.empty())
+            memcpy(dst + header->values_offset, values.data(), values.size());
+        memcpy(dst + header->strings_offset, strings.data(), strings.size());
+    }
+};
+
+// Converts a binary state of an older version into the current version. Returns false if `data` is not
+// a valid state of an older version. (Version 1 stored the values as is, so their URIDs, if any, are
+// still those of the process that saved them.)
+static inline bool aap_lv2_binary_state_upgrade(const void* data, size_t size, std::vector<uint8_t>& result) {
+    if (!aap_lv2_binary_state_has_magic(data, size) || size < sizeof(aap_lv2_binary_state_header_v1_t))
+        return false;
+    auto header = (const aap_lv2_binary_state_header_v1_t*) data;
+    if (header->version != 1 || header->total_size > size)
+        return false;
+    AAPLV2BinaryStateLayout layout{header->num_ports, header->ports_offset, header->num_properties, header->properties_offset,
+                                   header->values_offset, header->values_size, header->strings_offset, header->strings_size};
+    if (!aap_lv2_binary_state_validate_layout(data, size, layout))
+        return false;
+    auto bytes = (const uint8_t*) data;
+    auto strings = (const char*) bytes + layout.strings_offset;
+    AAPLV2BinaryStateWriter writer{};
+    auto ports = (const aap_lv2_binary_state_port_t*) (bytes + layout.ports_offset);
+    for (uint32_t i = 0; i < layout.num_ports; i++)
+        writer.addPort(strings + ports[i].symbol, ports[i].value);
+    auto properties = (const aap_lv2_binary_state_property_t*) (bytes + layout.properties_offset);
+    for (uint32_t i = 0; i < layout.num_properties; i++) {
+        auto& p = properties[i];
+        writer.addProperty(strings + p.key, strings + p.type, p.flags & ~AAP_LV2_BINARY_STATE_PROPERTY_FLAGS,
+                           bytes + layout.values_offset + p.value, p.size);
+    }
+    result.resize(writer.size());
+    writer.writeTo(result.data());
+    return true;
+}
+
+// Builds the full state that results from restoring `delta` on top of `base` (both validated).
+static inline void aap_lv2_binary_state_merge(const AAPLV2BinaryState& base, const AAPLV2BinaryState& delta,
+                                              AAPLV2BinaryStateWriter& writer) {
+    std::map<std::string, uint32_t> deltaPorts{}, deltaProperties{};
+    for (uint32_t i = 0; i < delta.numPorts(); i++)
+        deltaPorts[delta.string(delta.port(i)->symbol)] = i;
+    for (uint32_t i = 0; i < delta.numProperties(); i++)
+        deltaProperties[delta.string(delta.property(i)->key)] = i;
+
+    for (uint32_t i = 0; i < base.numPorts(); i++) {
+        auto symbol = base.string(base.port(i)->symbol);
+        auto changed = deltaPorts.find(symbol);
+        if (changed == deltaPorts.end())
+            writer.addPort(symbol, base.port(i)->value);
+        else {
+            writer.addPort(symbol, delta.port(changed->second)->value);
+            deltaPorts.erase(changed);
+        }
+    }
+    for (auto &added : deltaPorts)
+        writer.addPort(added.first.c_str(), delta.port(added.second)->value);
+
+    for (uint32_t i = 0; i < base.numProperties(); i++) {
+        auto p = base.property(i);
+        auto key = base.string(p->key);
+        if (deltaProperties.find(key) == deltaProperties.end())
+            writer.addPropertyOf(base, p);
+    }
+    for (uint32_t i = 0; i < delta.numProperties(); i++) {
+        auto p = delta.property(i);
+        if (!(p->flags & AAP_LV2_BINARY_STATE_PROPERTY_REMOVED))
+            writer.addPropertyOf(delta, p);
+    }
+}
+
+#endif // ifndef AAP_LV2_BINARY_STATE_INCLUDED
@@ -0,0 +1,48 @@
+#ifndef AAP_LV2_CHANGE_DETECTION_INCLUDED
+#define AAP_LV2_CHANGE_DETECTION_INCLUDED 1
+
+// Change detection over contiguous float arrays (the ControlPort values), for the output
+// parameter changes in process(). It compares up to 64 values at once and returns the result
+// as a bitmask, so that a block without any change costs a few vector compares.
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define AAP_LV2_CHANGE_MASK_BITS 64
+
+inline size_t aap_lv2_change_mask_words(size_t count) {
+    return (count + AAP_LV2_CHANGE_MASK_BITS - 1) / AAP_LV2_CHANGE_MASK_BITS;
+}
+
+// Returns a bitmask of `count` (up to 64) values where `|current[i] - last[i]| <= deadband[i]`
+// does NOT hold. NaN in `last` is therefore always a change (which is how "never emitted" is marked).
+inline uint64_t aap_lv2_detect_changes(const float *current, const float *last, const float *deadband, size_t count) {
+    uint64_t ret = 0;
+    size_t i = 0;
+#if defined(__aarch64__)
+    const uint32x4_t laneBits{1, 2, 4, 8};
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t within = vcleq_f32(vabdq_f32(vld1q_f32(current + i), vld1q_f32(last + i)), vld1q_f32(deadband + i));
+        ret |= (uint64_t) (~vaddvq_u32(vandq_u32(within, laneBits)) & 0xF) << i;
+    }
+#elif defined(__SSE2__)
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 diff = _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(current + i), _mm_loadu_ps(last + i)));
+        __m128 within = _mm_cmple_ps(diff, _mm_loadu_ps(deadband + i));
+        ret |= (uint64_t) (~_mm_movemask_ps(within) & 0xF) << i;
+    }
+#endif
+    for (; i < count; i++)
+        if (!(std::fabs(current[i] - last[i]) <= deadband[i]))
+            ret |= (uint64_t) 1 << i;
+    return ret;
+}
+
+#endif // ifndef AAP_LV2_CHANGE_DETECTION_INCLUDED
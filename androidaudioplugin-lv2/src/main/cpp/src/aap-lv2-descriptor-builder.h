@@ -0,0 +1,272 @@
+#ifndef AAP_LV2_DESCRIPTOR_BUILDER_INCLUDED
+#define AAP_LV2_DESCRIPTOR_BUILDER_INCLUDED 1
+
+// Generates compiled plugin descriptors (see aap-lv2-descriptor.h) from lilv.
+// It is used by aap-import-lv2-metadata at build time, and by the bridge at run time
+// when there is no pre-generated descriptor.
+
+#include <string>
+#include <vector>
+#include <lilv/lilv.h>
+#include <lv2/atom/atom.h>
+#include <lv2/midi/midi.h>
+#include <lv2/patch/patch.h>
+#include <lv2/worker/worker.h>
+#include <lv2/state/state.h>
+#include <lv2/port-props/port-props.h>
+#include <lv2/resize-port/resize-port.h>
+
+#include "aap-lv2-descriptor.h"
+
+class AAPLV2DescriptorBuilder {
+    LilvNode *audio_port_uri_node, *control_port_uri_node, *atom_port_uri_node, *cv_port_uri_node,
+            *input_port_uri_node, *output_port_uri_node,
+            *toggled_uri_node, *integer_uri_node, *discrete_cv_uri_node,
+            *midi_event_uri_node, *patch_message_uri_node, *ump_event_uri_node,
+            *resize_port_minimum_size_node, *work_interface_uri_node, *thread_safe_restore_uri_node,
+            *patch_writable_uri_node, *patch_readable_uri_node, *rdfs_label_uri_node, *rdfs_range_uri_node,
+            *default_uri_node, *minimum_uri_node, *maximum_uri_node;
+    LilvWorld *world;
+
+    std::vector<aap_lv2_descriptor_port_t> ports{};
+    std::vector<aap_lv2_descriptor_scale_point_t> scale_points{};
+    std::vector<aap_lv2_descriptor_property_t> properties{};
+    std::string strings{};
+
+    uint32_t addString(const char* s) {
+        auto ret = (uint32_t) strings.size();
+        strings.append(s ? s : "");
+        strings.push_back('\0');
+        return ret;
+    }
+
+    void addPort(const LilvPlugin* plugin, const LilvPort* port) {
+        aap_lv2_descriptor_port_t d{};
+        if (lilv_port_is_a(plugin, port, audio_port_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_AUDIO;
+        if (lilv_port_is_a(plugin, port, control_port_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_CONTROL;
+        if (lilv_port_is_a(plugin, port, atom_port_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_ATOM;
+        if (lilv_port_is_a(plugin, port, cv_port_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_CV;
+        if (lilv_port_is_a(plugin, port, input_port_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_INPUT;
+        if (lilv_port_is_a(plugin, port, output_port_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_OUTPUT;
+        if (lilv_port_has_property(plugin, port, toggled_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_TOGGLED;
+        if (lilv_port_has_property(plugin, port, integer_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_INTEGER;
+        if (lilv_port_has_property(plugin, port, discrete_cv_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_DISCRETE_CV;
+        if (lilv_port_supports_event(plugin, port, midi_event_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_MIDI_EVENT;
+        if (lilv_port_supports_event(plugin, port, patch_message_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_PATCH_MESSAGE;
+        if (lilv_port_supports_event(plugin, port, ump_event_uri_node))
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_UMP_EVENT;
+
+        LilvNode *defNode{nullptr}, *minNode{nullptr}, *maxNode{nullptr};
+        lilv_port_get_range(plugin, port, &defNode, &minNode, &maxNode);
+        if (defNode) {
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_HAS_DEFAULT;
+            d.default_value = lilv_node_as_float(defNode);
+            lilv_node_free(defNode);
+        }
+        if (minNode) {
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM;
+            d.minimum = lilv_node_as_float(minNode);
+            lilv_node_free(minNode);
+        }
+        if (maxNode) {
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_HAS_MAXIMUM;
+            d.maximum = lilv_node_as_float(maxNode);
+            lilv_node_free(maxNode);
+        }
+
+        LilvNode *minimumSizeNode = lilv_port_get(plugin, port, resize_port_minimum_size_node);
+        if (minimumSizeNode) {
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM_SIZE;
+            d.minimum_size = (uint32_t) lilv_node_as_int(minimumSizeNode);
+            lilv_node_free(minimumSizeNode);
+        }
+
+        LilvNode *nameNode = lilv_port_get_name(plugin, port);
+        d.name = addString(nameNode ? lilv_node_as_string(nameNode) : "");
+        if (nameNode)
+            lilv_node_free(nameNode);
+        d.symbol = addString(lilv_node_as_string(lilv_port_get_symbol(plugin, port)));
+
+        d.first_scale_point = (uint32_t) scale_points.size();
+        LilvScalePoints* scalePoints = lilv_port_get_scale_points(plugin, port);
+        if (scalePoints != nullptr) {
+            d.flags |= AAP_LV2_DESCRIPTOR_PORT_HAS_SCALE_POINTS;
+            LILV_FOREACH(scale_points, spi, scalePoints) {
+                auto sp = lilv_scale_points_get(scalePoints, spi);
+                aap_lv2_descriptor_scale_point_t s{};
+                s.value = lilv_node_as_float(lilv_scale_point_get_value(sp));
+                s.label = addString(lilv_node_as_string(lilv_scale_point_get_label(sp)));
+                scale_points.emplace_back(s);
+            }
+            lilv_scale_points_free(scalePoints);
+        }
+        d.num_scale_points = (uint32_t) scale_points.size() - d.first_scale_point;
+
+        ports.emplace_back(d);
+    }
+
+    // Returns the number if the property has the value of it, and stores it into `result`.
+    bool getPropertyNumber(const LilvNode* property, const LilvNode* predicate, float* result) {
+        LilvNode *node = lilv_world_get(world, property, predicate, nullptr);
+        if (!node)
+            return false;
+        bool ret = lilv_node_is_float(node) || lilv_node_is_int(node);
+        if (ret)
+            *result = lilv_node_as_float(node);
+        lilv_node_free(node);
+        return ret;
+    }
+
+    void addProperties(const LilvPlugin* plugin, const LilvNode* predicate, uint32_t flag) {
+        LilvNodes *nodes = lilv_plugin_get_value(plugin, predicate);
+        if (!nodes)
+            return;
+        LILV_FOREACH(nodes, i, nodes) {
+            auto property = lilv_nodes_get(nodes, i);
+            if (!lilv_node_is_uri(property))
+                continue;
+            auto uri = lilv_node_as_uri(property);
+            // a property can be both writable and readable.
+            bool found = false;
+            for (auto &existing : properties)
+                if (!strcmp(strings.c_str() + existing.uri, uri)) {
+                    existing.flags |= flag;
+                    found = true;
+                }
+            if (found)
+                continue;
+
+            aap_lv2_descriptor_property_t d{};
+            d.flags = flag;
+            d.uri = addString(uri);
+            LilvNode *labelNode = lilv_world_get(world, property, rdfs_label_uri_node, nullptr);
+            d.label = addString(labelNode ? lilv_node_as_string(labelNode) : uri);
+            if (labelNode)
+                lilv_node_free(labelNode);
+            LilvNode *rangeNode = lilv_world_get(world, property, rdfs_range_uri_node, nullptr);
+            d.range = addString(rangeNode && lilv_node_is_uri(rangeNode) ? lilv_node_as_uri(rangeNode) : "");
+            if (rangeNode)
+                lilv_node_free(rangeNode);
+            if (getPropertyNumber(property, default_uri_node, &d.default_value))
+                d.flags |= AAP_LV2_DESCRIPTOR_PORT_HAS_DEFAULT;
+            if (getPropertyNumber(property, minimum_uri_node, &d.minimum))
+                d.flags |= AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM;
+            if (getPropertyNumber(property, maximum_uri_node, &d.maximum))
+                d.flags |= AAP_LV2_DESCRIPTOR_PORT_HAS_MAXIMUM;
+            properties.emplace_back(d);
+        }
+        lilv_nodes_free(nodes);
+    }
+
+public:
+    explicit AAPLV2DescriptorBuilder(LilvWorld* world) : world(world) {
+        audio_port_uri_node = lilv_new_uri(world, LV2_CORE__AudioPort);
+        control_port_uri_node = lilv_new_uri(world, LV2_CORE__ControlPort);
+        atom_port_uri_node = lilv_new_uri(world, LV2_ATOM__AtomPort);
+        cv_port_uri_node = lilv_new_uri(world, LV2_CORE__CVPort);
+        input_port_uri_node = lilv_new_uri(world, LV2_CORE__InputPort);
+        output_port_uri_node = lilv_new_uri(world, LV2_CORE__OutputPort);
+        toggled_uri_node = lilv_new_uri(world, LV2_CORE__toggled);
+        integer_uri_node = lilv_new_uri(world, LV2_CORE__integer);
+        discrete_cv_uri_node = lilv_new_uri(world, LV2_PORT_PROPS__discreteCV);
+        midi_event_uri_node = lilv_new_uri(world, LV2_MIDI__MidiEvent);
+        patch_message_uri_node = lilv_new_uri(world, LV2_PATCH__Message);
+        ump_event_uri_node = lilv_new_uri(world, AAP_LV2_UMP_EVENT_URI);
+        resize_port_minimum_size_node = lilv_new_uri(world, LV2_RESIZE_PORT__minimumSize);
+        work_interface_uri_node = lilv_new_uri(world, LV2_WORKER__interface);
+        thread_safe_restore_uri_node = lilv_new_uri(world, LV2_STATE__threadSafeRestore);
+        patch_writable_uri_node = lilv_new_uri(world, LV2_PATCH__writable);
+        patch_readable_uri_node = lilv_new_uri(world, LV2_PATCH__readable);
+        rdfs_label_uri_node = lilv_new_uri(world, LILV_NS_RDFS "label");
+        rdfs_range_uri_node = lilv_new_uri(world, LILV_NS_RDFS "range");
+        default_uri_node = lilv_new_uri(world, LV2_CORE__default);
+        minimum_uri_node = lilv_new_uri(world, LV2_CORE__minimum);
+        maximum_uri_node = lilv_new_uri(world, LV2_CORE__maximum);
+    }
+
+    ~AAPLV2DescriptorBuilder() {
+        lilv_node_free(audio_port_uri_node);
+        lilv_node_free(control_port_uri_node);
+        lilv_node_free(atom_port_uri_node);
+        lilv_node_free(cv_port_uri_node);
+        lilv_node_free(input_port_uri_node);
+        lilv_node_free(output_port_uri_node);
+        lilv_node_free(toggled_uri_node);
+        lilv_node_free(integer_uri_node);
+        lilv_node_free(discrete_cv_uri_node);
+        lilv_node_free(midi_event_uri_node);
+        lilv_node_free(patch_message_uri_node);
+        lilv_node_free(ump_event_uri_node);
+        lilv_node_free(resize_port_minimum_size_node);
+        lilv_node_free(work_interface_uri_node);
+        lilv_node_free(thread_safe_restore_uri_node);
+        lilv_node_free(patch_writable_uri_node);
+        lilv_node_free(patch_readable_uri_node);
+        lilv_node_free(rdfs_label_uri_node);
+        lilv_node_free(rdfs_range_uri_node);
+        lilv_node_free(default_uri_node);
+        lilv_node_free(minimum_uri_node);
+        lilv_node_free(maximum_uri_node);
+    }
+
+    std::vector<uint8_t> build(const LilvPlugin* plugin) {
+        ports.clear();
+        scale_points.clear();
+        properties.clear();
+        strings.clear();
+
+        aap_lv2_descriptor_header_t header{};
+        memcpy(header.magic, AAP_LV2_DESCRIPTOR_MAGIC, sizeof(header.magic));
+        header.version = AAP_LV2_DESCRIPTOR_VERSION;
+        if (lilv_plugin_verify(plugin))
+            header.flags |= AAP_LV2_DESCRIPTOR_PLUGIN_VERIFIED;
+        if (lilv_plugin_has_extension_data(plugin, work_interface_uri_node))
+            header.flags |= AAP_LV2_DESCRIPTOR_PLUGIN_HAS_WORKER_INTERFACE;
+        if (lilv_plugin_has_feature(plugin, thread_safe_restore_uri_node))
+            header.flags |= AAP_LV2_DESCRIPTOR_PLUGIN_THREAD_SAFE_RESTORE;
+        header.uri = addString(lilv_node_as_uri(lilv_plugin_get_uri(plugin)));
+
+        for (uint32_t p = 0; p < lilv_plugin_get_num_ports(plugin); p++)
+            addPort(plugin, lilv_plugin_get_port_by_index(plugin, p));
+        addProperties(plugin, patch_writable_uri_node, AAP_LV2_DESCRIPTOR_PROPERTY_WRITABLE);
+        addProperties(plugin, patch_readable_uri_node, AAP_LV2_DESCRIPTOR_PROPERTY_READABLE);
+
+        // pad the string table so that the whole descriptor stays 4-byte aligned.
+        while (strings.size() % 4)
+            strings.push_back('\0');
+
+        header.num_ports = (uint32_t) ports.size();
+        header.ports_offset = sizeof(header);
+        header.num_scale_points = (uint32_t) scale_points.size();
+        header.scale_points_offset = header.ports_offset + header.num_ports * sizeof(aap_lv2_descriptor_port_t);
+        header.num_properties = (uint32_t) properties.size();
+        header.properties_offset = header.scale_points_offset + header.num_scale_points * sizeof(aap_lv2_descriptor_scale_point_t);
+        header.strings_offset = header.properties_offset + header.num_properties * sizeof(aap_lv2_descriptor_property_t);
+        header.strings_size = (uint32_t) strings.size();
+        header.total_size = header.strings_offset + header.strings_size;
+
+        std::vector<uint8_t> ret(header.total_size);
+        memcpy(ret.data(), &header, sizeof(header));
+        if (!ports.empty())
+            memcpy(ret.data() + header.ports_offset, ports.data(), header.num_ports * sizeof(aap_lv2_descriptor_port_t));
+        if (!scale_points.empty())
+            memcpy(ret.data() + header.scale_points_offset, scale_points.data(), header.num_scale_points * sizeof(aap_lv2_descriptor_scale_point_t));
+        if (!properties.empty())
+            memcpy(ret.data() + header.properties_offset, properties.data(), header.num_properties * sizeof(aap_lv2_descriptor_property_t));
+        memcpy(ret.data() + header.strings_offset, strings.data(), header.strings_size);
+        return ret;
+    }
+};
+
+#endif // ifndef AAP_LV2_DESCRIPTOR_BUILDER_INCLUDED
@@ -0,0 +1,176 @@
+#ifndef AAP_LV2_DESCRIPTOR_INCLUDED
+#define AAP_LV2_DESCRIPTOR_INCLUDED 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Compiled plugin descriptor.
+//
+// It contains everything that the LV2 bridge needs at instantiate() and prepare() steps
+// (port classes, ranges, scale points, rsz:minimumSize, supported events etc.), so that
+// the bridge does not have to run lilv queries on them. aap-import-lv2-metadata generates
+// one file per plugin and lists it in the plugin index (see aap-lv2-index.h).
+// The bridge also generates the same content from lilv when the file is not available.
+//
+// The layout is: header, port entries, scale point entries, property entries, then a string table.
+// Every integer is in native (little) endian and 4-byte aligned, so that it can be used
+// directly on mmap()-ed memory. Strings are referenced by their offsets in the string table.
+// Any change in the layout must bump AAP_LV2_DESCRIPTOR_VERSION.
+
+#define AAP_LV2_DESCRIPTOR_MAGIC "AAPLV2D"
+#define AAP_LV2_DESCRIPTOR_VERSION 3
+
+// The Atom event type for raw UMP packets (a sequence of 32-bit words in native endian, one or more
+// UMPs per event). LV2 has no standard UMP event type yet; Atom ports that list it in atom:supports
+// receive UMPs from AAP without being downconverted to MIDI 1.0 bytestream.
+#define AAP_LV2_UMP_EVENT_URI "urn:aap:lv2:ump#UmpEvent"
+
+enum AAPLV2DescriptorPluginFlags {
+    AAP_LV2_DESCRIPTOR_PLUGIN_VERIFIED = 1,
+    AAP_LV2_DESCRIPTOR_PLUGIN_HAS_WORKER_INTERFACE = 2,
+    AAP_LV2_DESCRIPTOR_PLUGIN_THREAD_SAFE_RESTORE = 4,
+};
+
+enum AAPLV2DescriptorPortFlags {
+    AAP_LV2_DESCRIPTOR_PORT_AUDIO = 1,
+    AAP_LV2_DESCRIPTOR_PORT_CONTROL = 2,
+    AAP_LV2_DESCRIPTOR_PORT_ATOM = 4,
+    AAP_LV2_DESCRIPTOR_PORT_CV = 8,
+    AAP_LV2_DESCRIPTOR_PORT_INPUT = 0x10,
+    AAP_LV2_DESCRIPTOR_PORT_OUTPUT = 0x20,
+    AAP_LV2_DESCRIPTOR_PORT_TOGGLED = 0x40,
+    AAP_LV2_DESCRIPTOR_PORT_INTEGER = 0x80,
+    AAP_LV2_DESCRIPTOR_PORT_DISCRETE_CV = 0x100,
+    AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_MIDI_EVENT = 0x200,
+    AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_PATCH_MESSAGE = 0x400,
+    AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_UMP_EVENT = 0x800,
+    AAP_LV2_DESCRIPTOR_PORT_HAS_DEFAULT = 0x1000,
+    AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM = 0x2000,
+    AAP_LV2_DESCRIPTOR_PORT_HAS_MAXIMUM = 0x4000,
+    AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM_SIZE = 0x8000,
+    AAP_LV2_DESCRIPTOR_PORT_HAS_SCALE_POINTS = 0x10000,
+};
+
+// Flags for patch:writable / patch:readable properties (parameters that are not ports).
+// The range flags share the values with the port flags.
+enum AAPLV2DescriptorPropertyFlags {
+    AAP_LV2_DESCRIPTOR_PROPERTY_WRITABLE = 1,
+    AAP_LV2_DESCRIPTOR_PROPERTY_READABLE = 2,
+};
+
+typedef struct aap_lv2_descriptor_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t flags;
+    uint32_t uri;
+    uint32_t num_ports;
+    uint32_t ports_offset;
+    uint32_t num_scale_points;
+    uint32_t scale_points_offset;
+    uint32_t num_properties;
+    uint32_t properties_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} aap_lv2_descriptor_header_t;
+
+typedef struct aap_lv2_descriptor_port_t {
+    uint32_t flags;
+    uint32_t name;
+    uint32_t symbol;
+    float default_value;
+    float minimum;
+    float maximum;
+    uint32_t minimum_size;
+    uint32_t first_scale_point;
+    uint32_t num_scale_points;
+} aap_lv2_descriptor_port_t;
+
+typedef struct aap_lv2_descriptor_scale_point_t {
+    float value;
+    uint32_t label;
+} aap_lv2_descriptor_scale_point_t;
+
+typedef struct aap_lv2_descriptor_property_t {
+    uint32_t flags;
+    uint32_t uri;
+    uint32_t label;
+    // rdfs:range (e.g. atom:Float), or an empty string.
+    uint32_t range;
+    float default_value;
+    float minimum;
+    float maximum;
+} aap_lv2_descriptor_property_t;
+
+// Returns true if `data` is a descriptor that can be safely accessed, i.e. every offset
+// and count in it is within `size`, and the string table is terminated.
+static inline bool aap_lv2_descriptor_validate(const void* data, size_t size) {
+    if (size < sizeof(aap_lv2_descriptor_header_t))
+        return false;
+    auto header = (const aap_lv2_descriptor_header_t*) data;
+    if (memcmp(header->magic, AAP_LV2_DESCRIPTOR_MAGIC, sizeof(header->magic)) != 0)
+        return false;
+    if (header->version != AAP_LV2_DESCRIPTOR_VERSION || header->total_size != size)
+        return false;
+    if (header->ports_offset % 4 || header->scale_points_offset % 4 || header->properties_offset % 4)
+        return false;
+    if ((uint64_t) header->ports_offset + (uint64_t) header->num_ports * sizeof(aap_lv2_descriptor_port_t) > size)
+        return false;
+    if ((uint64_t) header->scale_points_offset + (uint64_t) header->num_scale_points * sizeof(aap_lv2_descriptor_scale_point_t) > size)
+        return false;
+    if ((uint64_t) header->properties_offset + (uint64_t) header->num_properties * sizeof(aap_lv2_descriptor_property_t) > size)
+        return false;
+    if (header->strings_size == 0 || (uint64_t) header->strings_offset + header->strings_size > size)
+        return false;
+    auto strings = (const char*) data + header->strings_offset;
+    if (strings[header->strings_size - 1] != '\0' || header->uri >= header->strings_size)
+        return false;
+    auto ports = (const aap_lv2_descriptor_port_t*) ((const uint8_t*) data + header->ports_offset);
+    for (uint32_t i = 0; i < header->num_ports; i++) {
+        auto& port = ports[i];
+        if (port.name >= header->strings_size || port.symbol >= header->strings_size)
+            return false;
+        if ((uint64_t) port.first_scale_point + port.num_scale_points > header->num_scale_points)
+            return false;
+    }
+    auto scalePoints = (const aap_lv2_descriptor_scale_point_t*) ((const uint8_t*) data + header->scale_points_offset);
+    for (uint32_t i = 0; i < header->num_scale_points; i++)
+        if (scalePoints[i].label >= header->strings_size)
+            return false;
+    auto properties = (const aap_lv2_descriptor_property_t*) ((const uint8_t*) data + header->properties_offset);
+    for (uint32_t i = 0; i < header->num_properties; i++) {
+        auto& property = properties[i];
+        if (property.uri >= header->strings_size || property.label >= header->strings_size || property.range >= header->strings_size)
+            return false;
+    }
+    return true;
+}
+
+// Port symbol -> port index, sorted by symbol, for the port values in states and presets (which are
+// keyed by symbols). The symbols are not copied, so they have to outlive the table (the ones in the
+// descriptor string table do). Call sort() after adding them.
+class AAPLV2SymbolTable {
+    std::vector<std::pair<const char*, uint32_t>> entries{};
+
+public:
+    void clear() { entries.clear(); }
+    void reserve(size_t size) { entries.reserve(size); }
+    size_t size() const { return entries.size(); }
+    void add(const char* symbol, uint32_t index) { entries.emplace_back(symbol, index); }
+    void sort() {
+        std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) { return strcmp(a.first, b.first) < 0; });
+    }
+
+    // returns -1 if there is no such symbol.
+    int32_t find(const char* symbol) const {
+        auto it = std::lower_bound(entries.begin(), entries.end(), symbol,
+                                   [](auto& entry, const char* s) { return strcmp(entry.first, s) < 0; });
+        return it != entries.end() && !strcmp(it->first, symbol) ? (int32_t) it->second : -1;
+    }
+};
+
+#endif // ifndef AAP_LV2_DESCRIPTOR_INCLUDED
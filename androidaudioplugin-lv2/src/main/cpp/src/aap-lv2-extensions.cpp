@@ -1,10 +1,19 @@
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <cerrno>
 #include <memory>
+#include <algorithm>
 #include <cstring>
 #include <cassert>
+#include <functional>
 #include <vector>
 #include <map>
+#include <mutex>
 #include <string>
 
 #include <lilv/lilv.h>
@@ -15,6 +24,7 @@
 #include <aap/ext/state.h>
 
 #include "aap-lv2-internal.h"
+#include "aap-lv2-descriptor-builder.h"
 
 namespace aaplv2bridge {
 
@@ -24,36 +34,48 @@ typedef int (*PresetSink)(Jalv*           jalv,
                           const LilvNode* title,
                           void*           data);
 
-// imported from jalv/src/state.c with some changes to match AAPLV2Context
+// imported from jalv/src/state.c with some changes to match AAPLV2Context.
+// Unlike the original, it builds only the index of the labels (see aap-lv2-preset-index.h), and
+// the sink is required.
 int
 jalv_load_presets(Jalv* jalv, PresetSink sink, void* data)
 {
-    LilvNodes* presets = lilv_plugin_get_related(jalv->plugin,
-                                                 jalv->statics->presets_preset_node);
-    LILV_FOREACH(nodes, i, presets) {
-        const LilvNode* preset = lilv_nodes_get(presets, i);
-        lilv_world_load_resource(jalv->world, preset);
-        if (!sink) {
-            continue;
-        }
-
-        LilvNodes* labels = lilv_world_find_nodes(
-                jalv->world, preset, jalv->statics->rdfs_label_node, nullptr);
-        if (labels) {
-            const LilvNode* label = lilv_nodes_get_first(labels);
+    aap_lv2_index_presets(jalv->world, jalv->plugin, jalv->statics->presets_preset_node,
+                          jalv->statics->rdfs_label_node, jalv->statics->rdfs_see_also_node,
+                          [&](const LilvNode* preset, const LilvNode* label) {
+        if (label)
             sink(jalv, preset, label, data);
-            lilv_nodes_free(labels);
-        } else {
-            fprintf(stderr, "Preset <%s> has no rdfs:label\n",
-                    lilv_node_as_string(lilv_nodes_get(presets, i)));
-        }
-    }
-    lilv_nodes_free(presets);
+        else
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: preset <%s> has no rdfs:label.",
+                         jalv->aap_plugin_id.c_str(), lilv_node_as_string(preset));
+    });
 
     return 0;
 }
 
-// The code below (jalv_worker_xxx) is copied from jalv worker.c and then made minimum required changes.
+// The code below (jalv_worker_xxx) is derived from jalv worker.c. Unlike the original, the rings and
+// message buffers are preallocated with bounded sizes, a request or response that does not fit is
+// rejected with LV2_WORKER_ERR_NO_SPACE (instead of being written partially), and responses are
+// delivered under a time budget.
+
+static void
+update_high_water_mark(std::atomic<uint32_t> &mark, uint32_t value)
+{
+    auto current = mark.load(std::memory_order_relaxed);
+    while (value > current && !mark.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+}
+
+// Writes a message into the ring as a whole, or rejects it.
+static LV2_Worker_Status
+jalv_worker_write_message(JalvWorker* worker, AAPLV2SpscRing& ring, uint32_t size, const void* data)
+{
+    if (size > worker->max_message_size)
+        return LV2_WORKER_ERR_NO_SPACE;
+    AAPLV2WorkerMessageHeader header{size, 0, aap_lv2_monotonic_ns()};
+    if (!ring.write(&header, sizeof(header), data, size))
+        return LV2_WORKER_ERR_NO_SPACE;
+    return LV2_WORKER_SUCCESS;
+}
 
 static LV2_Worker_Status
 jalv_worker_respond(LV2_Worker_Respond_Handle handle,
@@ -61,81 +83,349 @@ jalv_worker_respond(LV2_Worker_Respond_Handle handle,
                     const void*               data)
 {
     JalvWorker* worker = (JalvWorker*)handle;
-    zix_ring_write(worker->responses, (const char*)&size, sizeof(size));
-    zix_ring_write(worker->responses, (const char*)data, size);
+    auto ret = jalv_worker_write_message(worker, worker->responses, size, data);
+    if (ret != LV2_WORKER_SUCCESS) {
+        worker->stats.rejected_responses++;
+        return ret;
+    }
+    update_high_water_mark(worker->stats.max_response_queue_bytes, worker->responses.readSpace());
     return LV2_WORKER_SUCCESS;
 }
 
+// Runs up to `maxRequests` requests in the queue, in order. Returns the number of requests run.
+// Only one thread may run the requests of a worker at a time.
+static uint32_t
+jalv_worker_run_requests(JalvWorker* worker, uint32_t maxRequests)
+{
+    Jalv* jalv = worker->ctx;
+    uint32_t count = 0;
+    AAPLV2WorkerMessageHeader header{};
+    // every request fits in the request buffer, as larger ones are rejected at schedule.
+    while (count < maxRequests && worker->requests.peek(&header, 0, sizeof(header))) {
+        if (!worker->requests.peek(worker->request, sizeof(header), header.size))
+            break;
+        worker->requests.skip(sizeof(header) + header.size);
+
+        zix_sem_wait(&jalv->work_lock);
+        auto workStart = aap_lv2_monotonic_ns();
+        worker->stats.latencies[AAP_LV2_WORKER_LATENCY_SCHEDULE_TO_WORK].record(workStart - header.timestamp_ns);
+        worker->iface->work(
+                jalv->instance->lv2_handle, jalv_worker_respond, worker, header.size, worker->request);
+        worker->stats.latencies[AAP_LV2_WORKER_LATENCY_WORK].record(aap_lv2_monotonic_ns() - workStart);
+        zix_sem_post(&jalv->work_lock);
+        count++;
+    }
+    return count;
+}
+
+// Applies the scheduling policy, priority and CPU affinity to the calling thread.
+// Failures (e.g. real-time policies without the permission) are logged if `logFailures`, and the
+// current ones are kept. Returns false if anything failed.
+static bool
+jalv_worker_apply_thread_policy(const AAPLV2WorkerThreadPolicy& policy, bool logFailures = true)
+{
+    bool succeeded = true;
+    bool realtime = policy.sched_policy == SCHED_FIFO || policy.sched_policy == SCHED_RR;
+    if (policy.sched_policy >= 0) {
+        sched_param param{};
+        if (realtime)
+            param.sched_priority = policy.has_priority ? policy.priority : sched_get_priority_min(policy.sched_policy);
+        int ret = pthread_setschedparam(pthread_self(), policy.sched_policy, &param);
+        if (ret != 0) {
+            succeeded = false;
+            if (logFailures)
+                aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Failed to set the worker thread scheduling policy %d: %s",
+                             policy.sched_policy, strerror(ret));
+        }
+    }
+    // on Linux, the nice value is per thread.
+    if (policy.has_priority && !realtime &&
+        setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), policy.priority) != 0) {
+        succeeded = false;
+        if (logFailures)
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Failed to set the worker thread nice value %d: %s",
+                         policy.priority, strerror(errno));
+    }
+    if (policy.cpu_affinity != 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++)
+            if (policy.cpu_affinity & ((uint64_t) 1 << cpu))
+                CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            succeeded = false;
+            if (logFailures)
+                aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Failed to set the worker thread CPU affinity %llx: %s",
+                             (unsigned long long) policy.cpu_affinity, strerror(errno));
+        }
+    }
+    return succeeded;
+}
+
+// The scheduling of the calling thread as it is, with every field set.
+static AAPLV2WorkerThreadPolicy
+jalv_worker_get_thread_policy()
+{
+    AAPLV2WorkerThreadPolicy ret{};
+    int schedPolicy;
+    sched_param param{};
+    if (pthread_getschedparam(pthread_self(), &schedPolicy, &param) == 0)
+        ret.sched_policy = schedPolicy;
+    if (ret.sched_policy == SCHED_FIFO || ret.sched_policy == SCHED_RR)
+        ret.priority = param.sched_priority;
+    else
+        ret.priority = getpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid));
+    ret.has_priority = true;
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+        for (int cpu = 0; cpu < 64; cpu++)
+            if (CPU_ISSET(cpu, &cpus))
+                ret.cpu_affinity |= (uint64_t) 1 << cpu;
+    return ret;
+}
+
+// `policy`, with what it leaves to the default taken from `base`.
+static AAPLV2WorkerThreadPolicy
+jalv_worker_merge_thread_policy(const AAPLV2WorkerThreadPolicy& policy, const AAPLV2WorkerThreadPolicy& base)
+{
+    auto ret = base;
+    if (policy.sched_policy >= 0) {
+        ret.sched_policy = policy.sched_policy;
+        // the priority of another policy does not make sense for this one.
+        ret.has_priority = policy.has_priority;
+        ret.priority = policy.priority;
+    } else if (policy.has_priority) {
+        ret.has_priority = true;
+        ret.priority = policy.priority;
+    }
+    if (policy.cpu_affinity != 0)
+        ret.cpu_affinity = policy.cpu_affinity;
+    return ret;
+}
+
 static void*
 worker_func(void* data)
 {
     JalvWorker* worker = (JalvWorker*)data;
     Jalv*       jalv   = worker->ctx;
-    void*       buf    = NULL;
+    jalv_worker_apply_thread_policy(jalv->options.worker_thread_policy);
     while (true) {
         zix_sem_wait(&worker->sem);
         if (jalv->exit) {
             break;
         }
+        // a wakeup may be for more than one request (see jalv_worker_end_block()).
+        jalv_worker_run_requests(worker, UINT32_MAX);
+    }
 
-        uint32_t size = 0;
-        zix_ring_read(worker->requests, (char*)&size, sizeof(size));
+    return NULL;
+}
 
-        if (!(buf = realloc(buf, size))) {
-            fprintf(stderr, "error: realloc() failed\n");
-            free(buf);
-            return NULL;
-        }
+// Worker pool
 
-        zix_ring_read(worker->requests, (char*)buf, size);
+static std::mutex worker_pool_lock{};
+static AAPLV2WorkerPool* worker_pool{nullptr};
 
-        zix_sem_wait(&jalv->work_lock);
-        worker->iface->work(
-                jalv->instance->lv2_handle, jalv_worker_respond, worker, size, buf);
-        zix_sem_post(&jalv->work_lock);
+// Takes a worker that has requests and is not taken by another pool thread, starting from `cursor`
+// (so that the instances are served in turn).
+static JalvWorker*
+worker_pool_claim(AAPLV2WorkerPool* pool, size_t& cursor)
+{
+    std::lock_guard<std::mutex> guard{pool->lock};
+    auto numWorkers = pool->workers.size();
+    for (size_t n = 0; n < numWorkers; n++) {
+        auto index = (cursor + n) % numWorkers;
+        auto worker = pool->workers[index];
+        if (worker->requests.readSpace() == 0)
+            continue;
+        bool expected = false;
+        if (worker->busy.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            cursor = index + 1;
+            return worker;
+        }
     }
+    return nullptr;
+}
 
-    free(buf);
+static void*
+worker_pool_func(void* data)
+{
+    auto pool = (AAPLV2WorkerPool*) data;
+    auto maxRequests = pool->policy == AAP_LV2_WORKER_POOL_POLICY_DRAIN ? UINT32_MAX : 1;
+    size_t cursor = 0;
+    // The thread runs the requests of each instance with the scheduling of the instance, and what
+    // an instance leaves to the default is what the thread started with.
+    auto base = jalv_worker_get_thread_policy();
+    auto current = base;
+    bool policyFailureLogged = false;
+    while (true) {
+        zix_sem_wait(&pool->sem);
+        if (pool->exit)
+            break;
+        // Keep going until there is nothing to claim. Requests that arrive while another thread holds
+        // the worker are picked up by that thread, as it looks for work again after releasing it.
+        while (auto worker = worker_pool_claim(pool, cursor)) {
+            auto policy = jalv_worker_merge_thread_policy(worker->ctx->options.worker_thread_policy, base);
+            if (!(policy == current)) {
+                // (log only once, as it would fail every time the thread switches to the instance.)
+                if (!jalv_worker_apply_thread_policy(policy, !policyFailureLogged))
+                    policyFailureLogged = true;
+                current = policy;
+            }
+            jalv_worker_run_requests(worker, maxRequests);
+            worker->busy.store(false, std::memory_order_release);
+        }
+    }
     return NULL;
 }
 
+static AAPLV2WorkerPool*
+worker_pool_acquire(const AAPLV2Options& options)
+{
+    std::lock_guard<std::mutex> guard{worker_pool_lock};
+    if (worker_pool) {
+        worker_pool->ref_count++;
+        return worker_pool;
+    }
+    auto pool = new AAPLV2WorkerPool();
+    pool->policy = options.worker_pool_policy;
+    if (zix_sem_init(&pool->sem, 0)) {
+        delete pool;
+        return nullptr;
+    }
+    for (int32_t i = 0; i < options.worker_pool_size; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, AAP_LV2_WORKER_STACK_SIZE);
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, worker_pool_func, pool) == 0)
+            pool->threads.emplace_back(thread);
+        pthread_attr_destroy(&attr);
+    }
+    if (pool->threads.empty()) {
+        zix_sem_destroy(&pool->sem);
+        delete pool;
+        return nullptr;
+    }
+    aap::a_log_f(AAP_LOG_LEVEL_INFO, AAP_LV2_TAG, "Started LV2 worker pool with %d threads.", (int32_t) pool->threads.size());
+    pool->ref_count = 1;
+    worker_pool = pool;
+    return pool;
+}
+
+static void
+worker_pool_release(AAPLV2WorkerPool* pool)
+{
+    std::lock_guard<std::mutex> guard{worker_pool_lock};
+    if (--pool->ref_count > 0)
+        return;
+    worker_pool = nullptr;
+    pool->exit = true;
+    for (size_t i = 0; i < pool->threads.size(); i++)
+        zix_sem_post(&pool->sem);
+    for (auto thread : pool->threads)
+        pthread_join(thread, NULL);
+    zix_sem_destroy(&pool->sem);
+    delete pool;
+}
+
+static bool
+jalv_worker_start_thread(JalvWorker* worker)
+{
+    auto &options = worker->ctx->options;
+    if (options.worker_pool_size > 0) {
+        auto pool = worker_pool_acquire(options);
+        if (pool) {
+            std::lock_guard<std::mutex> guard{pool->lock};
+            pool->workers.emplace_back(worker);
+            worker->pool = pool;
+            return true;
+        }
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Failed to start the LV2 worker pool. Using a worker thread for the instance.");
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, AAP_LV2_WORKER_STACK_SIZE);
+    int ret = pthread_create(&worker->thread, &attr, worker_func, worker);
+    pthread_attr_destroy(&attr);
+    return ret == 0;
+}
+
+static void
+jalv_worker_wakeup(JalvWorker* worker)
+{
+    zix_sem_post(worker->pool ? &worker->pool->sem : &worker->sem);
+}
+
+void
+jalv_worker_begin_block(JalvWorker* worker)
+{
+    worker->in_block.store(true, std::memory_order_relaxed);
+}
+
 void
-jalv_worker_init(Jalv*                       ZIX_UNUSED(jalv),
+jalv_worker_end_block(JalvWorker* worker)
+{
+    worker->in_block.store(false, std::memory_order_relaxed);
+    if (worker->wakeup_pending.exchange(false, std::memory_order_relaxed))
+        jalv_worker_wakeup(worker);
+}
+
+bool
+jalv_worker_init(Jalv*                       jalv,
                  JalvWorker*                 worker,
                  const LV2_Worker_Interface* iface,
                  bool                        threaded)
 {
+    auto &options = jalv->options;
     worker->iface = iface;
-    worker->threaded = threaded;
+    worker->max_message_size = options.worker_max_message_size;
+    // a ring has to be able to hold at least two messages of the maximum size.
+    auto ringSize = std::max(options.worker_ring_size,
+                             (uint32_t) (sizeof(AAPLV2WorkerMessageHeader) + options.worker_max_message_size) * 2);
+    if (!worker->responses.allocate(ringSize) || !(worker->response = calloc(worker->max_message_size, 1)))
+        return false;
     if (threaded) {
-        zix_thread_create(&worker->thread, 4096, worker_func, worker);
-        worker->requests = zix_ring_new(4096);
-        zix_ring_mlock(worker->requests);
+        if (!worker->requests.allocate(ringSize) || !(worker->request = calloc(worker->max_message_size, 1)))
+            return false;
+        if (!jalv_worker_start_thread(worker))
+            return false;
     }
-    worker->responses = zix_ring_new(4096);
-    worker->response  = malloc(4096);
-    zix_ring_mlock(worker->responses);
+    worker->threaded = threaded;
+    return true;
 }
 
 void
 jalv_worker_finish(JalvWorker* worker)
 {
-    if (worker->threaded) {
+    if (worker->threaded && worker->pool) {
+        auto pool = worker->pool;
+        {
+            std::lock_guard<std::mutex> guard{pool->lock};
+            pool->workers.erase(std::find(pool->workers.begin(), pool->workers.end(), worker));
+        }
+        // no pool thread can claim it anymore, but one may be still running its requests.
+        while (worker->busy.load(std::memory_order_acquire))
+            usleep(1000);
+        worker->pool = nullptr;
+        worker_pool_release(pool);
+        worker->threaded = false;
+    } else if (worker->threaded) {
         zix_sem_post(&worker->sem);
-        zix_thread_join(worker->thread, NULL);
+        pthread_join(worker->thread, NULL);
+        worker->threaded = false;
     }
 }
 
 void
 jalv_worker_destroy(JalvWorker* worker)
 {
-    if (worker->requests) {
-        if (worker->threaded) {
-            zix_ring_free(worker->requests);
-        }
-        zix_ring_free(worker->responses);
-        free(worker->response);
-    }
+    worker->requests.release();
+    worker->responses.release();
+    free(worker->request);
+    worker->request = nullptr;
+    free(worker->response);
+    worker->response = nullptr;
 }
 
 LV2_Worker_Status
@@ -145,154 +435,722 @@ jalv_worker_schedule(LV2_Worker_Schedule_Handle handle,
 {
     JalvWorker* worker = (JalvWorker*)handle;
     Jalv*       jalv   = worker->ctx;
+    if (!worker->iface)
+        return LV2_WORKER_ERR_UNKNOWN;
     if (worker->threaded) {
         // Schedule a request to be executed by the worker thread
-        zix_ring_write(worker->requests, (const char*)&size, sizeof(size));
-        zix_ring_write(worker->requests, (const char*)data, size);
-        zix_sem_post(&worker->sem);
+        auto ret = jalv_worker_write_message(worker, worker->requests, size, data);
+        if (ret != LV2_WORKER_SUCCESS) {
+            worker->stats.rejected_requests++;
+            return ret;
+        }
+        worker->stats.requests++;
+        update_high_water_mark(worker->stats.max_request_queue_bytes, worker->requests.readSpace());
+        // within process(), the wakeup is batched at the end of the block.
+        if (worker->in_block.load(std::memory_order_relaxed))
+            worker->wakeup_pending.store(true, std::memory_order_relaxed);
+        else
+            jalv_worker_wakeup(worker);
     } else {
         // Execute work immediately in this thread
+        worker->stats.requests++;
         zix_sem_wait(&jalv->work_lock);
+        auto workStart = aap_lv2_monotonic_ns();
         worker->iface->work(
                 jalv->instance->lv2_handle, jalv_worker_respond, worker, size, data);
+        worker->stats.latencies[AAP_LV2_WORKER_LATENCY_WORK].record(aap_lv2_monotonic_ns() - workStart);
         zix_sem_post(&jalv->work_lock);
     }
     return LV2_WORKER_SUCCESS;
 }
 
-void
-jalv_worker_emit_responses(JalvWorker* worker, LilvInstance* instance)
+uint32_t
+jalv_worker_emit_responses(JalvWorker* worker, LilvInstance* instance, int64_t deadlineNs)
 {
-    if (worker->responses) {
-        uint32_t read_space = zix_ring_read_space(worker->responses);
-        while (read_space) {
-            uint32_t size = 0;
-            zix_ring_read(worker->responses, (char*)&size, sizeof(size));
+    if (!worker->iface || !worker->response)
+        return 0;
+    AAPLV2WorkerMessageHeader header{};
+    bool first = true;
+    uint32_t count = 0;
+    while (worker->responses.peek(&header, 0, sizeof(header))) {
+        int64_t now = aap_lv2_monotonic_ns();
+        if (!first && deadlineNs > 0 && now >= deadlineNs) {
+            worker->stats.deferred_response_blocks++;
+            break;
+        }
+        first = false;
+        if (!worker->responses.peek(worker->response, sizeof(header), header.size))
+            break;
+        worker->responses.skip(sizeof(header) + header.size);
+
+        worker->stats.responses++;
+        worker->stats.latencies[AAP_LV2_WORKER_LATENCY_RESPONSE].record(now - header.timestamp_ns);
+
+        worker->iface->work_response(
+                instance->lv2_handle, header.size, worker->response);
+        count++;
+    }
+    return count;
+}
 
-            zix_ring_read(worker->responses, (char*)worker->response, size);
+static void
+jalv_worker_summarize_latency(const AAPLV2LatencyHistogram& histogram, aap_lv2_latency_summary_t* result)
+{
+    result->count = histogram.count();
+    result->mean_ns = histogram.meanNs();
+    result->p50_ns = histogram.percentileNs(50);
+    result->p90_ns = histogram.percentileNs(90);
+    result->p99_ns = histogram.percentileNs(99);
+    result->p999_ns = histogram.percentileNs(99.9);
+    result->max_ns = histogram.maxNs();
+}
 
-            worker->iface->work_response(
-                    instance->lv2_handle, size, worker->response);
+void
+jalv_worker_get_statistics(JalvWorker* worker, aap_lv2_worker_statistics_t* result)
+{
+    auto &stats = worker->stats;
+    result->requests = stats.requests.load();
+    result->responses = stats.responses.load();
+    result->rejected_requests = stats.rejected_requests.load();
+    result->rejected_responses = stats.rejected_responses.load();
+    result->deferred_response_blocks = stats.deferred_response_blocks.load();
+    result->max_request_queue_bytes = stats.max_request_queue_bytes.load();
+    result->max_response_queue_bytes = stats.max_response_queue_bytes.load();
+    for (int i = 0; i < AAP_LV2_WORKER_NUM_LATENCY_KINDS; i++)
+        jalv_worker_summarize_latency(stats.latencies[i], &result->latencies[i]);
+}
 
-            read_space -= sizeof(size) + size;
-        }
+void
+jalv_worker_report(Jalv* ctx, JalvWorker* worker, const char* name)
+{
+    aap_lv2_worker_statistics_t stats{};
+    jalv_worker_get_statistics(worker, &stats);
+    if (stats.rejected_requests > 0 || stats.rejected_responses > 0)
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: %s rejected %llu requests and %llu responses as they did not fit (max message size: %u).",
+                     ctx->aap_plugin_id.c_str(), name, (unsigned long long) stats.rejected_requests,
+                     (unsigned long long) stats.rejected_responses, worker->max_message_size);
+    if (stats.requests == 0)
+        return;
+    aap::a_log_f(AAP_LOG_LEVEL_DEBUG, AAP_LV2_TAG, "LV2 plugin %s: %s: %llu requests, %llu responses, %llu deferred blocks, max. queue %u/%u bytes.",
+                 ctx->aap_plugin_id.c_str(), name, (unsigned long long) stats.requests,
+                 (unsigned long long) stats.responses, (unsigned long long) stats.deferred_response_blocks,
+                 stats.max_request_queue_bytes, stats.max_response_queue_bytes);
+    const char* latencyNames[] {"schedule to work", "work", "response"};
+    for (int i = 0; i < AAP_LV2_WORKER_NUM_LATENCY_KINDS; i++) {
+        auto &l = stats.latencies[i];
+        if (l.count > 0)
+            aap::a_log_f(AAP_LOG_LEVEL_DEBUG, AAP_LV2_TAG, "LV2 plugin %s: %s %s latency (us): mean %llu, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu",
+                         ctx->aap_plugin_id.c_str(), name, latencyNames[i],
+                         (unsigned long long) l.mean_ns / 1000, (unsigned long long) l.p50_ns / 1000,
+                         (unsigned long long) l.p90_ns / 1000, (unsigned long long) l.p99_ns / 1000,
+                         (unsigned long long) l.p999_ns / 1000, (unsigned long long) l.max_ns / 1000);
     }
 }
 // end of jalv worker code.
 
 // State extension
 
+// Returns the value of the ControlPort (lilv asks for the input ControlPorts only), which is the
+// default value until prepare() allocates the ControlPort values.
 const void* aap_lv2_get_port_value(
         const char* port_symbol, void* user_data, uint32_t* size, uint32_t* type)
 {
     auto l = (AAPLV2PluginContext *) user_data;
-    auto uri = lilv_new_string(l->world, port_symbol);
-    auto port = lilv_plugin_get_port_by_symbol(l->plugin, uri);
-    lilv_node_free(uri);
-    int index = lilv_port_get_index(l->plugin, port);
-
-    // FIXME: preserve buffer in context, and retrieve from there.
-    auto data = l->cached_buffer->get_buffer(l->cached_buffer, index);
-
-    // FIXME: implement correctly
+    auto index = l->getPortIndexForSymbol(port_symbol);
+    if (index < 0 || !aap_lv2_port_is(l->descriptor, (uint32_t) index, AAP_LV2_DESCRIPTOR_PORT_CONTROL)) {
+        *size = 0;
+        *type = 0;
+        return nullptr;
+    }
     *size = sizeof(float);
     *type = l->urids.urid_atom_float_type;
-    return data;
+    if (!l->control_buffer_pointers)
+        return &l->descriptor->port((uint32_t) index)->default_value;
+    return &l->control_buffer_pointers[index];
+}
+
+// Restore pipeline
+
+// The destination of the ControlPort values in lilv_state_restore().
+struct AAPLV2StagingTarget {
+    AAPLV2PluginContext *ctx;
+    AAPLV2StagedPortValues *slot;
+};
+
+static inline void aap_lv2_stage_port_value(AAPLV2StagedPortValues* slot, uint32_t port, float value) {
+    slot->values[port] = value;
+    slot->mask[port / 64] |= (uint64_t) 1 << (port % 64);
 }
 
+// Converts a port value in a state to float, as jalv does. Returns false for any other type.
+static bool aap_lv2_port_value_to_float(const AAPLV2URIDs& urids, const void* value, uint32_t size, uint32_t type, float* result) {
+    if (type == urids.urid_atom_float_type && size == sizeof(float))
+        memcpy(result, value, sizeof(float));
+    else if (type == urids.urid_atom_double_type && size == sizeof(double)) {
+        double d;
+        memcpy(&d, value, sizeof(double));
+        *result = (float) d;
+    } else if (type == urids.urid_atom_int_type && size == sizeof(int32_t)) {
+        int32_t i;
+        memcpy(&i, value, sizeof(int32_t));
+        *result = (float) i;
+    } else if (type == urids.urid_atom_long_type && size == sizeof(int64_t)) {
+        int64_t l;
+        memcpy(&l, value, sizeof(int64_t));
+        *result = (float) l;
+    } else if (type == urids.urid_atom_bool_type && size == sizeof(int32_t)) {
+        int32_t b;
+        memcpy(&b, value, sizeof(int32_t));
+        *result = b != 0 ? 1.0f : 0.0f;
+    } else
+        return false;
+    return true;
+}
+
+// Stages the value into the slot, instead of writing to the port (see aap_lv2_restore()).
 void aap_lv2_set_port_value(
         const char* port_symbol, void* user_data, const void* value, uint32_t size, uint32_t type)
 {
-    auto l = (AAPLV2PluginContext *) user_data;
+    auto target = (AAPLV2StagingTarget *) user_data;
+    auto l = target->ctx;
     assert(l->instance_state != AAP_LV2_INSTANCE_STATE_INITIAL); // must be at prepared or later.
 
-    auto uri = lilv_new_string(l->world, port_symbol);
-    auto port = lilv_plugin_get_port_by_symbol(l->plugin, uri);
-    auto lv2Port = lilv_port_get_index(l->plugin, port);
-    if (lv2Port >= 0) {
-        auto aapPort = l->mappings.lv2_to_aap_portmap[(int32_t) lv2Port];
-        if (aapPort >= 0) {
-            auto data = l->cached_buffer->get_buffer(l->cached_buffer, aapPort);
-            memcpy(data, value, size);
-        } else {
-            // it is hopefully a float ControlPort...
-            // also note: https://github.com/atsushieno/aap-lv2/issues/7
-            auto data = l->control_buffer_pointers + lv2Port;
-            memcpy(data, value, size);
+    int32_t lv2Port = l->getPortIndexForSymbol(port_symbol);
+    auto &routes = l->mappings.routes;
+    // also note: https://github.com/atsushieno/aap-lv2/issues/7
+    if (lv2Port < 0 || lv2Port >= (int32_t) routes.size() || routes[lv2Port].kind != AAP_LV2_PORT_ROUTE_CONTROL) {
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "State contains invalid LV2 port specifier: %s", port_symbol);
+        return;
+    }
+    float floatValue;
+    if (!aap_lv2_port_value_to_float(l->urids, value, size, type, &floatValue)) {
+        auto unmap = &l->features.urid_unmap_feature_data;
+        auto typeUri = unmap->unmap(unmap->handle, type);
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "State value for LV2 port %s has an unsupported type: %s",
+                     port_symbol, typeUri ? typeUri : "(unknown)");
+        return;
+    }
+    aap_lv2_stage_port_value(target->slot, (uint32_t) lv2Port, floatValue);
+}
+
+// Withdraws the slot from the audio thread if it is published and not committed yet, and notifies
+// the completion of its restore as superseded. The caller must hold the restore lock.
+static void aap_lv2_retract_restore_slot(AAPLV2StateRestore& restore, int32_t slotIndex) {
+    int32_t expected = AAP_LV2_RESTORE_SLOT_PUBLISHED;
+    if (!restore.slot_states[slotIndex].compare_exchange_strong(expected, AAP_LV2_RESTORE_SLOT_FREE, std::memory_order_acquire))
+        return;
+    auto completion = restore.slots[slotIndex].completion;
+    restore.slots[slotIndex].completion = {};
+    completion.notify(false, aap_lv2_monotonic_ns());
+}
+
+// Restores a state off the audio thread: `restoreInstance` restores the plugin's own state (by
+// its restore()) on the calling thread, and the ControlPort values are staged into a slot that
+// process() commits at the beginning of the next block. It does not wait for the commit: process()
+// notifies `completion` when it commits the values (or the calling thread does, if the instance is
+// not active, if the restore fails, or if a later restore supersedes it before the commit).
+// For plugins with threadSafeRestore, restore() runs alongside run() (and any work it schedules
+// runs on the state worker, with the responses delivered at the block boundary). For the others,
+// run() is skipped while restore() is running.
+// If `restoresInstance` is false, `restoreInstance` only stages ControlPort values (without the
+// features), and it does not hold the instance at all.
+static void aap_lv2_restore(AAPLV2PluginContext* ctx,
+                            const std::function<void(AAPLV2StagingTarget*, const LV2_Feature* const*)>& restoreInstance,
+                            bool restoresInstance, const AAPLV2RestoreCompletion& completion) {
+    auto &restore = ctx->state_restore;
+    std::unique_lock<std::mutex> restoreGuard{restore.lock};
+    // (the audio thread holds the slot or the instance only for a block, so it is an error to wait longer.)
+    auto deadline = aap_lv2_monotonic_ns() + (int64_t) AAP_LV2_RESTORE_COMMIT_TIMEOUT_MSEC * 1000000;
+    auto fail = [&](const char* what) {
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s: %s was not released in %d msec. The state is not restored.",
+                     ctx->aap_plugin_id.c_str(), what, AAP_LV2_RESTORE_COMMIT_TIMEOUT_MSEC);
+        completion.notify(false, aap_lv2_monotonic_ns());
+    };
+
+    // take the slot (retracting it from the audio thread, if it has not been committed yet).
+    auto slotIndex = restore.next_slot;
+    auto &slotState = restore.slot_states[slotIndex];
+    while (true) {
+        aap_lv2_retract_restore_slot(restore, slotIndex);
+        int32_t expected = AAP_LV2_RESTORE_SLOT_FREE;
+        if (slotState.compare_exchange_strong(expected, AAP_LV2_RESTORE_SLOT_WRITING, std::memory_order_acquire))
+            break;
+        if (aap_lv2_monotonic_ns() >= deadline) {
+            fail("the restore slot");
+            return;
         }
+        usleep(100);
     }
-    else
-        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "State contains invalid LV2 port specifier: %s", lilv_node_as_uri(uri));
-    lilv_node_free(uri);
+    auto &slot = restore.slots[slotIndex];
+    auto numPorts = ctx->descriptor->numPorts();
+    slot.values.assign(numPorts, 0);
+    slot.mask.assign((numPorts + 63) / 64, 0);
+
+    AAPLV2StagingTarget target{ctx, &slot};
+    if (!restoresInstance)
+        restoreInstance(&target, nullptr);
+    else {
+        std::lock_guard<std::mutex> instanceGuard{restore.instance_lock};
+        auto features = ctx->stateFeaturesList();
+        bool exclusive = !ctx->safe_restore;
+        if (exclusive) {
+            // wait for the ongoing run() to finish. process() skips run() until we release it.
+            int32_t owner = AAP_LV2_INSTANCE_OWNER_NONE;
+            while (!restore.instance_owner.compare_exchange_weak(owner, AAP_LV2_INSTANCE_OWNER_RESTORE,
+                                                                 std::memory_order_acquire)) {
+                owner = AAP_LV2_INSTANCE_OWNER_NONE;
+                if (aap_lv2_monotonic_ns() >= deadline) {
+                    slotState.store(AAP_LV2_RESTORE_SLOT_FREE, std::memory_order_release);
+                    fail("the instance");
+                    return;
+                }
+                usleep(100);
+            }
+        }
+        restoreInstance(&target, features.get());
+        if (exclusive)
+            restore.instance_owner.store(AAP_LV2_INSTANCE_OWNER_NONE, std::memory_order_release);
+    }
+
+    slot.completion = completion;
+    slotState.store(AAP_LV2_RESTORE_SLOT_PUBLISHED, std::memory_order_release);
+    restore.published_slot.store(slotIndex, std::memory_order_release);
+    restore.next_slot = 1 - slotIndex;
+    // the other slot is not going to be committed anymore.
+    aap_lv2_retract_restore_slot(restore, 1 - slotIndex);
+
+    // without process(), nobody else commits it.
+    if (ctx->instance_state != AAP_LV2_INSTANCE_STATE_ACTIVE)
+        commitRestoredPortValues(ctx);
+}
+
+void aap_lv2_report_restores(AAPLV2PluginContext* ctx) {
+    auto &restore = ctx->state_restore;
+    auto uncommitted = restore.uncommitted.load(std::memory_order_relaxed);
+    if (uncommitted > 0)
+        aap::a_log_f(AAP_LOG_LEVEL_DEBUG, AAP_LV2_TAG, "LV2 plugin %s: %llu restores failed or were superseded before they were committed.",
+                     ctx->aap_plugin_id.c_str(), (unsigned long long) uncommitted);
+    aap_lv2_latency_summary_t l{};
+    jalv_worker_summarize_latency(restore.latency, &l);
+    if (l.count > 0)
+        aap::a_log_f(AAP_LOG_LEVEL_DEBUG, AAP_LV2_TAG, "LV2 plugin %s: %llu restores committed, latency (us): mean %llu, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu",
+                     ctx->aap_plugin_id.c_str(), (unsigned long long) l.count,
+                     (unsigned long long) l.mean_ns / 1000, (unsigned long long) l.p50_ns / 1000,
+                     (unsigned long long) l.p90_ns / 1000, (unsigned long long) l.p99_ns / 1000,
+                     (unsigned long long) l.p999_ns / 1000, (unsigned long long) l.max_ns / 1000);
+}
+
+static void aap_lv2_restore_lilv_state(AAPLV2PluginContext* ctx, LilvState* state, const AAPLV2RestoreCompletion& completion) {
+    aap_lv2_restore(ctx, [&](AAPLV2StagingTarget* target, const LV2_Feature* const* features) {
+        lilv_state_restore(state, ctx->instance, aap_lv2_set_port_value, target, 0, features);
+    }, true, completion);
+}
+
+// Binary state (see aap-lv2-binary-state.h)
+
+struct AAPLV2BinaryStateStore {
+    AAPLV2PluginContext *ctx;
+    AAPLV2BinaryStateWriter *writer;
+    // a value had URIDs that could not be rewritten (then the state has to be saved as Turtle).
+    bool failed{false};
+};
+
+static LV2_State_Status aap_lv2_binary_state_store(LV2_State_Handle handle, uint32_t key, const void* value,
+                                                   size_t size, uint32_t type, uint32_t flags) {
+    auto store = (AAPLV2BinaryStateStore *) handle;
+    // like lilv, only plain old data can be stored (a state may be loaded by another process).
+    if (!(flags & LV2_STATE_IS_POD))
+        return LV2_STATE_ERR_BAD_FLAGS;
+    auto unmap = &store->ctx->features.urid_unmap_feature_data;
+    auto keyUri = unmap->unmap(unmap->handle, key);
+    auto typeUri = unmap->unmap(unmap->handle, type);
+    if (!keyUri || !typeUri)
+        return LV2_STATE_ERR_BAD_TYPE;
+    if (size > UINT32_MAX)
+        return LV2_STATE_ERR_NO_SPACE;
+    // URIDs in the value are stored as their URIs.
+    if (!store->writer->addPropertyWithUrids(keyUri, typeUri, flags, value, (uint32_t) size,
+                                             [unmap](uint32_t urid) { return unmap->unmap(unmap->handle, urid); })) {
+        store->failed = true;
+        return LV2_STATE_ERR_BAD_TYPE;
+    }
+    return LV2_STATE_SUCCESS;
+}
+
+// Captures the input ControlPort values and the plugin's own state (by its save()). Returns false
+// if a property could not be stored in the binary format.
+static bool aap_lv2_save_binary_state(AAPLV2PluginContext* ctx, AAPLV2BinaryStateWriter& writer) {
+    auto descriptor = ctx->descriptor;
+    for (uint32_t p = 0; p < descriptor->numPorts(); p++) {
+        if (!aap_lv2_port_is(descriptor, p, AAP_LV2_DESCRIPTOR_PORT_CONTROL | AAP_LV2_DESCRIPTOR_PORT_INPUT))
+            continue;
+        auto port = descriptor->port(p);
+        auto value = ctx->control_buffer_pointers ? ctx->control_buffer_pointers[p] : port->default_value;
+        writer.addPort(descriptor->string(port->symbol), value);
+    }
+    auto iface = (const LV2_State_Interface *) lilv_instance_get_extension_data(ctx->instance, LV2_STATE__interface);
+    if (!iface || !iface->save)
+        return true;
+    AAPLV2BinaryStateStore store{ctx, &writer};
+    auto features = ctx->stateFeaturesList();
+    auto status = iface->save(lilv_instance_get_handle(ctx->instance), aap_lv2_binary_state_store, &store,
+                              LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE, features.get());
+    if (status != LV2_STATE_SUCCESS)
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: save() returned %d.", ctx->aap_plugin_id.c_str(), status);
+    return !store.failed;
+}
+
+struct AAPLV2BinaryStateRetrieve {
+    const AAPLV2BinaryState *state;
+    // (key URID, property index), sorted by URID.
+    std::vector<std::pair<LV2_URID, uint32_t>> keys{};
+    LV2_URID_Map *map;
+    // the values whose URIDs were mapped in this process. They have to stay until restore() returns.
+    std::list<std::vector<uint8_t>> mapped_values{};
+};
+
+static const void* aap_lv2_binary_state_retrieve(LV2_State_Handle handle, uint32_t key, size_t* size,
+                                                 uint32_t* type, uint32_t* flags) {
+    auto retrieve = (AAPLV2BinaryStateRetrieve *) handle;
+    auto &keys = retrieve->keys;
+    auto it = std::lower_bound(keys.begin(), keys.end(), std::pair<LV2_URID, uint32_t>{key, 0});
+    if (it == keys.end() || it->first != key)
+        return nullptr;
+    auto state = retrieve->state;
+    auto property = state->property(it->second);
+    auto map = retrieve->map;
+    const void* value = state->value(property);
+    if (property->flags & AAP_LV2_BINARY_STATE_PROPERTY_URIDS) {
+        auto &mapped = retrieve->mapped_values.emplace_back();
+        if (!state->copyValue(property, mapped, [map](const char* uri) { return map->map(map->handle, uri); })) {
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "The value of state property %s is malformed.", state->string(property->key));
+            return nullptr;
+        }
+        value = mapped.data();
+    }
+    *size = property->size;
+    *type = map->map(map->handle, state->string(property->type));
+    *flags = property->flags & ~AAP_LV2_BINARY_STATE_PROPERTY_FLAGS;
+    return value;
 }
 
+// The binary counterpart of lilv_state_restore(). `state` must have been validated.
+static void aap_lv2_restore_binary_state(AAPLV2PluginContext* ctx, const AAPLV2BinaryState& state,
+                                         AAPLV2StagingTarget* target, const LV2_Feature* const* features) {
+    auto iface = (const LV2_State_Interface *) lilv_instance_get_extension_data(ctx->instance, LV2_STATE__interface);
+    if (iface && iface->restore) {
+        AAPLV2BinaryStateRetrieve retrieve{&state, {}, &ctx->features.urid_map_feature_data};
+        auto map = retrieve.map;
+        for (uint32_t i = 0; i < state.numProperties(); i++)
+            retrieve.keys.emplace_back(map->map(map->handle, state.string(state.property(i)->key)), i);
+        std::sort(retrieve.keys.begin(), retrieve.keys.end());
+        auto status = iface->restore(lilv_instance_get_handle(ctx->instance), aap_lv2_binary_state_retrieve,
+                                     &retrieve, 0, features);
+        if (status != LV2_STATE_SUCCESS)
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: restore() returned %d.", ctx->aap_plugin_id.c_str(), status);
+    }
+    for (uint32_t i = 0; i < state.numPorts(); i++) {
+        auto port = state.port(i);
+        float value = port->value;
+        aap_lv2_set_port_value(state.string(port->symbol), target, &value, sizeof(float), ctx->urids.urid_atom_float_type);
+    }
+}
+
+// Restores a validated binary state. A delta state is merged into the base that it is relative to,
+// which is the full state that was restored (or handed to the host) last. In delta mode, a restored
+// full state becomes the base.
+static void aap_lv2_restore_binary_state_data(AAPLV2PluginContext* ctx, const void* data, const AAPLV2RestoreCompletion& completion) {
+    AAPLV2BinaryState input{data};
+    auto &snapshot = ctx->state_snapshot;
+    std::vector<uint8_t> merged{};
+    if (input.isDelta()) {
+        std::lock_guard<std::mutex> guard{snapshot.lock};
+        if (snapshot.base.empty() || snapshot.base_id != input.header()->base_id) {
+            aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s: the base of the delta state has not been restored.", ctx->aap_plugin_id.c_str());
+            completion.notify(false, aap_lv2_monotonic_ns());
+            return;
+        }
+        AAPLV2BinaryStateWriter writer{};
+        aap_lv2_binary_state_merge(AAPLV2BinaryState{snapshot.base.data()}, input, writer);
+        merged.resize(writer.size());
+        writer.writeTo(merged.data());
+    }
+    AAPLV2BinaryState state{merged.empty() ? data : merged.data()};
+    aap_lv2_restore(ctx, [&](AAPLV2StagingTarget* target, const LV2_Feature* const* features) {
+        aap_lv2_restore_binary_state(ctx, state, target, features);
+    }, true, completion);
+
+    if (!input.isDelta() && ctx->options.state_delta) {
+        std::lock_guard<std::mutex> guard{snapshot.lock};
+        auto size = input.header()->total_size;
+        snapshot.base.assign((const uint8_t *) data, (const uint8_t *) data + size);
+        snapshot.base_id = aap_lv2_binary_state_hash(data, size);
+        snapshot.base_generation = snapshot.state_generation.load(std::memory_order_acquire);
+    }
+}
+
+static void aap_lv2_restore_state_data(AAPLV2PluginContext* ctx, aap_state_t* input, const AAPLV2RestoreCompletion& completion) {
+    if (aap_lv2_binary_state_has_magic(input->data, input->data_size)) {
+        std::vector<uint8_t> upgraded{};
+        if (aap_lv2_binary_state_validate(input->data, input->data_size))
+            aap_lv2_restore_binary_state_data(ctx, input->data, completion);
+        else if (aap_lv2_binary_state_upgrade(input->data, input->data_size, upgraded))
+            aap_lv2_restore_binary_state_data(ctx, upgraded.data(), completion);
+        else {
+            aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s: the binary state is corrupt or of an unsupported version.", ctx->aap_plugin_id.c_str());
+            completion.notify(false, aap_lv2_monotonic_ns());
+        }
+        return;
+    }
+
+    LilvState *state;
+    {
+        std::lock_guard<std::recursive_mutex> worldGuard{ctx->shared_world->lock};
+        std::string stateString{(const char*) input->data, input->data_size};
+        state = lilv_state_new_from_string(ctx->world, &ctx->features.urid_map_feature_data, stateString.c_str());
+    }
+    if (state) {
+        aap_lv2_restore_lilv_state(ctx, state, completion);
+        lilv_state_free(state);
+    } else {
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s: failed to parse the state.", ctx->aap_plugin_id.c_str());
+        completion.notify(false, aap_lv2_monotonic_ns());
+    }
+}
+
+// Compares the values of the properties of the same size and type. Rewritten URIDs refer to the string
+// table of each state, so such values are compared as mapped in this process.
+static bool aap_lv2_binary_state_values_equal(AAPLV2PluginContext* ctx, const AAPLV2BinaryState& a, const aap_lv2_binary_state_property_t* pa,
+                                              const AAPLV2BinaryState& b, const aap_lv2_binary_state_property_t* pb) {
+    if (!(pa->flags & AAP_LV2_BINARY_STATE_PROPERTY_URIDS))
+        return !memcmp(a.value(pa), b.value(pb), pa->size);
+    auto map = &ctx->features.urid_map_feature_data;
+    auto mapUri = [map](const char* uri) { return map->map(map->handle, uri); };
+    std::vector<uint8_t> va{}, vb{};
+    return a.copyValue(pa, va, mapUri) && b.copyValue(pb, vb, mapUri) && va == vb;
+}
+
+// Builds the delta state from the base to `full` (the current state): the input ControlPorts that
+// changed since the base was captured, and the properties whose type, flags or bytes differ.
+static void aap_lv2_diff_binary_state(AAPLV2PluginContext* ctx, const AAPLV2BinaryState& full, AAPLV2BinaryStateWriter& delta) {
+    auto &snapshot = ctx->state_snapshot;
+    AAPLV2BinaryState base{snapshot.base.data()};
+    delta.setDelta(snapshot.base_id);
+
+    // (the ports are in the order aap_lv2_save_binary_state() wrote them.)
+    auto descriptor = ctx->descriptor;
+    uint32_t index = 0;
+    for (uint32_t p = 0; p < descriptor->numPorts() && index < full.numPorts(); p++) {
+        if (!aap_lv2_port_is(descriptor, p, AAP_LV2_DESCRIPTOR_PORT_CONTROL | AAP_LV2_DESCRIPTOR_PORT_INPUT))
+            continue;
+        auto port = full.port(index++);
+        if (snapshot.port_generations[p].load(std::memory_order_relaxed) > snapshot.base_generation)
+            delta.addPort(full.string(port->symbol), port->value);
+    }
+
+    std::map<std::string, uint32_t> baseProperties{};
+    for (uint32_t i = 0; i < base.numProperties(); i++)
+        baseProperties[base.string(base.property(i)->key)] = i;
+    for (uint32_t i = 0; i < full.numProperties(); i++) {
+        auto p = full.property(i);
+        auto key = full.string(p->key);
+        auto it = baseProperties.find(key);
+        if (it != baseProperties.end()) {
+            auto b = base.property(it->second);
+            bool same = b->size == p->size && b->flags == p->flags &&
+                        !strcmp(base.string(b->type), full.string(p->type)) &&
+                        aap_lv2_binary_state_values_equal(ctx, base, b, full, p);
+            baseProperties.erase(it);
+            if (same)
+                continue;
+        }
+        delta.addPropertyOf(full, p);
+    }
+    for (auto &removed : baseProperties)
+        delta.addRemovedProperty(removed.first.c_str());
+}
+
+// Serializes the current state into the snapshot, unless it already has the current one.
+// The caller must hold the snapshot lock.
+static void aap_lv2_capture_state(AAPLV2PluginContext* l) {
+    auto &snapshot = l->state_snapshot;
+    // (read before save(), so that a change during the capture makes the next call capture again.)
+    auto generation = snapshot.state_generation.load(std::memory_order_acquire);
+    if (snapshot.generation == generation)
+        return;
+
+    // (save() must not run at the same time as restore().)
+    std::lock_guard<std::mutex> instanceGuard{l->state_restore.instance_lock};
+    std::lock_guard<std::recursive_mutex> worldGuard{l->shared_world->lock};
+    snapshot.data_is_full = true;
+    AAPLV2BinaryStateWriter writer{};
+    bool binary = l->options.state_format == AAP_LV2_STATE_FORMAT_BINARY;
+    if (binary && !aap_lv2_save_binary_state(l, writer)) {
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: the state has values that cannot be saved in the binary format. Saving it as Turtle.",
+                     l->aap_plugin_id.c_str());
+        binary = false;
+    }
+    if (binary) {
+        snapshot.data.resize(writer.size());
+        writer.writeTo(snapshot.data.data());
+        // (the base may be a Turtle state too.)
+        if (l->options.state_delta && aap_lv2_binary_state_has_magic(snapshot.base.data(), snapshot.base.size())) {
+            AAPLV2BinaryStateWriter delta{};
+            aap_lv2_diff_binary_state(l, AAPLV2BinaryState{snapshot.data.data()}, delta);
+            // a large delta is compacted into the full state (which becomes the new base).
+            if (delta.size() < snapshot.data.size() * l->options.state_delta_compaction_ratio) {
+                snapshot.data.resize(delta.size());
+                delta.writeTo(snapshot.data.data());
+                snapshot.data_is_full = false;
+            }
+        }
+    } else {
+        auto features = l->stateFeaturesList();
+        LilvState *state = lilv_state_new_from_instance(l->plugin, l->instance, &l->features.urid_map_feature_data,
+                                                        nullptr, nullptr, nullptr, nullptr, aap_lv2_get_port_value, l, 0, features.get());
+        auto nameNode = lilv_plugin_get_name(l->plugin);
+        std::string stateUri{"urn:aap_state:"};
+        stateUri += lilv_node_as_string(nameNode);
+        lilv_node_free(nameNode);
+        auto stateString = lilv_state_to_string(l->world, &l->features.urid_map_feature_data, &l->features.urid_unmap_feature_data,
+                                                state, stateUri.c_str(), nullptr);
+        auto size = stateString ? strlen(stateString) : 0;
+        snapshot.data.assign((const uint8_t *) stateString, (const uint8_t *) stateString + size);
+        free(stateString);
+        lilv_state_free(state);
+    }
+    snapshot.generation = generation;
+}
+
+// The size of the snapshot that the following get_state() returns.
 size_t aap_lv2_get_state_size(aap_state_extension_t* ext, AndroidAudioPlugin* plugin) {
     auto l = (AAPLV2PluginContext *) plugin->plugin_specific;
-    auto features = l->stateFeaturesList();
-    LilvState *state = lilv_state_new_from_instance(l->plugin, l->instance, &l->features.urid_map_feature_data,
-                                                    nullptr, nullptr, nullptr, nullptr, aap_lv2_get_port_value, l, 0, features.get());
-    auto nameNode = lilv_plugin_get_name(l->plugin);
-    std::string stateUriBase{"urn:aap_state:"};
-    auto nameChars = lilv_node_as_string(nameNode);
-    std::string nameString{nameChars};
-    std::string stateUri = stateUriBase + nameString;
-    lilv_node_free(nameNode);
-    auto stateString = lilv_state_to_string(l->world, &l->features.urid_map_feature_data, &l->features.urid_unmap_feature_data,
-                                            state, stateUri.c_str(), nullptr);
-    auto ret = strlen(stateString);
-    lilv_state_delete(l->world, state);
-    return ret;
+    std::lock_guard<std::mutex> guard{l->state_snapshot.lock};
+    aap_lv2_capture_state(l);
+    return l->state_snapshot.data.size();
 }
 
+// Writes the snapshot that get_state_size() captured (even if the state has changed since then, so
+// that it fits) into the buffer that the host allocated for it, and releases it. Without a preceding
+// get_state_size(), the state is captured here, into a newly allocated buffer if the host did not pass one.
 void aap_lv2_get_state(aap_state_extension_t* ext, AndroidAudioPlugin* plugin, aap_state_t *result) {
     auto l = (AAPLV2PluginContext *) plugin->plugin_specific;
-    auto features = l->stateFeaturesList();
-    LilvState *state = lilv_state_new_from_instance(l->plugin, l->instance, &l->features.urid_map_feature_data,
-                                                    nullptr, nullptr, nullptr, nullptr, aap_lv2_get_port_value, l, 0, features.get());
-    auto nameNode = lilv_plugin_get_name(l->plugin);
-    std::string stateUriBase{"urn:aap_state:"};
-    auto nameChars = lilv_node_as_string(nameNode);
-    std::string nameString{nameChars};
-    std::string stateUri = stateUriBase + nameString;
-    lilv_node_free(nameNode);
-    auto stateString = lilv_state_to_string(l->world, &l->features.urid_map_feature_data, &l->features.urid_unmap_feature_data,
-                                            state, stateUri.c_str(), nullptr);
-    result->data = strdup(stateString);
-    result->data_size = strlen(stateString);
-    lilv_state_delete(l->world, state);
+    auto &snapshot = l->state_snapshot;
+    std::lock_guard<std::mutex> guard{snapshot.lock};
+    if (snapshot.generation == 0)
+        aap_lv2_capture_state(l);
+    auto size = snapshot.data.size();
+    if (!result->data)
+        result->data = malloc(size);
+    else if ((size_t) result->data_size < size) {
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s: the state (%zu bytes) does not fit in the buffer (%zu bytes).",
+                     l->aap_plugin_id.c_str(), size, (size_t) result->data_size);
+        result->data_size = 0;
+        return;
+    }
+    memcpy(result->data, snapshot.data.data(), size);
+    result->data_size = size;
+    if (l->options.state_delta && snapshot.data_is_full) {
+        // the following deltas are relative to this one.
+        snapshot.base.swap(snapshot.data);
+        snapshot.base_id = aap_lv2_binary_state_hash(snapshot.base.data(), snapshot.base.size());
+        snapshot.base_generation = snapshot.generation;
+    }
+    snapshot.release();
 }
 
+// It returns without waiting for process() to commit the ControlPort values (see aap_lv2_restore()).
 void aap_lv2_set_state(aap_state_extension_t* ext, AndroidAudioPlugin* plugin, aap_state_t *input) {
     auto l = (AAPLV2PluginContext *) plugin->plugin_specific;
-    LilvState *state = lilv_state_new_from_string(l->world, &l->features.urid_map_feature_data, (const char*) input->data);
-    auto features = l->stateFeaturesList();
-    lilv_state_restore(state, l->instance, aap_lv2_set_port_value, l, 0, features.get());
-    lilv_state_free(state);
-    l->markAllParameterValuesDirty();
+    aap_lv2_restore_state_data(l, input, AAPLV2RestoreCompletion{&l->state_restore, aap_lv2_monotonic_ns()});
 }
 
 // Presets extension
 
 int32_t aap_lv2_on_preset_loaded(Jalv* jalv, const LilvNode* node, const LilvNode* title, void* data) {
     auto name = lilv_node_as_string(title);
-    auto uridMap = &jalv->features.urid_map_feature_data;
-    auto uridUnmap = &jalv->features.urid_unmap_feature_data;
-    auto state = lilv_state_new_from_world(jalv->world, uridMap, node);
-    auto stateData = lilv_state_to_string(jalv->world, uridMap, uridUnmap, state, lilv_node_as_string(node), nullptr);
-
     aap_preset_t preset;
     preset.id = (int32_t) jalv->presets.size();
     strncpy(preset.name, name, AAP_PRESETS_EXTENSION_MAX_NAME_LENGTH);
-    jalv->presets.emplace_back(std::make_unique<AAPPresetAndLv2Binary>(preset, strdup(stateData)));
-    aap::a_log_f(AAP_LOG_LEVEL_DEBUG, "AAP-LV2", "aap_lv2_on_preset_loaded. %s: %s", name, lilv_node_as_string(node));
-    free(stateData);
-    lilv_state_free(state);
+    jalv->presets.emplace_back(std::make_unique<AAPLV2PresetIndexEntry>(preset, lilv_node_duplicate(node)));
     return 0;
 }
 
 void aap_lv2_ensure_preset_loaded(AAPLV2PluginContext *ctx) {
-    if (ctx->presets.size() == 0)
-        jalv_load_presets(ctx, aap_lv2_on_preset_loaded, nullptr);
+    std::lock_guard<std::recursive_mutex> worldGuard{ctx->shared_world->lock};
+    if (ctx->presets_indexed)
+        return;
+    auto startNs = aap_lv2_monotonic_ns();
+    jalv_load_presets(ctx, aap_lv2_on_preset_loaded, nullptr);
+    ctx->presets_indexed = true;
+    aap::a_log_f(AAP_LOG_LEVEL_DEBUG, AAP_LV2_TAG, "LV2 plugin %s: indexed %d presets in %lld usec.", ctx->aap_plugin_id.c_str(),
+                 (int32_t) ctx->presets.size(), (long long) (aap_lv2_monotonic_ns() - startNs) / 1000);
+}
+
+struct AAPLV2PresetCompiler {
+    AAPLV2PluginContext *ctx;
+    AAPLV2ParsedPreset *preset;
+};
+
+static void aap_lv2_compile_port_value(const char* port_symbol, void* user_data, const void* value, uint32_t size, uint32_t type) {
+    auto compiler = (AAPLV2PresetCompiler *) user_data;
+    auto ctx = compiler->ctx;
+    auto port = ctx->getPortIndexForSymbol(port_symbol);
+    float floatValue;
+    if (port < 0 || !aap_lv2_port_value_to_float(ctx->urids, value, size, type, &floatValue) ||
+        !aap_lv2_port_is(ctx->descriptor, (uint32_t) port, AAP_LV2_DESCRIPTOR_PORT_CONTROL | AAP_LV2_DESCRIPTOR_PORT_INPUT)) {
+        // leave it to lilv_state_restore() (which reports it).
+        compiler->preset->ports_only = false;
+        return;
+    }
+    compiler->preset->port_values.emplace_back((uint32_t) port, floatValue);
+}
+
+// Compiles the preset into port values, if it has nothing else.
+static void aap_lv2_compile_preset(AAPLV2PluginContext* ctx, AAPLV2ParsedPreset* preset) {
+    if (lilv_state_get_num_properties(preset->state.get()) > 0)
+        return;
+    preset->ports_only = true;
+    AAPLV2PresetCompiler compiler{ctx, preset};
+    lilv_state_emit_port_values(preset->state.get(), aap_lv2_compile_port_value, &compiler);
+    if (preset->ports_only)
+        preset->state.reset();
+    else
+        preset->port_values.clear();
+}
+
+// Returns the parsed preset, from the cache, or by loading and parsing it (then it is cached).
+static std::shared_ptr<AAPLV2ParsedPreset> aap_lv2_get_preset_state(AAPLV2PluginContext* ctx, int32_t index) {
+    std::lock_guard<std::recursive_mutex> worldGuard{ctx->shared_world->lock};
+    auto &cache = ctx->preset_cache;
+    for (auto it = cache.begin(); it != cache.end(); it++) {
+        if (it->first == index) {
+            cache.splice(cache.begin(), cache, it);
+            return cache.front().second;
+        }
+    }
+    for (auto& p : ctx->presets) {
+        if (p->preset.id != index)
+            continue;
+        // (a file that is already loaded, e.g. for another preset in it, is not parsed again.)
+        ctx->preset_resources.load(p->node);
+        auto state = lilv_state_new_from_world(ctx->world, &ctx->features.urid_map_feature_data, p->node);
+        if (!state) {
+            aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s: failed to load preset %s.",
+                         ctx->aap_plugin_id.c_str(), lilv_node_as_string(p->node));
+            return nullptr;
+        }
+        auto ret = std::make_shared<AAPLV2ParsedPreset>();
+        ret->state = std::shared_ptr<LilvState>{state, lilv_state_free};
+        aap_lv2_compile_preset(ctx, ret.get());
+        if (ctx->options.preset_cache_size > 0) {
+            cache.emplace_front(index, ret);
+            while ((int32_t) cache.size() > ctx->options.preset_cache_size)
+                cache.pop_back();
+        }
+        return ret;
+    }
+    return nullptr;
 }
 
 int32_t aap_lv2_get_preset_count(aap_presets_extension_t* ext, AndroidAudioPlugin* plugin) {
@@ -303,26 +1161,38 @@ int32_t aap_lv2_get_preset_count(aap_presets_extension_t* ext, AndroidAudioPlugi
 void aap_lv2_get_preset(aap_presets_extension_t* ext, AndroidAudioPlugin* plugin, int32_t index, aap_preset_t* destination, aapxs_completion_callback callback, void* callbackContext) {
     auto ctx = ((AAPLV2PluginContext *) plugin->plugin_specific);
     aap_lv2_ensure_preset_loaded(ctx);
+    if (index < 0 || index >= (int32_t) ctx->presets.size()) {
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s: preset index %d is out of range.", ctx->aap_plugin_id.c_str(), index);
+        // the host still waits for the completion.
+        memset(destination->name, 0, AAP_PRESETS_EXTENSION_MAX_NAME_LENGTH);
+        if (callback)
+            callback(callbackContext, plugin);
+        return;
+    }
     auto preset = ctx->presets[index].get();
     strncpy(destination->name, preset->preset.name, AAP_PRESETS_EXTENSION_MAX_NAME_LENGTH);
     if (callback)
         callback(callbackContext, plugin);
 }
-void aap_lv2_set_preset_index(aap_presets_extension_t* ext, AndroidAudioPlugin* plugin, int32_t index) {
-    auto ctx = ((AAPLV2PluginContext *) plugin->plugin_specific);
+static void aap_lv2_restore_preset(AAPLV2PluginContext* ctx, int32_t index, const AAPLV2RestoreCompletion& completion) {
     aap_lv2_ensure_preset_loaded(ctx);
 
-    for (auto& p : ctx->presets) {
-        if (p->preset.id == index) {
-            auto state = lilv_state_new_from_string(ctx->world,
-                                                    &ctx->features.urid_map_feature_data,
-                                                    (const char *) p->data);
-            lilv_state_restore(state, ctx->instance, aap_lv2_set_port_value, ctx, 0, ctx->stateFeaturesList().get());
-            lilv_state_free(state);
-            break;
-        }
-    }
-    ctx->markAllParameterValuesDirty();
+    auto preset = aap_lv2_get_preset_state(ctx, index);
+    if (preset && preset->ports_only)
+        aap_lv2_restore(ctx, [&](AAPLV2StagingTarget* target, const LV2_Feature* const*) {
+            for (auto &portValue : preset->port_values)
+                aap_lv2_stage_port_value(target->slot, portValue.first, portValue.second);
+        }, false, completion);
+    else if (preset)
+        aap_lv2_restore_lilv_state(ctx, preset->state.get(), completion);
+    else
+        completion.notify(false, aap_lv2_monotonic_ns());
+}
+
+// It returns without waiting for process() to commit the ControlPort values (see aap_lv2_restore()).
+void aap_lv2_set_preset_index(aap_presets_extension_t* ext, AndroidAudioPlugin* plugin, int32_t index) {
+    auto ctx = ((AAPLV2PluginContext *) plugin->plugin_specific);
+    aap_lv2_restore_preset(ctx, index, AAPLV2RestoreCompletion{&ctx->state_restore, aap_lv2_monotonic_ns()});
 }
 
 // parameters extension
@@ -389,9 +1259,270 @@ aap_plugin_info_t aap_lv2_plugin_get_plugin_info(AndroidAudioPlugin* plugin) {
     return hostExt->get(hostExt, ctx->aap_host, ctx->aap_plugin_id.c_str());
 }
 
+// Shared LilvWorld registry
+
+static std::mutex shared_worlds_lock{};
+static std::map<std::string, AAPLV2SharedWorld*> shared_worlds{};
+
+AAPLV2SharedWorld* aap_lv2_acquire_shared_world() {
+    auto lv2PathEnv = getenv("LV2_PATH");
+    std::string lv2Path{lv2PathEnv ? lv2PathEnv : ""};
+
+    std::lock_guard<std::mutex> guard{shared_worlds_lock};
+    auto existing = shared_worlds.find(lv2Path);
+    if (existing != shared_worlds.end()) {
+        existing->second->ref_count++;
+        return existing->second;
+    }
+
+    auto sharedWorld = new AAPLV2SharedWorld();
+    sharedWorld->lv2_path = lv2Path;
+    sharedWorld->world = lilv_world_new();
+    sharedWorld->statics = new AAPLV2PluginContextStatics(sharedWorld->world);
+    sharedWorld->ref_count = 1;
+    shared_worlds[lv2Path] = sharedWorld;
+    return sharedWorld;
+}
+
+void aap_lv2_release_shared_world(AAPLV2SharedWorld* sharedWorld) {
+    std::lock_guard<std::mutex> guard{shared_worlds_lock};
+    if (--sharedWorld->ref_count > 0)
+        return;
+    shared_worlds.erase(sharedWorld->lv2_path);
+    delete sharedWorld->statics;
+    lilv_world_free(sharedWorld->world);
+    delete sharedWorld;
+}
+
+// Plugin bundle index
+
+extern "C" {
+void* abstract_fopen(const char* path, const char* mode);
+int abstract_fread(void *ptr, size_t size, size_t count, void* stream);
+int abstract_fclose (void* stream);
+}
+
+// Reads the whole file via abstract IO (which may be Android assets, not the filesystem).
+static bool aap_lv2_read_file(const std::string& path, std::string& result) {
+    auto fp = abstract_fopen(path.c_str(), "r");
+    if (!fp)
+        return false;
+    char buf[4096];
+    int size;
+    while ((size = abstract_fread(buf, 1, sizeof(buf), fp)) > 0)
+        result.append(buf, size);
+    abstract_fclose(fp);
+    return true;
+}
+
+static void aap_lv2_parse_bundle_index(AAPLV2SharedWorld* sharedWorld, const std::string& lv2Dir, const std::string& content) {
+    size_t pos = 0;
+    bool headerChecked = false;
+    while (pos < content.size()) {
+        auto eol = content.find('\n', pos);
+        if (eol == std::string::npos)
+            eol = content.size();
+        std::string line = content.substr(pos, eol - pos);
+        pos = eol + 1;
+        if (!headerChecked) {
+            if (line != AAP_LV2_INDEX_HEADER && line != AAP_LV2_INDEX_HEADER_V2 && line != AAP_LV2_INDEX_HEADER_V1) {
+                aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Unsupported plugin index format in %s", lv2Dir.c_str());
+                return;
+            }
+            headerChecked = true;
+            continue;
+        }
+        auto tab = line.find('\t');
+        if (line.empty() || line[0] == '#' || tab == std::string::npos)
+            continue;
+        auto uri = line.substr(0, tab);
+        auto rest = line.substr(tab + 1);
+        std::vector<std::string> columns{};
+        for (size_t start = 0; start <= rest.size();) {
+            auto next = rest.find('\t', start);
+            if (next == std::string::npos)
+                next = rest.size();
+            columns.emplace_back(rest.substr(start, next - start));
+            start = next + 1;
+        }
+        auto& bundle = columns[0];
+        std::string descriptor = columns.size() > 1 ? columns[1] : std::string{};
+        // keep the first one, as lilv does for LV2_PATH.
+        if (!sharedWorld->bundle_index.contains(uri)) {
+            AAPLV2BundleIndexEntry indexEntry{lv2Dir + "/" + bundle + "/",
+                                              descriptor.empty() ? descriptor : lv2Dir + "/" + descriptor, {}};
+            for (size_t i = 2; i < columns.size(); i++)
+                if (!columns[i].empty())
+                    indexEntry.preset_bundle_paths.emplace_back(lv2Dir + "/" + columns[i] + "/");
+            sharedWorld->bundle_index[uri] = std::move(indexEntry);
+        }
+    }
+}
+
+static void aap_lv2_load_bundle_index(AAPLV2SharedWorld* sharedWorld) {
+    if (sharedWorld->bundle_index_loaded)
+        return;
+    sharedWorld->bundle_index_loaded = true;
+
+    // LV2_PATH is either the lv2 directory itself (when plugins are extracted to files),
+    // or the list of bundle directories (when they are loaded from assets). The index file
+    // is at the top of the lv2 directory, so we look for it in each entry and its parent.
+    std::set<std::string> visited{};
+    auto &lv2Path = sharedWorld->lv2_path;
+    size_t pos = 0;
+    while (pos < lv2Path.size()) {
+        auto sep = lv2Path.find(':', pos);
+        if (sep == std::string::npos)
+            sep = lv2Path.size();
+        std::string entry = lv2Path.substr(pos, sep - pos);
+        pos = sep + 1;
+        while (entry.size() > 1 && entry.back() == '/')
+            entry.pop_back();
+        if (entry.empty())
+            continue;
+        auto slash = entry.rfind('/');
+        std::string parent = slash == std::string::npos ? "." : slash == 0 ? "" : entry.substr(0, slash);
+
+        for (auto& dir : {entry, parent}) {
+            if (visited.contains(dir))
+                continue;
+            visited.insert(dir);
+            std::string content{};
+            if (aap_lv2_read_file(dir + "/" + AAP_LV2_INDEX_FILENAME, content))
+                aap_lv2_parse_bundle_index(sharedWorld, dir, content);
+        }
+    }
+    aap::a_log_f(AAP_LOG_LEVEL_DEBUG, AAP_LV2_TAG, "Loaded plugin index: %d entries", (int) sharedWorld->bundle_index.size());
+}
+
+// Loads only the bundle that contains the plugin (and the bundles that have presets for it) if it
+// is indexed, and falls back to lilv_world_load_all() if there is no index or it turned out to be stale.
+// The caller has to hold the world lock.
+static const LilvPlugin* aap_lv2_find_plugin(AAPLV2SharedWorld* sharedWorld, const char* pluginUri) {
+    auto world = sharedWorld->world;
+    auto pluginUriNode = lilv_new_uri(world, pluginUri);
+    const LilvPlugin *plugin{nullptr};
+
+    if (!sharedWorld->all_loaded) {
+        aap_lv2_load_bundle_index(sharedWorld);
+        auto entry = sharedWorld->bundle_index.find(pluginUri);
+        if (entry != sharedWorld->bundle_index.end()) {
+            auto loadBundle = [&](const std::string& path) {
+                if (sharedWorld->loaded_bundles.contains(path))
+                    return;
+                auto bundleNode = lilv_new_file_uri(world, nullptr, path.c_str());
+                lilv_world_load_bundle(world, bundleNode);
+                lilv_node_free(bundleNode);
+                sharedWorld->loaded_bundles.insert(path);
+            };
+            auto& bundlePath = entry->second.bundle_path;
+            loadBundle(bundlePath);
+            // so that lilv_plugin_get_related() finds the presets in them.
+            for (auto& presetBundlePath : entry->second.preset_bundle_paths)
+                loadBundle(presetBundlePath);
+            plugin = lilv_plugins_get_by_uri(lilv_world_get_all_plugins(world), pluginUriNode);
+            if (!plugin)
+                aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Plugin index is stale; %s was not found in %s. Loading everything in LV2_PATH.",
+                             pluginUri, bundlePath.c_str());
+        }
+    }
+
+    if (!plugin && !sharedWorld->all_loaded) {
+        lilv_world_load_all(world);
+        sharedWorld->all_loaded = true;
+        auto allPlugins = lilv_world_get_all_plugins(world);
+        if (lilv_plugins_size(allPlugins) <= 0)
+            aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "No LV2 plugins were found.");
+        else
+            plugin = lilv_plugins_get_by_uri(allPlugins, pluginUriNode);
+    }
+    else if (!plugin)
+        plugin = lilv_plugins_get_by_uri(lilv_world_get_all_plugins(world), pluginUriNode);
+
+    lilv_node_free(pluginUriNode);
+    return plugin;
+}
+
+// Loads a compiled descriptor file. It is mmap()-ed if it is on the filesystem, and read
+// via abstract IO otherwise (Android assets).
+static AAPLV2PluginDescriptor* aap_lv2_load_descriptor_file(const std::string& path) {
+    AAPLV2PluginDescriptor* ret{nullptr};
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            auto size = (size_t) st.st_size;
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                if (aap_lv2_descriptor_validate(mapped, size))
+                    ret = new AAPLV2PluginDescriptor(mapped, size);
+                else
+                    munmap(mapped, size);
+            }
+        }
+        close(fd);
+    } else {
+        std::string content{};
+        if (aap_lv2_read_file(path, content) && aap_lv2_descriptor_validate(content.data(), content.size()))
+            ret = new AAPLV2PluginDescriptor(std::vector<uint8_t>(content.begin(), content.end()));
+    }
+    if (!ret)
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Plugin descriptor %s is missing or invalid.", path.c_str());
+    return ret;
+}
+
+// Returns the compiled descriptor for the plugin. It prefers the one that aap-import-lv2-metadata
+// generated, and builds it from lilv if it is not available (or does not match the plugin).
+// The caller has to hold the world lock.
+static const AAPLV2PluginDescriptor* aap_lv2_get_plugin_descriptor(AAPLV2SharedWorld* sharedWorld, const LilvPlugin* plugin, const char* pluginUri) {
+    auto cached = sharedWorld->descriptors.find(pluginUri);
+    if (cached != sharedWorld->descriptors.end())
+        return cached->second.get();
+
+    std::unique_ptr<AAPLV2PluginDescriptor> descriptor{};
+    auto entry = sharedWorld->bundle_index.find(pluginUri);
+    if (entry != sharedWorld->bundle_index.end() && !entry->second.descriptor_path.empty()) {
+        descriptor.reset(aap_lv2_load_descriptor_file(entry->second.descriptor_path));
+        if (descriptor && strcmp(descriptor->uri(), pluginUri) != 0) {
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Plugin descriptor %s is for another plugin %s.",
+                         entry->second.descriptor_path.c_str(), descriptor->uri());
+            descriptor.reset();
+        } else if (descriptor && descriptor->numPorts() != lilv_plugin_get_num_ports(plugin)) {
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "Plugin descriptor %s is stale (it has %d ports, while the plugin has %d).",
+                         entry->second.descriptor_path.c_str(), (int) descriptor->numPorts(), (int) lilv_plugin_get_num_ports(plugin));
+            descriptor.reset();
+        }
+    }
+    if (!descriptor)
+        descriptor = std::make_unique<AAPLV2PluginDescriptor>(AAPLV2DescriptorBuilder{sharedWorld->world}.build(plugin));
+
+    auto ret = descriptor.get();
+    sharedWorld->descriptors[pluginUri] = std::move(descriptor);
+    return ret;
+}
+
+// The worker capacities are per instance. The options give the defaults, and they are raised to
+// the largest Atom port buffer that the plugin asks for (rsz:minimumSize), as worker messages
+// often carry such Atoms (e.g. a patch:Set with a sample path, forwarded from the port).
+// The message size is clamped to AAP_LV2_WORKER_MAX_MESSAGE_SIZE_LIMIT.
+static void aap_lv2_adjust_worker_capacity(AAPLV2Options& options, const AAPLV2PluginDescriptor* descriptor, const char* pluginId) {
+    for (uint32_t i = 0; i < descriptor->numPorts(); i++) {
+        auto port = descriptor->port(i);
+        if ((port->flags & AAP_LV2_DESCRIPTOR_PORT_ATOM) && (port->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM_SIZE))
+            options.worker_max_message_size = std::max(options.worker_max_message_size, port->minimum_size);
+    }
+    if (options.worker_max_message_size > AAP_LV2_WORKER_MAX_MESSAGE_SIZE_LIMIT) {
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: worker messages are limited to %d bytes (%u requested).",
+                     pluginId, AAP_LV2_WORKER_MAX_MESSAGE_SIZE_LIMIT, options.worker_max_message_size);
+        options.worker_max_message_size = AAP_LV2_WORKER_MAX_MESSAGE_SIZE_LIMIT;
+    }
+    options.worker_ring_size = (uint32_t) std::max((uint64_t) options.worker_ring_size,
+                                                   (uint64_t) options.worker_max_message_size * 8);
+}
+
 // AAP factory members
-void
-jalv_worker_init(Jalv*                       ZIX_UNUSED(jalv),
+bool
+jalv_worker_init(Jalv*                       jalv,
                  JalvWorker*                 worker,
                  const LV2_Worker_Interface* iface,
                  bool                        threaded);
@@ -410,56 +1541,71 @@ AndroidAudioPlugin *aap_lv2_plugin_new(
         AndroidAudioPluginHost *host) {
     aap::a_log_f(AAP_LOG_LEVEL_INFO, AAP_LV2_TAG, "Instantiating aap-lv2 plugin %s", pluginUniqueID);
 
-    auto world = lilv_world_new();
-    // Here we expect that LV2_PATH is already set using setenv() etc.
-    lilv_world_load_all(world);
-
-    auto statics = new AAPLV2PluginContextStatics(world);
-
-    auto allPlugins = lilv_world_get_all_plugins(world);
-    if (lilv_plugins_size(allPlugins) <= 0) {
-        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "No LV2 plugins were found.");
-        return nullptr;
-    }
-
     // AAP-LV2 Plugin URI is just LV2 URI prefixed by "lv2:".
     if (strncmp(pluginUniqueID, "lv2:", strlen("lv2:"))) {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "Unexpected AAP LV2 pluginId: %s", pluginUniqueID);
         return nullptr;
     }
-    auto pluginUriNode = lilv_new_uri(world, pluginUniqueID + strlen("lv2:"));
-    const LilvPlugin *plugin = lilv_plugins_get_by_uri(allPlugins, pluginUriNode);
-    lilv_node_free(pluginUriNode);
+
+    // Here we expect that LV2_PATH is already set using setenv() etc.
+    auto sharedWorld = aap_lv2_acquire_shared_world();
+    auto world = sharedWorld->world;
+    // The rest of the instantiation step is done while holding the world lock (including
+    // plugin instantiation, as lilv registers the loaded library to the world).
+    std::unique_lock<std::recursive_mutex> worldGuard{sharedWorld->lock};
+
+    const LilvPlugin *plugin = aap_lv2_find_plugin(sharedWorld, pluginUniqueID + strlen("lv2:"));
     if (!plugin) {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin could not be instantiated: %s",
-                     lilv_node_as_uri(pluginUriNode));
+                     pluginUniqueID);
+        worldGuard.unlock();
+        aap_lv2_release_shared_world(sharedWorld);
         return nullptr;
     }
-    if (!lilv_plugin_verify(plugin)) {
+    auto descriptor = aap_lv2_get_plugin_descriptor(sharedWorld, plugin, pluginUniqueID + strlen("lv2:"));
+    if (!descriptor->hasFlag(AAP_LV2_DESCRIPTOR_PLUGIN_VERIFIED)) {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin is invalid: %s",
-                     lilv_node_as_uri(pluginUriNode));
+                     pluginUniqueID);
+        worldGuard.unlock();
+        aap_lv2_release_shared_world(sharedWorld);
         return nullptr;
     }
 
     aap::a_log_f(AAP_LOG_LEVEL_INFO, AAP_LV2_TAG, "Plugin %s is valid, ready to instantiate.", pluginUniqueID);
 
-    auto ctx = new AAPLV2PluginContext(host, statics, world, plugin, pluginUniqueID);
+    auto ctx = new AAPLV2PluginContext(host, sharedWorld, plugin, descriptor, pluginUniqueID);
+    // Releases what has been set up so far, when any of the steps below fails.
+    bool workLockInitialized{false}, workerSemInitialized{false};
+    auto abortInstantiation = [&]() -> AndroidAudioPlugin* {
+        // the worker threads (if any) may still use the instance and the semaphore.
+        ctx->exit = true;
+        jalv_worker_finish(&ctx->worker);
+        jalv_worker_destroy(&ctx->worker);
+        jalv_worker_destroy(&ctx->state_worker);
+        if (ctx->instance)
+            lilv_instance_free(ctx->instance);
+        if (workerSemInitialized)
+            zix_sem_destroy(&ctx->worker.sem);
+        if (workLockInitialized)
+            zix_sem_destroy(&ctx->work_lock);
+        delete ctx;
+        worldGuard.unlock();
+        aap_lv2_release_shared_world(sharedWorld);
+        return nullptr;
+    };
 
-    ctx->features.urid_map_feature_data.handle = ctx;
+    auto uridMap = AAPLV2UridMap::instance();
+    ctx->features.urid_map_feature_data.handle = uridMap;
     ctx->features.urid_map_feature_data.map = map_uri;
-    ctx->features.urid_unmap_feature_data.handle = ctx;
+    ctx->features.urid_unmap_feature_data.handle = uridMap;
     ctx->features.urid_unmap_feature_data.unmap = unmap_uri;
 
-    if (zix_sem_init(&ctx->symap_lock, 1)) {
-        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "Failed to initialize semaphore (symap). plugin: %s",
-                     lilv_node_as_uri(pluginUriNode));
-        return nullptr;
-    }
     if (zix_sem_init(&ctx->work_lock, 1)) {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "Failed to initialize semaphore (work_lock). plugin: %s",
-                     lilv_node_as_uri(pluginUriNode));
-        return nullptr;
+                     pluginUniqueID);
+        return abortInstantiation();
     }
+    workLockInitialized = true;
     ctx->worker.ctx = ctx;
     ctx->state_worker.ctx = ctx;
 
@@ -468,17 +1614,21 @@ AndroidAudioPlugin *aap_lv2_plugin_new(
     ctx->features.state_worker_schedule_data.handle = &ctx->state_worker;
     ctx->features.state_worker_schedule_data.schedule_work = jalv_worker_schedule;
 
+    // sub-blocks can be shorter than the usual minimum.
+    if (ctx->options.sub_block_processing)
+        ctx->features.minBlockLengthValue = std::min(ctx->features.minBlockLengthValue,
+                                                     ctx->options.min_sub_block_frames);
     ctx->features.minBlockLengthOption = {LV2_OPTIONS_INSTANCE,
                                           0,
-                                          map_uri(ctx, LV2_BUF_SIZE__minBlockLength),
+                                          map_uri(uridMap, LV2_BUF_SIZE__minBlockLength),
                                           sizeof(int),
-                                          map_uri(ctx, LV2_ATOM__Int),
+                                          map_uri(uridMap, LV2_ATOM__Int),
                                           &ctx->features.minBlockLengthValue};
     ctx->features.maxBlockLengthOption = {LV2_OPTIONS_INSTANCE,
                                           0,
-                                          map_uri(ctx, LV2_BUF_SIZE__maxBlockLength),
+                                          map_uri(uridMap, LV2_BUF_SIZE__maxBlockLength),
                                           sizeof(int),
-                                          map_uri(ctx, LV2_ATOM__Int),
+                                          map_uri(uridMap, LV2_ATOM__Int),
                                           &ctx->features.maxBlockLengthValue};
 
     LV2_Options_Option options[3];
@@ -503,15 +1653,16 @@ AndroidAudioPlugin *aap_lv2_plugin_new(
     // for jalv worker
     if (zix_sem_init(&ctx->worker.sem, 0)) {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "Failed to initialize semaphore on worker. plugin: %s",
-                     lilv_node_as_uri(pluginUriNode));
-        return nullptr;
+                     pluginUniqueID);
+        return abortInstantiation();
     }
+    workerSemInitialized = true;
 
     LilvInstance *instance = lilv_plugin_instantiate(plugin, ctx->sample_rate, features);
     if (!instance) {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "Failed to instantiate plugin: %s",
-                     lilv_node_as_uri(pluginUriNode));
-        return nullptr;
+                     pluginUniqueID);
+        return abortInstantiation();
     }
     ctx->instance = instance;
 
@@ -519,27 +1670,35 @@ AndroidAudioPlugin *aap_lv2_plugin_new(
     if (!ctx->urids.urid_atom_sequence_type) {
         ctx->urids.urid_atom_sequence_type = map->map(map->handle, LV2_ATOM__Sequence);
         ctx->urids.urid_midi_event_type = map->map(map->handle, LV2_MIDI__MidiEvent);
+        ctx->urids.urid_ump_event_type = map->map(map->handle, AAP_LV2_UMP_EVENT_URI);
         ctx->urids.urid_time_frame = map->map(map->handle, LV2_ATOM__frameTime);
         ctx->urids.urid_atom_float_type = map->map(map->handle, LV2_ATOM__Float);
+        ctx->urids.urid_atom_double_type = map->map(map->handle, LV2_ATOM__Double);
+        ctx->urids.urid_atom_int_type = map->map(map->handle, LV2_ATOM__Int);
+        ctx->urids.urid_atom_long_type = map->map(map->handle, LV2_ATOM__Long);
+        ctx->urids.urid_atom_bool_type = map->map(map->handle, LV2_ATOM__Bool);
         ctx->urids.urid_patch_set = map->map(map->handle, LV2_PATCH__Set);
         ctx->urids.urid_patch_property = map->map(map->handle, LV2_PATCH__property);
+        ctx->urids.urid_patch_value = map->map(map->handle, LV2_PATCH__value);
     }
+    ctx->mapPatchProperties();
 
     /* Check for thread-safe state restore() method. */
-    LilvNode* state_threadSafeRestore = lilv_new_uri(
-            ctx->world, LV2_STATE__threadSafeRestore);
-    if (lilv_plugin_has_feature(ctx->plugin, state_threadSafeRestore)) {
+    if (descriptor->hasFlag(AAP_LV2_DESCRIPTOR_PLUGIN_THREAD_SAFE_RESTORE))
         ctx->safe_restore = true;
-    }
-    lilv_node_free(state_threadSafeRestore);
 
-    if (lilv_plugin_has_extension_data(ctx->plugin, ctx->statics->work_interface_uri_node)) {
+    if (descriptor->hasFlag(AAP_LV2_DESCRIPTOR_PLUGIN_HAS_WORKER_INTERFACE)) {
         const auto* iface = (const LV2_Worker_Interface*)
                 lilv_instance_get_extension_data(ctx->instance, LV2_WORKER__interface);
 
-        jalv_worker_init(ctx, &ctx->worker, iface, true);
-        if (ctx->safe_restore) {
-            jalv_worker_init(ctx, &ctx->state_worker, iface, false);
+        aap_lv2_adjust_worker_capacity(ctx->options, descriptor, pluginUniqueID);
+        if (!jalv_worker_init(ctx, &ctx->worker, iface, true)) {
+            aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "Failed to start the worker. plugin: %s", pluginUniqueID);
+            return abortInstantiation();
+        }
+        if (ctx->safe_restore && !jalv_worker_init(ctx, &ctx->state_worker, iface, false)) {
+            aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "Failed to initialize the state worker. plugin: %s", pluginUniqueID);
+            return abortInstantiation();
         }
     }
 
@@ -564,17 +1723,23 @@ void aap_lv2_plugin_delete(
     l->exit = true;
     l->instance_state = AAP_LV2_INSTANCE_STATE_TERMINATING;
 
+    AAP_LV2_RT_CHECK_REPORT(l->rt_check, l->aap_plugin_id.c_str());
+
     // Terminate the worker
     jalv_worker_finish(&l->worker);
 
-    // Destroy the worker
+    // Destroy the workers
     jalv_worker_destroy(&l->worker);
+    jalv_worker_destroy(&l->state_worker);
 
     free(l->dummy_raw_buffer);
-    lilv_instance_free(l->instance);
-    delete l->statics;
-    lilv_world_free(l->world);
-    delete l;
+    auto sharedWorld = l->shared_world;
+    {
+        std::lock_guard<std::recursive_mutex> worldGuard{sharedWorld->lock};
+        lilv_instance_free(l->instance);
+        delete l;
+    }
+    aap_lv2_release_shared_world(sharedWorld);
     delete plugin;
 }
 
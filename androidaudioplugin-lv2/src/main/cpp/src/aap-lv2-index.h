@@ -0,0 +1,19 @@
+#ifndef AAP_LV2_INDEX_INCLUDED
+#define AAP_LV2_INDEX_INCLUDED 1
+
+// The plugin index file is generated by aap-import-lv2-metadata and placed at the top of
+// the lv2 directory (next to the bundle directories). Each line after the header line is:
+//
+//   {plugin URI} TAB {bundle directory name} [TAB {compiled descriptor path} [TAB {preset bundle directory name}]...]
+//
+// The bridge uses it to load only the bundle that contains the requested plugin,
+// instead of loading everything in LV2_PATH. The descriptor path (see aap-lv2-descriptor.h)
+// is relative to the lv2 directory. Version 1 index files do not have it.
+// The preset bundles are the other bundles that have presets for the plugin (lv2:appliesTo),
+// which are loaded together with the plugin bundle. Version 1 and 2 index files do not have them.
+#define AAP_LV2_INDEX_FILENAME "aap-lv2-index.txt"
+#define AAP_LV2_INDEX_HEADER "# aap-lv2-index 3"
+#define AAP_LV2_INDEX_HEADER_V2 "# aap-lv2-index 2"
+#define AAP_LV2_INDEX_HEADER_V1 "# aap-lv2-index 1"
+
+#endif // ifndef AAP_LV2_INDEX_INCLUDED
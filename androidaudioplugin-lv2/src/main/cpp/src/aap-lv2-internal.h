@@ -3,8 +3,14 @@
 
 #include <unistd.h>
 #include <dlfcn.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <ctime>
+#include <cstdlib>
 #include <cstring>
 #include <cassert>
 #include <memory>
@@ -12,6 +18,9 @@
 #include <map>
 #include <limits>
 #include <string>
+#include <mutex>
+#include <set>
+#include <list>
 
 #include <aap/unstable/logging.h>
 #include <aap/android-audio-plugin.h>
@@ -21,9 +30,19 @@
 #include <aap/ext/state.h>
 #include <aap/ext/plugin-info.h>
 
-#include "symap.h"
+#include "aap-lv2-index.h"
+#include "aap-lv2-descriptor.h"
+#include "aap-lv2-rt-check.h"
+#include "aap-lv2-change-detection.h"
+#include "aap-lv2-ump-demux.h"
+#include "aap-lv2-midi-timing.h"
+#include "aap-lv2-spsc-ring.h"
+#include "aap-lv2-latency-histogram.h"
+#include "aap-lv2-worker-statistics.h"
+#include "aap-lv2-binary-state.h"
+#include "aap-lv2-urid-map.h"
+#include "aap-lv2-preset-index.h"
 #include "zix/sem.h"
-#include "zix/ring.h"
 #include "zix/thread.h"
 
 #include <lilv/lilv.h>
@@ -91,6 +110,7 @@ public:
         integer_uri_node = lilv_new_uri (world, LV2_CORE__integer);
         discrete_cv_uri_node = lilv_new_uri(world, LV2_PORT_PROPS__discreteCV);
         rdfs_label_node = lilv_new_uri(world, LILV_NS_RDFS "label");
+        rdfs_see_also_node = lilv_new_uri(world, LILV_NS_RDFS "seeAlso");
     }
 
     ~AAPLV2PluginContextStatics() {
@@ -105,6 +125,7 @@ public:
         lilv_node_free(resize_port_minimum_size_node);
         lilv_node_free(presets_preset_node);
         lilv_node_free(rdfs_label_node);
+        lilv_node_free(rdfs_see_also_node);
     }
 
     LilvNode *audio_port_uri_node, *control_port_uri_node, *atom_port_uri_node,
@@ -114,7 +135,81 @@ public:
             *discrete_cv_uri_node,
             *midi_event_uri_node, *patch_message_uri_node,
             *resize_port_minimum_size_node, *presets_preset_node,
-            *work_interface_uri_node, *rdfs_label_node;
+            *work_interface_uri_node, *rdfs_label_node, *rdfs_see_also_node;
+};
+
+// A read-only view of a compiled plugin descriptor (see aap-lv2-descriptor.h).
+// It is either mmap()-ed from the file that aap-import-lv2-metadata generated, or built from lilv.
+// It must have been validated by aap_lv2_descriptor_validate() beforehand.
+class AAPLV2PluginDescriptor {
+    std::vector<uint8_t> owned_data{};
+    void *mapped_data{nullptr};
+    size_t mapped_size{0};
+    const uint8_t *data;
+
+public:
+    explicit AAPLV2PluginDescriptor(std::vector<uint8_t>&& bytes)
+            : owned_data(std::move(bytes)), data(owned_data.data()) {
+    }
+
+    AAPLV2PluginDescriptor(void *mapped, size_t size)
+            : mapped_data(mapped), mapped_size(size), data((const uint8_t*) mapped) {
+    }
+
+    ~AAPLV2PluginDescriptor() {
+        if (mapped_data)
+            munmap(mapped_data, mapped_size);
+    }
+
+    const aap_lv2_descriptor_header_t* header() const { return (const aap_lv2_descriptor_header_t*) data; }
+    const char* uri() const { return string(header()->uri); }
+    bool hasFlag(uint32_t flag) const { return (header()->flags & flag) != 0; }
+    uint32_t numPorts() const { return header()->num_ports; }
+    const aap_lv2_descriptor_port_t* port(uint32_t index) const {
+        return (const aap_lv2_descriptor_port_t*) (data + header()->ports_offset) + index;
+    }
+    const aap_lv2_descriptor_scale_point_t* scalePoint(uint32_t index) const {
+        return (const aap_lv2_descriptor_scale_point_t*) (data + header()->scale_points_offset) + index;
+    }
+    uint32_t numProperties() const { return header()->num_properties; }
+    const aap_lv2_descriptor_property_t* property(uint32_t index) const {
+        return (const aap_lv2_descriptor_property_t*) (data + header()->properties_offset) + index;
+    }
+    const char* string(uint32_t offset) const {
+        return (const char*) data + header()->strings_offset + offset;
+    }
+};
+
+inline bool aap_lv2_port_is(const AAPLV2PluginDescriptor *descriptor, uint32_t port, uint32_t flags) {
+    return (descriptor->port(port)->flags & flags) == flags;
+}
+
+struct AAPLV2BundleIndexEntry {
+    std::string bundle_path;
+    std::string descriptor_path;
+    // the other bundles that have presets for the plugin.
+    std::vector<std::string> preset_bundle_paths;
+};
+
+// LilvWorld and the statics are shared across all the plugin instances that were instantiated
+// with the same LV2_PATH, so that we do not have to parse the same Turtle files every time.
+// They are reference-counted, and released when the last instance is deleted.
+class AAPLV2SharedWorld {
+public:
+    std::string lv2_path{};
+    LilvWorld *world{nullptr};
+    AAPLV2PluginContextStatics *statics{nullptr};
+    int32_t ref_count{0};
+    bool all_loaded{false};
+    // plugin URI -> bundle path (and descriptor path), read from AAP_LV2_INDEX_FILENAME files in LV2_PATH.
+    bool bundle_index_loaded{false};
+    std::map<std::string, AAPLV2BundleIndexEntry> bundle_index{};
+    std::set<std::string> loaded_bundles{};
+    // plugin URI -> compiled descriptor
+    std::map<std::string, std::unique_ptr<AAPLV2PluginDescriptor>> descriptors{};
+    // LilvWorld is not thread-safe (even node creation modifies the world), so any access to
+    // the world (and plugins that belong to it) has to be done while holding this lock.
+    std::recursive_mutex lock{};
 };
 
 class AAPLV2PluginContext;
@@ -122,20 +217,116 @@ class AAPLV2PluginContext;
 typedef AAPLV2PluginContext Jalv;
 
 
-// imported from jalv
+// The worker thread runs plugins' work() (e.g. sample loading), which may need a deep stack.
+#define AAP_LV2_WORKER_STACK_SIZE (1024 * 1024)
+// Worker messages are never larger than this, whatever the options or rsz:minimumSize say, so that the
+// ring sizes (a few times of it) stay within 32 bits.
+#define AAP_LV2_WORKER_MAX_MESSAGE_SIZE_LIMIT (16 * 1024 * 1024)
+
+inline int64_t aap_lv2_monotonic_ns() {
+    struct timespec ts{0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Precedes each message body in the worker rings.
+struct AAPLV2WorkerMessageHeader {
+    uint32_t size;
+    uint32_t reserved;
+    // when the message was written (CLOCK_MONOTONIC).
+    int64_t timestamp_ns;
+};
+
+// Counters of a worker. They are updated by the audio thread and the worker thread, and read
+// outside the audio thread.
+struct AAPLV2WorkerStatistics {
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> responses{0};
+    // requests and responses that were rejected with LV2_WORKER_ERR_NO_SPACE.
+    std::atomic<uint64_t> rejected_requests{0};
+    std::atomic<uint64_t> rejected_responses{0};
+    // blocks that left responses to the next block, as the response time budget ran out.
+    std::atomic<uint64_t> deferred_response_blocks{0};
+    // high-water marks of the queues, in bytes.
+    std::atomic<uint32_t> max_request_queue_bytes{0};
+    std::atomic<uint32_t> max_response_queue_bytes{0};
+    // indexed by aap_lv2_worker_latency_kind.
+    AAPLV2LatencyHistogram latencies[AAP_LV2_WORKER_NUM_LATENCY_KINDS]{};
+};
+
+// OS scheduling of the worker threads. Priority is the nice value for SCHED_OTHER and SCHED_BATCH,
+// and the real-time priority for SCHED_FIFO and SCHED_RR.
+struct AAPLV2WorkerThreadPolicy {
+    // -1 to leave the OS default.
+    int32_t sched_policy{-1};
+    int32_t priority{0};
+    bool has_priority{false};
+    // bitmask of CPUs (0 to 63) to run on. 0 to leave the OS default.
+    uint64_t cpu_affinity{0};
+
+    bool operator==(const AAPLV2WorkerThreadPolicy&) const = default;
+};
+
+struct AAPLV2WorkerPool;
+
+// The LV2 worker (derived from jalv worker). Its rings and message buffers are allocated at
+// instantiation, and scheduling work or delivering responses never allocates.
+// Requests are run either by its own thread, or by the process-wide worker pool.
 typedef struct {
     Jalv *ctx;       ///< Pointer back to AAPLV2PluginContext
-    ZixRing *requests{nullptr};   ///< Requests to the worker
-    ZixRing *responses{nullptr};  ///< Responses from the worker
-    void *response;   ///< Worker response buffer
+    AAPLV2SpscRing requests{};   ///< Requests to the worker
+    AAPLV2SpscRing responses{};  ///< Responses from the worker
+    uint32_t max_message_size{0};  ///< Larger requests and responses are rejected
+    void *request{nullptr};   ///< Worker request buffer (used by the worker thread)
+    void *response{nullptr};   ///< Worker response buffer (used by the audio thread)
     ZixSem sem;        ///< Worker semaphore
-    ZixThread thread;     ///< Worker thread
+    pthread_t thread;     ///< Worker thread
     const LV2_Worker_Interface *iface{nullptr};      ///< Plugin worker interface
-    bool threaded;   ///< Run work in another thread
+    bool threaded{false};   ///< Run work in another thread
+    AAPLV2WorkerPool *pool{nullptr};   ///< The pool that runs the requests (instead of its own thread)
+    // held by the pool thread that is running the requests, so that they are run one at a time, in order.
+    std::atomic<bool> busy{false};
+    // Within process(), the worker thread (or pool) is woken up only once, at the end of the block.
+    std::atomic<bool> in_block{false};
+    std::atomic<bool> wakeup_pending{false};
+    AAPLV2WorkerStatistics stats{};
 } JalvWorker;
 
+// How a pool thread runs the requests of the instances.
+enum AAPLV2WorkerPoolPolicy {
+    // one request of an instance at a time, then the next instance (so that one instance cannot hog the pool).
+    AAP_LV2_WORKER_POOL_POLICY_ROUND_ROBIN,
+    // all pending requests of an instance, then the next instance (fewer context switches).
+    AAP_LV2_WORKER_POOL_POLICY_DRAIN
+};
+
+// Worker threads that are shared by all the instances in the process (optional; see AAPLV2Options).
+struct AAPLV2WorkerPool {
+    std::vector<pthread_t> threads{};
+    AAPLV2WorkerPoolPolicy policy{AAP_LV2_WORKER_POOL_POLICY_ROUND_ROBIN};
+    ZixSem sem;
+    // guards `workers`. Only pool threads and instantiation/deletion take it, never the audio thread.
+    std::mutex lock{};
+    std::vector<JalvWorker*> workers{};
+    std::atomic<bool> exit{false};
+    int32_t ref_count{0};
+};
+
+// Called at the beginning and the end of process(). Requests that are scheduled in between
+// wake up the worker (or the pool) only once, at the end.
 void
-jalv_worker_emit_responses(JalvWorker *worker, LilvInstance *instance);
+jalv_worker_begin_block(JalvWorker *worker);
+void
+jalv_worker_end_block(JalvWorker *worker);
+
+// Delivers the responses to the plugin, until `deadlineNs` (CLOCK_MONOTONIC) passes. At least one
+// response is delivered in each call, so that a worker never starves. Returns the number of responses.
+uint32_t
+jalv_worker_emit_responses(JalvWorker *worker, LilvInstance *instance, int64_t deadlineNs);
+
+// Logs the worker counters and latencies (outside the audio thread).
+void
+jalv_worker_report(Jalv *ctx, JalvWorker *worker, const char *name);
 
 
 class AAPLv2PluginFeatures {
@@ -146,7 +337,8 @@ public:
     LV2_Worker_Schedule state_worker_schedule_data{};
     LV2_Log_Log logData{nullptr, log_printf, log_vprintf};
 
-    const int minBlockLengthValue = 128;
+    // It may be lowered at instantiation, when sub-block processing is enabled.
+    int minBlockLengthValue = 128;
     // FIXME: this should not be a magic number, but lowering the value causes aap-sfizz crash.
     //  Needs some investigation.
     const int maxBlockLengthValue = 8192;
@@ -168,102 +360,511 @@ void *aap_lv2_plugin_get_extension(AndroidAudioPlugin *plugin, const char *uri);
 struct AAPLV2URIDs {
     LV2_URID urid_atom_sequence_type{0},
             urid_midi_event_type{0},
+            urid_ump_event_type{0},
             urid_time_frame{0},
             urid_atom_float_type{0},
+            urid_atom_double_type{0},
+            urid_atom_int_type{0},
+            urid_atom_long_type{0},
+            urid_atom_bool_type{0},
             urid_patch_set{0},
-            urid_patch_property{0};
+            urid_patch_property{0},
+            urid_patch_value{0};
+};
+
+// How each LV2 port is connected. It is classified once at prepare() and process() only
+// follows it, without any lilv (or descriptor) queries.
+enum AAPLV2PortRouteKind : uint8_t {
+    AAP_LV2_PORT_ROUTE_NONE,
+    // audio and CV ports; connected to the AAP buffer.
+    AAP_LV2_PORT_ROUTE_AAP_BUFFER,
+    // points to an element in `control_buffer_pointers`.
+    AAP_LV2_PORT_ROUTE_CONTROL,
+    // Atom ports that support midi:MidiEvent and/or UMP events. Connected to a local buffer.
+    AAP_LV2_PORT_ROUTE_MIDI_ATOM,
+    // Atom ports that support patch:Message. Connected to a local buffer.
+    AAP_LV2_PORT_ROUTE_PATCH_ATOM,
+    // any other port that needs a local buffer (other Atom ports, or ports with rsz:minimumSize).
+    AAP_LV2_PORT_ROUTE_LOCAL_BUFFER,
+};
+
+// indexed by LV2 port index.
+struct AAPLV2PortRoute {
+    AAPLV2PortRouteKind kind{AAP_LV2_PORT_ROUTE_NONE};
+    bool is_input{false};
+    // index in AAPLV2PortMappings::atom_ports, or -1.
+    int16_t atom_port{-1};
+    // AAP port index for AAP_LV2_PORT_ROUTE_AAP_BUFFER, or -1.
+    int32_t aap_port{-1};
+    uint32_t buffer_size{0};
+    // locally allocated buffer (owned by the context), or nullptr.
+    void *buffer{nullptr};
+};
+
+// Atom ports (of any route kind) that are reset and/or forged in every process() cycle, packed together.
+struct AAPLV2AtomPort {
+    uint32_t lv2_port;
+    AAPLV2PortRouteKind kind;
+    bool is_input;
+    // UMP group that MIDI events for this port come from (input) or go to (output). -1 if not MIDI.
+    int8_t ump_group{-1};
+    // The port supports UMP events (AAP_LV2_UMP_EVENT_URI), so UMPs are forged as is instead of
+    // being converted to midi:MidiEvent.
+    bool ump_native{false};
+    uint32_t buffer_size;
+    LV2_Atom_Sequence *sequence;
+    LV2_Atom_Forge forge;
+    LV2_Atom_Forge_Frame frame;
+    // The whole-block sequence while run() is split into sub-blocks (owned by mappings).
+    LV2_Atom_Sequence *sub_block_staging{nullptr};
+    // SysEx7 UMPs are assembled here until the end packet, for MIDI 1.0 input ports (owned by mappings).
+    uint8_t *sysex_buffer{nullptr};
+    uint32_t sysex_length{0};
+    // Input events that belong to later blocks, with their times relative to the next block. `pending` holds
+    // the ones carried from the previous block, and `next_pending` collects the ones for the next block.
+    // They have the same capacity as the port buffer (input ports only, owned by mappings).
+    LV2_Atom_Sequence *pending{nullptr};
+    LV2_Atom_Sequence *next_pending{nullptr};
+    LV2_Atom_Forge pending_forge;
+    LV2_Atom_Forge_Frame pending_frame;
+    // the length of the current block; events at or after it go to `next_pending`.
+    int32_t block_frames{0};
+    uint64_t carried_events{0};
+    uint64_t dropped_carried_events{0};
 };
 
+#define AAP_LV2_MAX_SYSEX7_SIZE 4096
+
+#define AAP_LV2_NUM_UMP_GROUPS 16
+
 class AAPLV2PortMappings {
 public:
     int32_t aap_midi_in_port{-1};
     int32_t aap_midi_out_port{-1};
-    std::map<int32_t, int32_t> aap_to_lv2_portmap{};
-    std::map<int32_t, int32_t> lv2_to_aap_portmap{};
-    std::map<uint32_t, int32_t> lv2_index_to_port{};
-    std::map<int32_t, int32_t> ump_group_to_atom_in_port{};
-    std::map<int32_t, int32_t> atom_out_port_to_ump_group{};
     int32_t lv2_patch_in_port{-1};
     int32_t lv2_patch_out_port{-1};
+    // index in `atom_ports` for the patch input/output (it may be shared with MIDI), or -1.
+    int32_t patch_in_atom_port{-1};
+    int32_t patch_out_atom_port{-1};
+    std::vector<AAPLV2PortRoute> routes{};
+    // It never grows after prepare(), as forges hold pointers into their own frames.
+    std::vector<AAPLV2AtomPort> atom_ports{};
+
+    ~AAPLV2PortMappings() {
+        releaseBuffers();
+    }
+
+    void releaseBuffers() {
+        for (auto &r : routes)
+            if (r.buffer)
+                free(r.buffer);
+        for (auto &a : atom_ports) {
+            if (a.sub_block_staging)
+                free(a.sub_block_staging);
+            if (a.sysex_buffer)
+                free(a.sysex_buffer);
+            if (a.pending)
+                free(a.pending);
+            if (a.next_pending)
+                free(a.next_pending);
+        }
+        routes.clear();
+        atom_ports.clear();
+        lv2_patch_in_port = lv2_patch_out_port = -1;
+        patch_in_atom_port = patch_out_atom_port = -1;
+    }
+
+    int32_t lv2ToAAPPort(int32_t lv2Port) const {
+        return lv2Port >= 0 && lv2Port < (int32_t) routes.size() ? routes[lv2Port].aap_port : -1;
+    }
+};
+
+// The encoding of the state that aap_lv2_get_state() returns (aap_lv2_set_state() accepts either).
+enum AAPLV2StateFormat {
+    AAP_LV2_STATE_FORMAT_TURTLE,
+    // see aap-lv2-binary-state.h.
+    AAP_LV2_STATE_FORMAT_BINARY
+};
+
+// Runtime options. They are given via environment variables (like LV2_PATH) before instantiation.
+struct AAPLV2Options {
+    // Split run() at the timestamps of ControlPort changes, for sample accurate automation.
+    bool sub_block_processing{false};
+    // Changes closer than this to the previous split point (or the end of the block) are applied
+    // at that split point, so that the plugin never runs shorter sub-blocks than this.
+    int32_t min_sub_block_frames{16};
+    // Output ControlPort changes (e.g. meters) are sent to the host at most this many times per
+    // second. 0 means every block. Input ControlPort changes are always echoed immediately.
+    int32_t output_parameter_rate{0};
+    // Output ControlPort changes smaller than this ratio of the parameter range are not sent.
+    float output_parameter_deadband{0};
+    // The size of each of the worker request and response rings, in bytes.
+    uint32_t worker_ring_size{0x10000};
+    // Worker requests and responses larger than this are rejected with LV2_WORKER_ERR_NO_SPACE.
+    uint32_t worker_max_message_size{0x2000};
+    // Worker responses are delivered at the beginning of process() until this much time (in
+    // microseconds) is spent, and the rest are left to the next block. 0 means no limit.
+    int32_t worker_response_budget_usec{500};
+    // The number of threads in the process-wide worker pool. 0 means that each instance has its own worker thread.
+    // (The pool is created with the options of the first instance that uses it.)
+    int32_t worker_pool_size{0};
+    AAPLV2WorkerPoolPolicy worker_pool_policy{AAP_LV2_WORKER_POOL_POLICY_ROUND_ROBIN};
+    // Scheduling of the worker thread. Pool threads switch to it while they run the requests of the instance.
+    AAPLV2WorkerThreadPolicy worker_thread_policy{};
+    AAPLV2StateFormat state_format{AAP_LV2_STATE_FORMAT_TURTLE};
+    // get_state() returns delta states after the first full one (binary format only).
+    bool state_delta{false};
+    // A full state is returned instead of a delta that is as large as this ratio of the full state.
+    float state_delta_compaction_ratio{0.5};
+    // The number of parsed presets that are kept, to apply them again without parsing. 0 disables it.
+    int32_t preset_cache_size{8};
+
+    // "other", "batch", "idle", "fifo" or "rr" (-1 for anything else).
+    static int32_t parseSchedPolicy(const char *name) {
+        if (!strcmp(name, "other"))
+            return SCHED_OTHER;
+        if (!strcmp(name, "batch"))
+            return SCHED_BATCH;
+        if (!strcmp(name, "idle"))
+            return SCHED_IDLE;
+        if (!strcmp(name, "fifo"))
+            return SCHED_FIFO;
+        if (!strcmp(name, "rr"))
+            return SCHED_RR;
+        return -1;
+    }
+
+    // CPU list in the form of "0-3,6" (as in taskset -c), into a bitmask.
+    static uint64_t parseCpuList(const char *list) {
+        uint64_t mask = 0;
+        while (*list) {
+            char *end;
+            long first = strtol(list, &end, 10);
+            if (end == list)
+                break;
+            long last = first;
+            if (*end == '-')
+                last = strtol(end + 1, &end, 10);
+            for (long cpu = std::max(first, 0L); cpu <= last && cpu < 64; cpu++)
+                mask |= (uint64_t) 1 << cpu;
+            list = *end == ',' ? end + 1 : end;
+            if (*end != ',')
+                break;
+        }
+        return mask;
+    }
+
+    static AAPLV2Options fromEnvironment() {
+        AAPLV2Options ret{};
+        auto subBlock = getenv("AAP_LV2_SUB_BLOCK_PROCESSING");
+        ret.sub_block_processing = subBlock && atoi(subBlock) != 0;
+        auto minFrames = getenv("AAP_LV2_MIN_SUB_BLOCK_FRAMES");
+        if (minFrames && atoi(minFrames) > 0)
+            ret.min_sub_block_frames = atoi(minFrames);
+        auto outputRate = getenv("AAP_LV2_OUTPUT_PARAMETER_RATE");
+        if (outputRate && atoi(outputRate) >= 0)
+            ret.output_parameter_rate = atoi(outputRate);
+        auto outputDeadband = getenv("AAP_LV2_OUTPUT_PARAMETER_DEADBAND");
+        if (outputDeadband && atof(outputDeadband) >= 0)
+            ret.output_parameter_deadband = (float) atof(outputDeadband);
+        auto workerRingSize = getenv("AAP_LV2_WORKER_RING_SIZE");
+        if (workerRingSize && atoi(workerRingSize) > 0)
+            ret.worker_ring_size = (uint32_t) atoi(workerRingSize);
+        auto workerMaxMessageSize = getenv("AAP_LV2_WORKER_MAX_MESSAGE_SIZE");
+        if (workerMaxMessageSize && atoi(workerMaxMessageSize) > 0)
+            ret.worker_max_message_size = (uint32_t) atoi(workerMaxMessageSize);
+        auto workerBudget = getenv("AAP_LV2_WORKER_RESPONSE_BUDGET_USEC");
+        if (workerBudget && atoi(workerBudget) >= 0)
+            ret.worker_response_budget_usec = atoi(workerBudget);
+        auto workerPoolSize = getenv("AAP_LV2_WORKER_POOL_SIZE");
+        if (workerPoolSize && atoi(workerPoolSize) >= 0)
+            ret.worker_pool_size = atoi(workerPoolSize);
+        auto workerPoolPolicy = getenv("AAP_LV2_WORKER_POOL_POLICY");
+        if (workerPoolPolicy && !strcmp(workerPoolPolicy, "drain"))
+            ret.worker_pool_policy = AAP_LV2_WORKER_POOL_POLICY_DRAIN;
+        auto workerSchedPolicy = getenv("AAP_LV2_WORKER_SCHED_POLICY");
+        if (workerSchedPolicy)
+            ret.worker_thread_policy.sched_policy = parseSchedPolicy(workerSchedPolicy);
+        auto workerPriority = getenv("AAP_LV2_WORKER_PRIORITY");
+        if (workerPriority && *workerPriority) {
+            ret.worker_thread_policy.priority = atoi(workerPriority);
+            ret.worker_thread_policy.has_priority = true;
+        }
+        auto workerCpuAffinity = getenv("AAP_LV2_WORKER_CPU_AFFINITY");
+        if (workerCpuAffinity)
+            ret.worker_thread_policy.cpu_affinity = parseCpuList(workerCpuAffinity);
+        auto stateFormat = getenv("AAP_LV2_STATE_FORMAT");
+        if (stateFormat && !strcmp(stateFormat, "binary"))
+            ret.state_format = AAP_LV2_STATE_FORMAT_BINARY;
+        auto stateDelta = getenv("AAP_LV2_STATE_DELTA");
+        if (stateDelta && atoi(stateDelta) != 0) {
+            ret.state_delta = true;
+            ret.state_format = AAP_LV2_STATE_FORMAT_BINARY;
+        }
+        auto compactionRatio = getenv("AAP_LV2_STATE_DELTA_COMPACTION_RATIO");
+        if (compactionRatio && atof(compactionRatio) >= 0)
+            ret.state_delta_compaction_ratio = (float) atof(compactionRatio);
+        auto presetCacheSize = getenv("AAP_LV2_PRESET_CACHE_SIZE");
+        if (presetCacheSize && atoi(presetCacheSize) >= 0)
+            ret.preset_cache_size = atoi(presetCacheSize);
+        return ret;
+    }
+};
+
+// Counters that process() updates, to be reported outside the audio thread.
+struct AAPLV2Statistics {
+    // MIDI events (and patch:Set events) from the plugin that did not fit in the AAP MIDI2 output buffer.
+    uint64_t dropped_midi_output_events{0};
+    // UMP words in the AAP MIDI2 input beyond what the demultiplexer was prepared for (the buffer size
+    // at prepare()). They can only come from a host that writes past the buffer size, and are ignored.
+    uint64_t dropped_midi_input_words{0};
+};
+
+// Tracks the ControlPort values that were last sent to the host, indexed by LV2 port index
+// (which is the parameter ID), so that changes are detected over the ControlPort value array.
+struct AAPLV2ParameterChangeTracker {
+    // NaN if not sent yet.
+    std::vector<float> last_emitted_values{};
+    // changes within this are not sent (0 for input ports and discrete parameters).
+    std::vector<float> deadbands{};
+    // bitmaps of the ControlPort parameters, by direction.
+    std::vector<uint64_t> input_ports{};
+    std::vector<uint64_t> output_ports{};
+    // output ControlPort changes are sent only once in this many frames (0 = every block).
+    int32_t output_interval_frames{0};
+    int32_t frames_until_output{0};
+    bool emit_all{true};
 };
 
-struct AAPPresetAndLv2Binary {
+// A ControlPort change that is deferred until its frame within the current block.
+struct AAPLV2ControlChange {
+    int32_t frame;
+    uint32_t port;
+    float value;
+};
+
+#define AAP_LV2_MAX_PENDING_CONTROL_CHANGES 1024
+
+struct AAPLV2StateRestore;
+
+// How a restore is accounted for when it is done: the latency of a committed restore is recorded,
+// and the restores that failed or were superseded are counted (see aap_lv2_report_restores()).
+struct AAPLV2RestoreCompletion {
+    AAPLV2StateRestore *restore{nullptr};
+    // when the restore was requested (CLOCK_MONOTONIC).
+    int64_t start_ns{0};
+
+    // It may be called on the audio thread.
+    inline void notify(bool committed, int64_t nowNs) const;
+};
+
+// ControlPort values that a state (or preset) restore staged, to be committed at a block boundary.
+struct AAPLV2StagedPortValues {
+    // indexed by LV2 port index.
+    std::vector<float> values{};
+    // bitmap of the ports that the state has values for.
+    std::vector<uint64_t> mask{};
+    AAPLV2RestoreCompletion completion{};
+};
+
+enum AAPLV2RestoreSlotState : int32_t {
+    AAP_LV2_RESTORE_SLOT_FREE,
+    AAP_LV2_RESTORE_SLOT_WRITING,
+    AAP_LV2_RESTORE_SLOT_PUBLISHED,
+    AAP_LV2_RESTORE_SLOT_COMMITTING
+};
+
+enum AAPLV2InstanceOwner : int32_t {
+    AAP_LV2_INSTANCE_OWNER_NONE,
+    AAP_LV2_INSTANCE_OWNER_RUN,
+    AAP_LV2_INSTANCE_OWNER_RESTORE
+};
+
+// Hands over restored ControlPort values from the restoring thread to the audio thread, through
+// a lock-free double buffer: the restoring thread fills a slot and publishes it, and process()
+// commits it at the beginning of the next block. Each slot goes through its states by CAS, so
+// neither side ever waits for the other on the audio thread.
+struct AAPLV2StateRestore {
+    AAPLV2StagedPortValues slots[2]{};
+    std::atomic<int32_t> slot_states[2]{{AAP_LV2_RESTORE_SLOT_FREE}, {AAP_LV2_RESTORE_SLOT_FREE}};
+    // the slot to commit, or -1.
+    std::atomic<int32_t> published_slot{-1};
+    // restoring thread only (guarded by `lock`).
+    int32_t next_slot{0};
+    // serializes restores (non-realtime threads only).
+    std::mutex lock{};
+    // serializes the calls into the plugin's restore() and save() (non-realtime threads only).
+    std::mutex instance_lock{};
+    // For plugins without threadSafeRestore, restore() must not run at the same time as run().
+    // process() skips run() (and outputs silence) for the blocks where restore() holds the instance.
+    std::atomic<int32_t> instance_owner{AAP_LV2_INSTANCE_OWNER_NONE};
+    // from the request to the commit.
+    AAPLV2LatencyHistogram latency{};
+    // the restores that failed, or were superseded before they were committed.
+    std::atomic<uint64_t> uncommitted{0};
+};
+
+inline void AAPLV2RestoreCompletion::notify(bool committed, int64_t nowNs) const {
+    if (!restore)
+        return;
+    if (committed)
+        restore->latency.record(nowNs - start_ns);
+    else
+        restore->uncommitted.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A restore waits this long for process() to release the slot that it is committing, or the
+// instance (then the restore fails).
+#define AAP_LV2_RESTORE_COMMIT_TIMEOUT_MSEC 1000
+
+// The serialized state that get_state_size() captures, so that the following get_state() returns
+// the same bytes without calling the plugin's save() and serializing again (see aap_lv2_capture_state()).
+struct AAPLV2StateSnapshot {
+    // incremented whenever the plugin state may have changed: input ControlPort changes, input
+    // events, worker responses and restores. It is updated on the audio thread.
+    std::atomic<uint64_t> state_generation{1};
+    // non-realtime threads only (guarded by `lock`).
+    std::mutex lock{};
+    std::vector<uint8_t> data{};
+    // the state_generation that `data` was captured at, or 0 if there is no snapshot.
+    uint64_t generation{0};
+    // whether `data` is a full state (not a delta).
+    bool data_is_full{false};
+
+    // In delta mode, the full state that was last handed to the host (or restored), which delta
+    // states are relative to, and the state_generation it was captured at.
+    std::vector<uint8_t> base{};
+    uint64_t base_id{0};
+    uint64_t base_generation{0};
+    // the state_generation of the last change, per LV2 port (input ControlPorts only).
+    std::unique_ptr<std::atomic<uint64_t>[]> port_generations{};
+
+    void markChanged() { state_generation.fetch_add(1, std::memory_order_relaxed); }
+
+    void markPortChanged(uint32_t port) {
+        auto generation = state_generation.fetch_add(1, std::memory_order_relaxed) + 1;
+        port_generations[port].store(generation, std::memory_order_relaxed);
+    }
+
+    void release() {
+        std::vector<uint8_t>{}.swap(data);
+        generation = 0;
+        data_is_full = false;
+    }
+};
+
+// Parameter metadata, indexed by parameter ID so that it can be looked up in O(1) on the audio thread.
+struct AAPLV2ParameterMetadata {
+    // index in AAPLV2PluginContext::aapParams, or -1 if the ID is not a parameter.
+    int32_t parameter_index{-1};
+    // LV2 ControlPort index that backs the parameter, or -1.
+    int32_t port_index{-1};
+    // index of the patch:writable / patch:readable property in the descriptor, or -1.
+    int32_t property_index{-1};
+    // for properties: the property URID, and the Atom type of its value (mapped at instantiation).
+    LV2_URID property_urid{0};
+    LV2_URID value_type{0};
+    double min_value{0};
+    double max_value{1};
+    double default_value{0};
+    bool is_discrete{false};
+    // range in AAPLV2PluginContext::aapEnums.
+    int32_t first_enum{0};
+    int32_t num_enums{0};
+};
+
+// An entry of the preset index, which is built from the preset labels only. The preset itself is
+// parsed when it is applied (see aap_lv2_get_preset_state()).
+struct AAPLV2PresetIndexEntry {
     aap_preset_t preset;
-    void* data;
-    AAPPresetAndLv2Binary(aap_preset_t preset, void* data)
-            : preset(preset), data(data) {
+    // the preset URI.
+    LilvNode *node;
+    AAPLV2PresetIndexEntry(aap_preset_t preset, LilvNode *node)
+            : preset(preset), node(node) {
     }
+    ~AAPLV2PresetIndexEntry() { lilv_node_free(node); }
+};
+
+// A parsed preset (see aap_lv2_get_preset_state()). A preset that has only input ControlPort values
+// (as most factory presets do) is compiled into (LV2 port index, value) pairs, which are staged and
+// committed without lilv_state_restore() and the plugin's restore().
+struct AAPLV2ParsedPreset {
+    std::shared_ptr<LilvState> state{};
+    bool ports_only{false};
+    std::vector<std::pair<uint32_t, float>> port_values{};
 };
 
 class AAPLV2PluginContext {
 public:
-    AAPLV2PluginContext(AndroidAudioPluginHost *host, AAPLV2PluginContextStatics *statics,
-                        LilvWorld *world,
-                        const LilvPlugin *plugin, const char *pluginUniqueId)
-            : aap_host(host), statics(statics), world(world), plugin(plugin),
+    AAPLV2PluginContext(AndroidAudioPluginHost *host, AAPLV2SharedWorld *sharedWorld,
+                        const LilvPlugin *plugin, const AAPLV2PluginDescriptor *descriptor,
+                        const char *pluginUniqueId)
+            : aap_host(host), shared_world(sharedWorld), statics(sharedWorld->statics),
+              world(sharedWorld->world), plugin(plugin), descriptor(descriptor),
               aap_plugin_id(pluginUniqueId) {
-        symap = symap_new();
-        // They don't have default assignment...
-        worker.threaded = false;
-        state_worker.threaded = false;
-
         buildParameterList();
     }
 
     ~AAPLV2PluginContext() {
-        for (auto &p: presets)
-            if (p->data)
-                free(p->data);
-        for (auto p: midi_atom_inputs)
-            free(p.second);
-        for (auto p: explicitly_allocated_port_buffers)
-            free(p.second);
         if (control_buffer_pointers)
             free(control_buffer_pointers);
-        symap_free(symap);
     }
 
+    // Members that process() touches in every cycle come first, so that they share cache lines.
     int32_t instance_state{AAP_LV2_INSTANCE_STATE_INITIAL};
+    int32_t sample_rate{48000};
+    LilvInstance *instance{nullptr};
+    aap_buffer_t *cached_buffer{nullptr};
+    // a ControlPort points to single float value, which can be stored in an array.
+    float *control_buffer_pointers{nullptr};
+    AAPLV2URIDs urids;
+    AAPLV2PortMappings mappings;
+    AAPLV2Options options{AAPLV2Options::fromEnvironment()};
+    AAPLV2Statistics stats{};
+    // ControlPort changes to apply in the middle of the block (only in sub-block processing).
+    // Its capacity is reserved at prepare(), and it never grows beyond that.
+    std::vector<AAPLV2ControlChange> pending_control_changes{};
+    // UMP input classified by destination, for the current block.
+    AAPLV2UmpDemux ump_demux{};
+    // JR Timestamps, JR Clocks and Delta Clockstamps in the UMP input.
+    AAPLV2MidiTiming midi_timing{};
+    AAPLV2ParameterChangeTracker parameter_changes{};
+    // state and preset restore, committed at the beginning of a block.
+    AAPLV2StateRestore state_restore{};
+    AAPLV2StateSnapshot state_snapshot{};
+    // real-time violation counters of this instance (nothing unless AAP_LV2_RT_CHECK).
+    AAPLV2RealtimeCheck rt_check{};
+
+    // Members below are used only at non-realtime steps (or rarely).
     AndroidAudioPluginHost *aap_host;
+    AAPLV2SharedWorld *shared_world;
     AAPLV2PluginContextStatics *statics;
     AAPLv2PluginFeatures features;
-    AAPLV2URIDs urids;
-    AAPLV2PortMappings mappings;
     LilvWorld *world;
     const LilvPlugin *plugin;
-    LilvInstance *instance{nullptr};
+    // Port and plugin properties are taken from here, not from lilv.
+    const AAPLV2PluginDescriptor *descriptor;
     std::string aap_plugin_id{};
-    int32_t sample_rate{48000};
-
-    aap_buffer_t *cached_buffer{nullptr};
 
     void *dummy_raw_buffer{nullptr};
 
-    // a ControlPort points to single float value, which can be stored in an array.
-    float *control_buffer_pointers{nullptr};
-    // We store ResizePort::minimumSize here, to specify sufficient Atom buffer size
-    // (not to allocate local memory; it is passed as a shared memory by the local service host).
-    std::map<int32_t, size_t> explicit_port_buffer_sizes{};
-    // FIXME: make it a simple array so that we don't have to iterate over in every `process()`.
-    std::map<int32_t, void *> explicitly_allocated_port_buffers{};
     int32_t atom_buffer_size = 0x1000;
-    // They receive the Atom events that were translated from AAP MIDI2 inputs.
-    std::map<int32_t, LV2_Atom_Sequence *> midi_atom_inputs{};
-    // Their outputs have to be translated to AAP MIDI2 outputs.
-    std::map<int32_t, LV2_Atom_Sequence *> midi_atom_outputs{};
-
-    std::map<int32_t, LV2_Atom_Forge> midi_forges_in{};
-    std::map<int32_t, LV2_Atom_Forge> midi_forges_out{};
-    LV2_Atom_Forge patch_forge_in{};
-    LV2_Atom_Forge patch_forge_out{};
-
-    std::vector<std::unique_ptr<AAPPresetAndLv2Binary>> presets{};
 
-    std::vector<aap_parameter_info_t*> aapParams{};
-    std::map<int32_t,int32_t> aapParamIdToEnumIndex{};
-    std::vector<aap_parameter_enum_t*> aapEnums{};
-    std::vector<float> last_emitted_parameter_values{};
-    bool emit_all_parameter_values{true};
+    std::vector<std::unique_ptr<AAPLV2PresetIndexEntry>> presets{};
+    bool presets_indexed{false};
+    // parsed presets (by preset ID), the most recently used first (guarded by the world lock).
+    std::list<std::pair<int32_t, std::shared_ptr<AAPLV2ParsedPreset>>> preset_cache{};
+    // the preset files that were loaded to parse presets. They stay loaded (other presets in the same
+    // file are likely to be applied too), and are unloaded when the instance is deleted (under the world lock).
+    AAPLV2PresetResources preset_resources{world, statics->rdfs_see_also_node};
+
+    std::vector<aap_parameter_info_t> aapParams{};
+    std::vector<aap_parameter_enum_t> aapEnums{};
+    std::vector<AAPLV2ParameterMetadata> parameter_metadata{};
+    // property URID -> parameter ID, sorted by URID (for patch:Set outputs).
+    std::vector<std::pair<LV2_URID, int32_t>> patch_property_parameters{};
+    // port symbol (in the descriptor string table) -> LV2 port index (for states and presets).
+    AAPLV2SymbolTable port_symbols{};
 
     std::unique_ptr<LV2_Feature *> stateFeaturesList() {
         LV2_Feature *list[]{
@@ -281,148 +882,212 @@ public:
         return ret;
     }
 
-    void registerParameter(const LilvPlugin* plugin, const LilvPort* port) {
+    void registerParameter(uint32_t portIndex) {
+        auto port = descriptor->port(portIndex);
         aap_parameter_info_t info{0, {}, {}, 0, 1, 0, 0};
         info.path[0] = '\0';
-        info.stable_id = static_cast<int16_t>(lilv_port_get_index(plugin, port));
+        info.stable_id = static_cast<int16_t>(portIndex);
         auto nameMax = sizeof(info.display_name);
-        auto nameNode = lilv_port_get_name(plugin, port);
-        const char* paramName = lilv_node_as_string(nameNode);
-        strncpy(info.display_name, paramName, nameMax);
-
-        LilvNode *defNode{nullptr}, *minNode{nullptr}, *maxNode{nullptr}, *propertyTypeNode{nullptr};
-        lilv_port_get_range(plugin, port, &defNode, &minNode, &maxNode);
-        LilvNodes *portProps = lilv_port_get_properties(plugin, port);
-        bool isInteger{false};
-        bool isToggled{false};
-        LILV_FOREACH(nodes, pp, portProps) {
-            auto portProp = lilv_nodes_get(portProps, pp);
-            if (lilv_node_equals(portProp, statics->integer_uri_node))
-                isInteger = true;
-            if (lilv_node_equals(portProp, statics->toggled_uri_node))
-                isToggled = true;
-        }
+        strncpy(info.display_name, descriptor->string(port->name), nameMax);
+
+        bool hasDefault = port->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_DEFAULT;
+        bool hasMinimum = port->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM;
+        bool hasMaximum = port->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_MAXIMUM;
+        bool isInteger = port->flags & AAP_LV2_DESCRIPTOR_PORT_INTEGER;
+        bool isToggled = port->flags & AAP_LV2_DESCRIPTOR_PORT_TOGGLED;
         if (isToggled) {
-            info.default_value = defNode == nullptr ? 0 : lilv_node_as_float(defNode) > 0.0 ? 1 : 0;
+            info.default_value = !hasDefault ? 0 : port->default_value > 0.0 ? 1 : 0;
             info.min_value = 0;
             info.max_value = 1;
         } else if (isInteger) {
-            info.default_value = defNode == nullptr ? 0 : lilv_node_as_int(defNode);
-            info.min_value = minNode == nullptr ? 0 : lilv_node_as_int(minNode);
-            info.max_value = maxNode == nullptr ? 1 : lilv_node_as_int(maxNode);
+            info.default_value = !hasDefault ? 0 : (int32_t) port->default_value;
+            info.min_value = !hasMinimum ? 0 : (int32_t) port->minimum;
+            info.max_value = !hasMaximum ? 1 : (int32_t) port->maximum;
         } else {
-            info.default_value = defNode == nullptr ? 0 : lilv_node_as_float(defNode);
-            info.min_value = minNode == nullptr ? 0 : lilv_node_as_float(minNode);
-            info.max_value = maxNode == nullptr ? 1 : lilv_node_as_float(maxNode);
+            info.default_value = !hasDefault ? 0 : port->default_value;
+            info.min_value = !hasMinimum ? 0 : port->minimum;
+            info.max_value = !hasMaximum ? 1 : port->maximum;
         }
 
-        LilvScalePoints* scalePoints = lilv_port_get_scale_points(plugin, port);
-        if (scalePoints != nullptr) {
-            aapParamIdToEnumIndex[info.stable_id] = aapEnums.size();
-
-            LILV_FOREACH(scale_points, spi, scalePoints) {
-                auto sp = lilv_scale_points_get(scalePoints, spi);
-                auto labelNode = lilv_scale_point_get_label(sp);
-                auto valueNode = lilv_scale_point_get_value(sp);
-                auto label = lilv_node_as_string(labelNode);
-                auto value = lilv_node_as_float(valueNode);
-
+        auto &meta = parameter_metadata[info.stable_id];
+        meta.parameter_index = (int32_t) aapParams.size();
+        meta.port_index = (int32_t) portIndex;
+        meta.min_value = info.min_value;
+        meta.max_value = info.max_value;
+        meta.default_value = info.default_value;
+        meta.is_discrete = port->flags & AAP_LV2_DESCRIPTOR_PORT_DISCRETE_CV;
+        meta.first_enum = (int32_t) aapEnums.size();
+
+        if (port->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_SCALE_POINTS) {
+            for (uint32_t i = 0; i < port->num_scale_points; i++) {
+                auto sp = descriptor->scalePoint(port->first_scale_point + i);
                 aap_parameter_enum_t e;
-                e.value = value;
-                strncpy(e.name, label, sizeof(e.name));
-                aapEnums.emplace_back(new aap_parameter_enum_t(e));
+                e.value = sp->value;
+                strncpy(e.name, descriptor->string(sp->label), sizeof(e.name));
+                aapEnums.emplace_back(e);
             }
-            lilv_scale_points_free(scalePoints);
         } else if (isToggled) {
-            aapParamIdToEnumIndex[info.stable_id] = aapEnums.size();
             aap_parameter_enum_t t;
             t.value = 1;
             strncpy(t.name, "true", sizeof(t.name));
-            aapEnums.emplace_back(new aap_parameter_enum_t(t));
+            aapEnums.emplace_back(t);
 
             aap_parameter_enum_t f;
             f.value = 0;
             strncpy(f.name, "false", sizeof(f.name));
-            aapEnums.emplace_back(new aap_parameter_enum_t(f));
+            aapEnums.emplace_back(f);
         }
-        aapParams.emplace_back(new aap_parameter_info_t(info));
-
-        if(defNode) lilv_node_free(defNode);
-        if(minNode) lilv_node_free(minNode);
-        if(maxNode) lilv_node_free(maxNode);
-        if(propertyTypeNode) lilv_node_free(propertyTypeNode);
+        meta.num_enums = (int32_t) aapEnums.size() - meta.first_enum;
+        aapParams.emplace_back(info);
     }
 
-#define PORTCHECKER_SINGLE(_name_,_type_) inline bool _name_ (const LilvPlugin* plugin, const LilvPort* port) { return lilv_port_is_a (plugin, port, statics->_type_); }
-#define PORTCHECKER_AND(_name_,_cond1_,_cond2_) inline bool _name_ (const LilvPlugin* plugin, const LilvPort* port) { return _cond1_ (plugin, port) && _cond2_ (plugin, port); }
-
-        PORTCHECKER_SINGLE (IS_CONTROL_PORT, control_port_uri_node)
-        PORTCHECKER_SINGLE (IS_AUDIO_PORT, audio_port_uri_node)
-        PORTCHECKER_SINGLE (IS_INPUT_PORT, input_port_uri_node)
-        PORTCHECKER_SINGLE (IS_OUTPUT_PORT, output_port_uri_node)
-        PORTCHECKER_SINGLE (IS_ATOM_PORT, atom_port_uri_node)
-        PORTCHECKER_AND (IS_AUDIO_IN, IS_AUDIO_PORT, IS_INPUT_PORT)
-        PORTCHECKER_AND (IS_AUDIO_OUT, IS_AUDIO_PORT, IS_OUTPUT_PORT)
+    // patch:writable / patch:readable properties become parameters whose IDs follow the port indices.
+    void registerProperty(uint32_t propertyIndex) {
+        auto property = descriptor->property(propertyIndex);
+        aap_parameter_info_t info{0, {}, {}, 0, 1, 0, 0};
+        info.path[0] = '\0';
+        info.stable_id = static_cast<int16_t>(descriptor->numPorts() + propertyIndex);
+        strncpy(info.display_name, descriptor->string(property->label), sizeof(info.display_name));
+
+        auto range = descriptor->string(property->range);
+        bool isToggled = !strcmp(range, LV2_ATOM__Bool);
+        bool isInteger = !strcmp(range, LV2_ATOM__Int) || !strcmp(range, LV2_ATOM__Long);
+        bool hasDefault = property->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_DEFAULT;
+        info.default_value = hasDefault ? property->default_value : 0;
+        info.min_value = isToggled ? 0 : property->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM ? property->minimum : 0;
+        info.max_value = isToggled ? 1 : property->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_MAXIMUM ? property->maximum : 1;
+        if (isInteger || isToggled)
+            info.default_value = (int32_t) info.default_value;
+
+        auto &meta = parameter_metadata[info.stable_id];
+        meta.parameter_index = (int32_t) aapParams.size();
+        meta.property_index = (int32_t) propertyIndex;
+        meta.min_value = info.min_value;
+        meta.max_value = info.max_value;
+        meta.default_value = info.default_value;
+        meta.is_discrete = isInteger || isToggled;
+        meta.first_enum = (int32_t) aapEnums.size();
+        meta.num_enums = 0;
+        aapParams.emplace_back(info);
+    }
 
     void buildParameterList() {
         aapParams.clear();
-        aapParamIdToEnumIndex.clear();
         aapEnums.clear();
+        parameter_metadata.assign(descriptor->numPorts() + descriptor->numProperties(), AAPLV2ParameterMetadata{});
 
-        for (uint32_t p = 0; p < lilv_plugin_get_num_ports(plugin); p++) {
-            auto port = lilv_plugin_get_port_by_index(plugin, p);
-            if (!IS_CONTROL_PORT(plugin, port))
+        for (uint32_t p = 0; p < descriptor->numPorts(); p++) {
+            if (!aap_lv2_port_is(descriptor, p, AAP_LV2_DESCRIPTOR_PORT_CONTROL))
                 continue;
-            registerParameter(plugin, port);
+            registerParameter(p);
+        }
+        for (uint32_t p = 0; p < descriptor->numProperties(); p++)
+            registerProperty(p);
+
+        auto numPorts = descriptor->numPorts();
+        port_symbols.clear();
+        port_symbols.reserve(numPorts);
+        for (uint32_t p = 0; p < numPorts; p++)
+            port_symbols.add(descriptor->string(descriptor->port(p)->symbol), p);
+        port_symbols.sort();
+
+        state_snapshot.port_generations.reset(new std::atomic<uint64_t>[numPorts]());
+        auto &tracker = parameter_changes;
+        tracker.deadbands.assign(numPorts, 0);
+        tracker.input_ports.assign(aap_lv2_change_mask_words(numPorts), 0);
+        tracker.output_ports.assign(aap_lv2_change_mask_words(numPorts), 0);
+        for (uint32_t p = 0; p < numPorts; p++) {
+            auto meta = getParameterMetadata((int32_t) p);
+            if (!meta || meta->port_index < 0)
+                continue;
+            auto bit = (uint64_t) 1 << (p % AAP_LV2_CHANGE_MASK_BITS);
+            if (aap_lv2_port_is(descriptor, p, AAP_LV2_DESCRIPTOR_PORT_INPUT)) {
+                tracker.input_ports[p / AAP_LV2_CHANGE_MASK_BITS] |= bit;
+                continue;
+            }
+            tracker.output_ports[p / AAP_LV2_CHANGE_MASK_BITS] |= bit;
+            if (!meta->is_discrete && meta->num_enums == 0 && !aap_lv2_port_is(descriptor, p, AAP_LV2_DESCRIPTOR_PORT_INTEGER))
+                tracker.deadbands[p] = (float) ((meta->max_value - meta->min_value) * options.output_parameter_deadband);
         }
     }
 
+    // It has to be called once the URID map is ready.
+    void mapPatchProperties() {
+        auto map = &features.urid_map_feature_data;
+        patch_property_parameters.clear();
+        for (auto &meta : parameter_metadata) {
+            if (meta.property_index < 0)
+                continue;
+            auto property = descriptor->property(meta.property_index);
+            auto range = descriptor->string(property->range);
+            meta.property_urid = map->map(map->handle, descriptor->string(property->uri));
+            meta.value_type = map->map(map->handle, range[0] ? range : LV2_ATOM__Float);
+            patch_property_parameters.emplace_back(meta.property_urid, aapParams[meta.parameter_index].stable_id);
+        }
+        std::sort(patch_property_parameters.begin(), patch_property_parameters.end());
+    }
+
+    // returns -1 if the URID is not a patch property parameter.
+    int32_t getParameterIdForPatchProperty(LV2_URID property) const {
+        auto it = std::lower_bound(patch_property_parameters.begin(), patch_property_parameters.end(),
+                                   std::pair<LV2_URID, int32_t>{property, INT32_MIN});
+        return it != patch_property_parameters.end() && it->first == property ? it->second : -1;
+    }
+
+    // returns -1 if there is no port of the symbol.
+    int32_t getPortIndexForSymbol(const char *symbol) const {
+        return port_symbols.find(symbol);
+    }
+
+    // returns nullptr if parameterId is not a valid parameter.
+    const AAPLV2ParameterMetadata* getParameterMetadata(int32_t parameterId) const {
+        if (parameterId < 0 || parameterId >= (int32_t) parameter_metadata.size())
+            return nullptr;
+        auto meta = &parameter_metadata[parameterId];
+        return meta->parameter_index < 0 ? nullptr : meta;
+    }
+
     int32_t getAAPParameterCount() { return aapParams.size(); }
-    aap_parameter_info_t getAAPParameterInfo(int index) { return *aapParams[index]; }
+    aap_parameter_info_t getAAPParameterInfo(int index) { return aapParams[index]; }
     void markAllParameterValuesDirty() {
-        emit_all_parameter_values = true;
-        last_emitted_parameter_values.assign(
-                lilv_plugin_get_num_ports(plugin),
+        parameter_changes.emit_all = true;
+        parameter_changes.frames_until_output = 0;
+        parameter_changes.last_emitted_values.assign(
+                descriptor->numPorts(),
                 std::numeric_limits<float>::quiet_NaN());
     }
     double getAAPParameterProperty(int32_t parameterId, int32_t propertyId) {
-        for (auto info: aapParams) {
-            if (info->stable_id == parameterId) {
-                switch (propertyId) {
-                    case AAP_PARAMETER_PROPERTY_MIN_VALUE:
-                        return info->min_value;
-                    case AAP_PARAMETER_PROPERTY_MAX_VALUE:
-                        return info->max_value;
-                    case AAP_PARAMETER_PROPERTY_DEFAULT_VALUE:
-                        return info->default_value;
-                    case AAP_PARAMETER_PROPERTY_IS_DISCRETE: {
-                        auto port = lilv_plugin_get_port_by_index(plugin, parameterId);
-                        auto value = lilv_port_get_value(plugin, port, statics->discrete_cv_uri_node);
-                        if (value != nullptr)
-                            return lilv_node_as_float((LilvNode*) value);
-                    }
-                        // LV2 does not have it (yet?)
-                    case AAP_PARAMETER_PROPERTY_PRIORITY:
-                        return 0;
-                }
-            }
+        auto meta = getParameterMetadata(parameterId);
+        if (!meta)
+            return 0;
+        switch (propertyId) {
+            case AAP_PARAMETER_PROPERTY_MIN_VALUE:
+                return meta->min_value;
+            case AAP_PARAMETER_PROPERTY_MAX_VALUE:
+                return meta->max_value;
+            case AAP_PARAMETER_PROPERTY_DEFAULT_VALUE:
+                return meta->default_value;
+            case AAP_PARAMETER_PROPERTY_IS_DISCRETE:
+                return meta->is_discrete ? 1 : 0;
+            // LV2 does not have it (yet?)
+            case AAP_PARAMETER_PROPERTY_PRIORITY:
+                return 0;
         }
         return 0;
     }
     int32_t getAAPEnumerationCount(int32_t parameterId) {
-        auto port = lilv_plugin_get_port_by_index(plugin, parameterId);
-        LilvScalePoints* scalePoints = lilv_port_get_scale_points(plugin, port);
-        return scalePoints != nullptr ? lilv_scale_points_size(scalePoints) : 0;
+        auto meta = getParameterMetadata(parameterId);
+        return meta ? meta->num_enums : 0;
     }
     aap_parameter_enum_t getAAPEnumeration(int32_t parameterId, int32_t enumIndex) {
-        int32_t baseIndex = aapParamIdToEnumIndex[parameterId];
-        return *aapEnums[baseIndex + enumIndex];
+        auto meta = getParameterMetadata(parameterId);
+        if (!meta || enumIndex < 0 || enumIndex >= meta->num_enums)
+            return aap_parameter_enum_t{};
+        return aapEnums[meta->first_enum + enumIndex];
     }
 
 
     // from jalv codebase
-    Symap *symap{nullptr};          ///< URI map
-    ZixSem symap_lock;     ///< Lock for URI map
     JalvWorker worker;         ///< Worker thread implementation
     JalvWorker state_worker;   ///< Synchronous worker for state restore
     ZixSem work_lock;      ///< Lock for plugin work() method
@@ -430,24 +1095,17 @@ public:
     bool exit{false};
 };
 
+// The handle is the process-wide AAPLV2UridMap.
 static LV2_URID
 map_uri(LV2_URID_Map_Handle handle,
         const char *uri) {
-    auto ctx = (AAPLV2PluginContext *) handle;
-    zix_sem_wait(&ctx->symap_lock);
-    const LV2_URID id = symap_map(ctx->symap, uri);
-    zix_sem_post(&ctx->symap_lock);
-    return id;
+    return ((AAPLV2UridMap *) handle)->map(uri);
 }
 
 static const char *
 unmap_uri(LV2_URID_Unmap_Handle handle,
           LV2_URID urid) {
-    auto ctx = (AAPLV2PluginContext *) handle;
-    zix_sem_wait(&ctx->symap_lock);
-    const char *uri = symap_unmap(ctx->symap, urid);
-    zix_sem_post(&ctx->symap_lock);
-    return uri;
+    return ((AAPLV2UridMap *) handle)->unmap(urid);
 }
 
 
@@ -478,6 +1136,12 @@ void aap_lv2_plugin_process(AndroidAudioPlugin *plugin,
 
 void aap_lv2_plugin_deactivate(AndroidAudioPlugin *plugin);
 
+// Logs the restore latencies and the restores that were not committed (outside the audio thread).
+void aap_lv2_report_restores(AAPLV2PluginContext* ctx);
+
+// Commits the ControlPort values of a published restore (see aap_lv2_restore()).
+void commitRestoredPortValues(AAPLV2PluginContext* ctx);
+
 }
 
 #endif // ifndef AAP_LV2_INTERNAL_INCLUDED
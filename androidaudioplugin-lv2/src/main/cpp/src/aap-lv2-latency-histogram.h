@@ -0,0 +1,94 @@
+#ifndef AAP_LV2_LATENCY_HISTOGRAM_INCLUDED
+#define AAP_LV2_LATENCY_HISTOGRAM_INCLUDED 1
+
+// Log-linear histogram of durations, in the manner of HdrHistogram.
+// Values are bucketed by their power of two, with 8 linear sub-buckets each, so that the error of
+// a percentile is within 12.5% over the whole range (from a microsecond to hours), with a fixed
+// number of buckets. Recording is a few bit operations and relaxed atomic updates, so it can be
+// done on the audio thread, while another thread reads the histogram.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+#define AAP_LV2_HISTOGRAM_SUB_BUCKET_BITS 3
+#define AAP_LV2_HISTOGRAM_SUB_BUCKETS (1 << AAP_LV2_HISTOGRAM_SUB_BUCKET_BITS)
+// Values are recorded in units of 1024 nanoseconds (about a microsecond).
+#define AAP_LV2_HISTOGRAM_UNIT_SHIFT 10
+// Units up to 2^(this + sub bucket bits + 1) are distinguished; larger ones go to the last bucket.
+#define AAP_LV2_HISTOGRAM_MAX_EXPONENT 32
+#define AAP_LV2_HISTOGRAM_NUM_BUCKETS (AAP_LV2_HISTOGRAM_SUB_BUCKETS * (AAP_LV2_HISTOGRAM_MAX_EXPONENT + 2))
+
+class AAPLV2LatencyHistogram {
+    std::atomic<uint32_t> counts[AAP_LV2_HISTOGRAM_NUM_BUCKETS]{};
+    std::atomic<uint64_t> total_count{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+
+    static int bucketOf(uint64_t units) {
+        if (units < AAP_LV2_HISTOGRAM_SUB_BUCKETS)
+            return (int) units;
+        int exponent = 63 - __builtin_clzll(units) - AAP_LV2_HISTOGRAM_SUB_BUCKET_BITS;
+        if (exponent > AAP_LV2_HISTOGRAM_MAX_EXPONENT)
+            return AAP_LV2_HISTOGRAM_NUM_BUCKETS - 1;
+        return AAP_LV2_HISTOGRAM_SUB_BUCKETS * (exponent + 1) + (int) ((units >> exponent) - AAP_LV2_HISTOGRAM_SUB_BUCKETS);
+    }
+
+    // the smallest value (in units) that goes to the bucket.
+    static uint64_t lowerBoundOf(int bucket) {
+        if (bucket < AAP_LV2_HISTOGRAM_SUB_BUCKETS)
+            return (uint64_t) bucket;
+        int exponent = bucket / AAP_LV2_HISTOGRAM_SUB_BUCKETS - 1;
+        uint64_t subBucket = bucket % AAP_LV2_HISTOGRAM_SUB_BUCKETS;
+        return (AAP_LV2_HISTOGRAM_SUB_BUCKETS + subBucket) << exponent;
+    }
+
+public:
+    void record(int64_t ns) {
+        auto value = (uint64_t) (ns < 0 ? 0 : ns);
+        counts[bucketOf(value >> AAP_LV2_HISTOGRAM_UNIT_SHIFT)].fetch_add(1, std::memory_order_relaxed);
+        total_count.fetch_add(1, std::memory_order_relaxed);
+        total_ns.fetch_add(value, std::memory_order_relaxed);
+        auto currentMax = max_ns.load(std::memory_order_relaxed);
+        while (value > currentMax && !max_ns.compare_exchange_weak(currentMax, value, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return total_count.load(std::memory_order_relaxed); }
+
+    uint64_t maxNs() const { return max_ns.load(std::memory_order_relaxed); }
+
+    uint64_t meanNs() const {
+        auto n = count();
+        return n == 0 ? 0 : total_ns.load(std::memory_order_relaxed) / n;
+    }
+
+    // The value (in nanoseconds) below which `percentile` percent of the recorded values fall.
+    // It is the upper bound of the bucket (but not larger than the maximum).
+    uint64_t percentileNs(double percentile) const {
+        auto n = count();
+        if (n == 0)
+            return 0;
+        auto target = (uint64_t) (percentile / 100.0 * (double) n + 0.5);
+        if (target < 1)
+            target = 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < AAP_LV2_HISTOGRAM_NUM_BUCKETS; b++) {
+            seen += counts[b].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                auto upper = b + 1 < AAP_LV2_HISTOGRAM_NUM_BUCKETS ? lowerBoundOf(b + 1) : UINT64_MAX >> AAP_LV2_HISTOGRAM_UNIT_SHIFT;
+                return std::min(upper << AAP_LV2_HISTOGRAM_UNIT_SHIFT, maxNs());
+            }
+        }
+        return maxNs();
+    }
+
+    void reset() {
+        for (auto &c : counts)
+            c.store(0, std::memory_order_relaxed);
+        total_count.store(0, std::memory_order_relaxed);
+        total_ns.store(0, std::memory_order_relaxed);
+        max_ns.store(0, std::memory_order_relaxed);
+    }
+};
+
+#endif // ifndef AAP_LV2_LATENCY_HISTOGRAM_INCLUDED
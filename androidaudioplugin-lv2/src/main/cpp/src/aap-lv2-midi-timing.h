@@ -0,0 +1,149 @@
+#ifndef AAP_LV2_MIDI_TIMING_INCLUDED
+#define AAP_LV2_MIDI_TIMING_INCLUDED 1
+
+// Timing of the UMP input, in process().
+// It turns JR Timestamps (1/31250 sec.) and UMP 1.1 Delta Clockstamps (ticks of the sender's
+// DCTPQ at the current tempo) into frame offsets within the block. Positions are accumulated in
+// 32.32 fixed point frames, so that there is no per-event division. The conversion factors are
+// recalculated only when the sample rate, DCTPQ or tempo changes.
+//
+// JR Clock messages tell the sender's clock at the time of sending. Their progress is compared
+// to our own clock (the frames we have processed) to estimate the drift of the sender clock,
+// and JR Timestamps are scaled by it.
+
+#include <cstdint>
+#include <algorithm>
+
+// UMP 1.1 Utility Messages (in the same encoding as CMIDI2_UTILITY_STATUS_*); cmidi2 does not have them.
+#define AAP_LV2_UTILITY_STATUS_DCTPQ 0x30
+#define AAP_LV2_UTILITY_STATUS_DELTA_CLOCKSTAMP 0x40
+
+#define AAP_LV2_JR_TICKS_PER_SECOND 31250
+// Default tempo (120 BPM) in the unit of Flex Data Set Tempo (10 nanoseconds per quarter note).
+#define AAP_LV2_DEFAULT_TEMPO 50000000
+// The drift estimate is a 16.16 fixed point ratio of our clock to the sender clock, limited to
+// this many parts per million, so that a burst of jittery JR Clocks cannot skew the timing too much.
+#define AAP_LV2_MAX_CLOCK_DRIFT_PPM 10000
+// JR Clocks closer than this (in JR ticks, 10 msec.) to the previous one are not used for the
+// estimate, as the quantization error would be larger than the drift itself.
+#define AAP_LV2_MIN_JR_CLOCK_INTERVAL 312
+
+class AAPLV2MidiTiming {
+    static constexpr int64_t ONE = (int64_t) 1 << 16;
+
+    int32_t sample_rate{48000};
+    // frames per JR tick and per Delta Clockstamp tick, in 32.32 fixed point.
+    uint64_t frames_per_jr_tick{0};
+    uint64_t frames_per_dc_tick{0};
+    uint32_t ticks_per_quarter_note{0};
+    uint32_t tempo{AAP_LV2_DEFAULT_TEMPO};
+
+    // the position in the current block, in 32.32 fixed point frames.
+    uint64_t position{0};
+    // frames processed before the current block, and the length of the current block.
+    uint64_t block_start_frame{0};
+    int32_t block_frames{0};
+
+    // drift as the ratio of our clock to the sender clock, in 16.16 fixed point.
+    int64_t drift{ONE};
+    bool has_jr_clock{false};
+    uint16_t last_sender_clock{0};
+    uint64_t last_local_clock{0};
+
+    void updateDeltaClockstampFactor() {
+        // computed only when DCTPQ or tempo changes.
+        frames_per_dc_tick = ticks_per_quarter_note == 0 ? 0 : (uint64_t) (
+                (double) tempo / 100000000.0 / ticks_per_quarter_note * sample_rate * 4294967296.0);
+    }
+
+    // Saturates instead of wrapping around. A huge delta (e.g. a long Delta Clockstamp at a slow tempo)
+    // just means that the rest of the events are carried to later blocks.
+    void advance(unsigned __int128 delta) {
+        position = delta >= UINT64_MAX - position ? UINT64_MAX : position + (uint64_t) delta;
+    }
+
+    // our clock at the current position, in JR ticks.
+    uint64_t localClock() const {
+        return (block_start_frame + (position >> 32)) * AAP_LV2_JR_TICKS_PER_SECOND / sample_rate;
+    }
+
+public:
+    // statistics
+    uint64_t num_jr_clocks{0};
+    uint64_t num_rejected_jr_clocks{0};
+
+    void setSampleRate(int32_t sampleRate) {
+        sample_rate = sampleRate;
+        frames_per_jr_tick = ((uint64_t) sampleRate << 32) / AAP_LV2_JR_TICKS_PER_SECOND;
+        updateDeltaClockstampFactor();
+        reset();
+    }
+
+    void reset() {
+        position = 0;
+        block_start_frame = 0;
+        block_frames = 0;
+        drift = ONE;
+        has_jr_clock = false;
+    }
+
+    // It has to be called at the beginning of every block, whether there is any input or not.
+    void beginBlock(int32_t frameCount) {
+        block_start_frame += block_frames;
+        block_frames = frameCount;
+        position = 0;
+    }
+
+    void onJRClock(uint16_t senderClock) {
+        num_jr_clocks++;
+        auto local = localClock();
+        if (has_jr_clock) {
+            auto senderElapsed = (uint16_t) (senderClock - last_sender_clock);
+            if (senderElapsed < AAP_LV2_MIN_JR_CLOCK_INTERVAL)
+                return;
+            auto localElapsed = (int64_t) (local - last_local_clock);
+            // the 16-bit sender clock wraps around in about 2 seconds. Beyond that, we cannot tell the elapsed time.
+            if (localElapsed <= 0 || localElapsed >= 0x10000) {
+                num_rejected_jr_clocks++;
+            } else {
+                auto ratio = (localElapsed << 16) / senderElapsed;
+                auto limit = ONE * AAP_LV2_MAX_CLOCK_DRIFT_PPM / 1000000;
+                ratio = std::clamp(ratio, ONE - limit, ONE + limit);
+                // exponential moving average, to smooth out the jitter.
+                drift += (ratio - drift) / 16;
+            }
+        }
+        has_jr_clock = true;
+        last_sender_clock = senderClock;
+        last_local_clock = local;
+    }
+
+    void onJRTimestamp(uint16_t ticks) {
+        advance((unsigned __int128) ((uint64_t) ticks * frames_per_jr_tick >> 16) * (uint64_t) drift);
+    }
+
+    void onDeltaClockstampTicksPerQuarterNote(uint16_t ticksPerQuarterNote) {
+        ticks_per_quarter_note = ticksPerQuarterNote;
+        updateDeltaClockstampFactor();
+    }
+
+    void onDeltaClockstamp(uint32_t ticks) {
+        // (a Delta Clockstamp has 20 bits, and the factor can be up to 64 bits at a slow tempo)
+        advance((unsigned __int128) ticks * frames_per_dc_tick);
+    }
+
+    // `tempo` is in 10 nanoseconds per quarter note (as in Flex Data Set Tempo).
+    void onSetTempo(uint32_t newTempo) {
+        if (newTempo == 0 || newTempo == tempo)
+            return;
+        tempo = newTempo;
+        updateDeltaClockstampFactor();
+    }
+
+    int64_t currentFrame() const { return (int64_t) (position >> 32); }
+
+    // the estimated drift of the sender clock, in parts per million (positive if it runs slower than ours).
+    int32_t driftPpm() const { return (int32_t) ((drift - ONE) * 1000000 / ONE); }
+};
+
+#endif // ifndef AAP_LV2_MIDI_TIMING_INCLUDED
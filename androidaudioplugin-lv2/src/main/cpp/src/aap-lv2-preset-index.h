@@ -0,0 +1,81 @@
+#ifndef AAP_LV2_PRESET_INDEX_INCLUDED
+#define AAP_LV2_PRESET_INDEX_INCLUDED 1
+
+// The preset index is built from the preset labels only (see jalv_load_presets()). A preset resource
+// is loaded only if its label is not in the data that is already loaded (labels are usually in the
+// bundle manifest). Factory presets usually share one file, so the files stay loaded until all the
+// labels are collected (then the following presets in the same file need no loading), and they are
+// unloaded together, so that listing presets neither parses a file twice nor keeps the preset bodies.
+// It depends only on lilv, so that the desktop benchmarks can measure it.
+
+#include <cstdint>
+#include <vector>
+
+#include <lilv/lilv.h>
+
+// The preset resources that were loaded into the world to be read, to unload them when they are no
+// longer needed. A resource is recorded only if loading it parsed all of its rdfs:seeAlso files, so
+// that unloading it never drops what was loaded before (such as the plugin data, or a preset file
+// that another instance in the same world has loaded); such a resource is left loaded.
+class AAPLV2PresetResources {
+    LilvWorld* world;
+    const LilvNode* see_also_predicate;
+    std::vector<LilvNode*> loaded{};
+
+public:
+    AAPLV2PresetResources(LilvWorld* lilvWorld, const LilvNode* seeAlsoPredicate)
+            : world(lilvWorld), see_also_predicate(seeAlsoPredicate) {
+    }
+    // (the world must still be alive.)
+    ~AAPLV2PresetResources() { unloadAll(); }
+
+    // Loads the files of the preset resource (lilv skips the files that are already loaded). Returns
+    // false if nothing had to be loaded.
+    bool load(const LilvNode* preset) {
+        LilvNodes* files = lilv_world_find_nodes(world, preset, see_also_predicate, nullptr);
+        int numFiles = files ? (int) lilv_nodes_size(files) : 0;
+        if (files)
+            lilv_nodes_free(files);
+        int numParsed = lilv_world_load_resource(world, preset);
+        if (numParsed <= 0)
+            return false;
+        if (numParsed == numFiles)
+            loaded.emplace_back(lilv_node_duplicate(preset));
+        return true;
+    }
+
+    void unloadAll() {
+        for (auto preset : loaded) {
+            lilv_world_unload_resource(world, preset);
+            lilv_node_free(preset);
+        }
+        loaded.clear();
+    }
+};
+
+// Calls `sink(preset, label)` for each preset of the plugin, in the order of lilv_plugin_get_related().
+// `label` is nullptr for a preset that has no rdfs:label. The nodes are valid only within the call.
+// Returns the number of the preset resources that had to be loaded for their labels.
+template <typename F>
+static inline int32_t aap_lv2_index_presets(LilvWorld* world, const LilvPlugin* plugin, const LilvNode* presetClass,
+                                            const LilvNode* labelPredicate, const LilvNode* seeAlsoPredicate, F&& sink) {
+    int32_t numLoaded = 0;
+    AAPLV2PresetResources resources{world, seeAlsoPredicate};
+    LilvNodes* presets = lilv_plugin_get_related(plugin, presetClass);
+    LILV_FOREACH(nodes, i, presets) {
+        const LilvNode* preset = lilv_nodes_get(presets, i);
+        LilvNodes* labels = lilv_world_find_nodes(world, preset, labelPredicate, nullptr);
+        if (!labels && resources.load(preset)) {
+            numLoaded++;
+            labels = lilv_world_find_nodes(world, preset, labelPredicate, nullptr);
+        }
+        sink(preset, labels ? lilv_nodes_get_first(labels) : nullptr);
+        if (labels)
+            lilv_nodes_free(labels);
+    }
+    lilv_nodes_free(presets);
+    resources.unloadAll();
+    return numLoaded;
+}
+
+#endif // ifndef AAP_LV2_PRESET_INDEX_INCLUDED
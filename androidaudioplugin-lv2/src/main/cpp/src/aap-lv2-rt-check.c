@@ -0,0 +1,443 @@
+// Real-time safety checking mode. See aap-lv2-rt-check.h for details.
+// This file is compiled only when AAP_LV2_ENABLE_RT_CHECK is ON.
+//
+// It is written in C so that the interposed libc functions can be defined with the exact
+// same signatures as libc declares (C++ would complain about exception specifications).
+
+#define _GNU_SOURCE 1
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <semaphore.h>
+#if ANDROID
+#include <android/log.h>
+#endif
+
+#include "aap-lv2-rt-check.h"
+
+#define AAP_LV2_TAG "aap-lv2"
+#define AAP_LV2_RT_CHECK_MAX_SITES 256
+
+static const char* violation_kind_names[AAP_LV2_RT_VIOLATION_NUM_KINDS] = {
+        "malloc", "free", "realloc", "calloc", "operator new", "operator delete",
+        "mutex lock", "semaphore wait", "condition wait", "logging"
+};
+
+typedef struct {
+    // (call site << 8) | kind, or 0 if the slot is unused.
+    _Atomic uint64_t key;
+    _Atomic uint64_t count;
+} rt_violation_site;
+
+struct AAPLV2RealtimeCounters {
+    rt_violation_site sites[AAP_LV2_RT_CHECK_MAX_SITES];
+    _Atomic uint64_t counts[AAP_LV2_RT_VIOLATION_NUM_KINDS];
+    _Atomic uint64_t without_site;
+};
+
+// They are "initial-exec" so that accessing them never allocates (which would recurse into malloc()).
+// The counters of the real-time span that the thread is in, or NULL.
+static __thread AAPLV2RealtimeCounters* current_counters __attribute__((tls_model("initial-exec"))) = NULL;
+// Non-zero while an interposed function calls the real one that may call other interposed functions
+// (e.g. operator new -> malloc), so that the violation is counted only once, at the outermost call site.
+static __thread int in_hook __attribute__((tls_model("initial-exec"))) = 0;
+
+// Lock-free and allocation-free, as it is called within the interposed functions.
+static void record_violation(AAPLV2RealtimeCounters* counters, int kind, void* caller) {
+    atomic_fetch_add_explicit(&counters->counts[kind], 1, memory_order_relaxed);
+    uint64_t key = ((uint64_t) (uintptr_t) caller << 8) | (uint64_t) kind;
+    uint32_t start = (uint32_t) ((key >> 4) * 2654435761u) % AAP_LV2_RT_CHECK_MAX_SITES;
+    for (uint32_t i = 0; i < AAP_LV2_RT_CHECK_MAX_SITES; i++) {
+        rt_violation_site* site = &counters->sites[(start + i) % AAP_LV2_RT_CHECK_MAX_SITES];
+        uint64_t current = atomic_load_explicit(&site->key, memory_order_acquire);
+        if (current == 0) {
+            uint64_t expected = 0;
+            if (atomic_compare_exchange_strong(&site->key, &expected, key))
+                current = key;
+            else
+                current = expected;
+        }
+        if (current == key) {
+            atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed);
+            return;
+        }
+    }
+    atomic_fetch_add_explicit(&counters->without_site, 1, memory_order_relaxed);
+}
+
+// It has to be used directly in the interposed function, so that the return address is its caller.
+#define CHECK_RT(kind) \
+    if (current_counters && !in_hook) \
+        record_violation(current_counters, kind, __builtin_return_address(0))
+
+// Calls the real function without counting what it calls.
+#define CALL_REAL(result, call) \
+    do { in_hook++; result = call; in_hook--; } while (0)
+
+AAPLV2RealtimeCounters* aap_lv2_rt_check_counters_new() {
+    return (AAPLV2RealtimeCounters*) calloc(1, sizeof(AAPLV2RealtimeCounters));
+}
+
+void aap_lv2_rt_check_counters_free(AAPLV2RealtimeCounters* counters) {
+    free(counters);
+}
+
+AAPLV2RealtimeCounters* aap_lv2_rt_check_enter(AAPLV2RealtimeCounters* counters) {
+    AAPLV2RealtimeCounters* previous = current_counters;
+    current_counters = counters;
+    return previous;
+}
+
+void aap_lv2_rt_check_leave(AAPLV2RealtimeCounters* previous) {
+    current_counters = previous;
+}
+
+uint64_t aap_lv2_rt_check_get_violation_count(const AAPLV2RealtimeCounters* counters, int32_t kind) {
+    if (!counters || kind >= AAP_LV2_RT_VIOLATION_NUM_KINDS)
+        return 0;
+    if (kind >= 0)
+        return atomic_load(&counters->counts[kind]);
+    uint64_t ret = 0;
+    for (int i = 0; i < AAP_LV2_RT_VIOLATION_NUM_KINDS; i++)
+        ret += atomic_load(&counters->counts[i]);
+    return ret;
+}
+
+int32_t aap_lv2_rt_check_get_violation_sites(const AAPLV2RealtimeCounters* counters, int32_t kind, void** sites, int32_t maxSites) {
+    int32_t ret = 0;
+    for (int i = 0; counters && i < AAP_LV2_RT_CHECK_MAX_SITES && ret < maxSites; i++) {
+        uint64_t key = atomic_load(&counters->sites[i].key);
+        if (key && (int32_t) (key & 0xFF) == kind)
+            sites[ret++] = (void*) (uintptr_t) (key >> 8);
+    }
+    return ret;
+}
+
+#if ANDROID
+#define rt_check_log(...) __android_log_print(ANDROID_LOG_WARN, AAP_LV2_TAG, __VA_ARGS__)
+#else
+#define rt_check_log(...) do { fprintf(stderr, AAP_LV2_TAG ": " __VA_ARGS__); fputc('\n', stderr); } while (0)
+#endif
+
+void aap_lv2_rt_check_report(const AAPLV2RealtimeCounters* counters, const char* name) {
+    if (aap_lv2_rt_check_get_violation_count(counters, -1) == 0)
+        return;
+    rt_check_log("Real-time violations in %s:", name);
+    for (int i = 0; i < AAP_LV2_RT_VIOLATION_NUM_KINDS; i++) {
+        uint64_t count = atomic_load(&counters->counts[i]);
+        if (count)
+            rt_check_log("  %s: %llu", violation_kind_names[i], (unsigned long long) count);
+    }
+    for (int i = 0; i < AAP_LV2_RT_CHECK_MAX_SITES; i++) {
+        const rt_violation_site* site = &counters->sites[i];
+        uint64_t key = atomic_load(&site->key);
+        uint64_t count = atomic_load(&site->count);
+        if (!key || !count)
+            continue;
+        void* caller = (void*) (uintptr_t) (key >> 8);
+        Dl_info info;
+        if (dladdr(caller, &info) && info.dli_fname)
+            rt_check_log("  %s from %s (%s+%#lx): %llu", violation_kind_names[key & 0xFF],
+                         info.dli_sname ? info.dli_sname : "?", info.dli_fname,
+                         (unsigned long) ((uintptr_t) caller - (uintptr_t) (info.dli_saddr ? info.dli_saddr : info.dli_fbase)),
+                         (unsigned long long) count);
+        else
+            rt_check_log("  %s from %p: %llu", violation_kind_names[key & 0xFF], caller, (unsigned long long) count);
+    }
+    uint64_t unknown = atomic_load(&counters->without_site);
+    if (unknown)
+        rt_check_log("  (%llu more violations from untracked call sites)", (unsigned long long) unknown);
+}
+
+// Interposed functions
+
+#if defined(__GLIBC__)
+// glibc exposes the actual allocator, which lets us avoid dlsym() (which may calloc()).
+extern void* __libc_malloc(size_t size);
+extern void __libc_free(void* ptr);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+#define real_malloc __libc_malloc
+#define real_free __libc_free
+#define real_realloc __libc_realloc
+#define real_calloc __libc_calloc
+#else
+#define REAL_FUNCTION(ret, name, ...) \
+    static ret (*real_##name)(__VA_ARGS__) = NULL; \
+    static void resolve_##name() { \
+        if (!real_##name) \
+            real_##name = (ret (*)(__VA_ARGS__)) dlsym(RTLD_NEXT, #name); \
+    }
+REAL_FUNCTION(void*, malloc, size_t)
+REAL_FUNCTION(void, free, void*)
+REAL_FUNCTION(void*, realloc, void*, size_t)
+REAL_FUNCTION(void*, calloc, size_t, size_t)
+#endif
+
+#define RESOLVE(name) \
+    if (!real_##name) \
+        real_##name = dlsym(RTLD_NEXT, #name)
+
+void* malloc(size_t size) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_MALLOC);
+#if !defined(__GLIBC__)
+    resolve_malloc();
+#endif
+    return real_malloc(size);
+}
+
+void free(void* ptr) {
+    if (ptr)
+        CHECK_RT(AAP_LV2_RT_VIOLATION_FREE);
+#if !defined(__GLIBC__)
+    resolve_free();
+#endif
+    real_free(ptr);
+}
+
+void* realloc(void* ptr, size_t size) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_REALLOC);
+#if !defined(__GLIBC__)
+    resolve_realloc();
+#endif
+    return real_realloc(ptr, size);
+}
+
+void* calloc(size_t count, size_t size) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_CALLOC);
+#if !defined(__GLIBC__)
+    resolve_calloc();
+#endif
+    return real_calloc(count, size);
+}
+
+// operator new/delete (their mangled names, as this is C). We have to interpose them as well, as
+// the malloc() calls within them would be recorded with a call site in libc++ otherwise.
+#if __SIZEOF_SIZE_T__ == 8
+#define OPERATOR_NEW _Znwm
+#define OPERATOR_NEW_ARRAY _Znam
+#define OPERATOR_DELETE_SIZED _ZdlPvm
+#define OPERATOR_DELETE_ARRAY_SIZED _ZdaPvm
+#else
+#define OPERATOR_NEW _Znwj
+#define OPERATOR_NEW_ARRAY _Znaj
+#define OPERATOR_DELETE_SIZED _ZdlPvj
+#define OPERATOR_DELETE_ARRAY_SIZED _ZdaPvj
+#endif
+#define OPERATOR_DELETE _ZdlPv
+#define OPERATOR_DELETE_ARRAY _ZdaPv
+#define STRINGIFY_NAME(name) #name
+#define REAL_NAME(name) STRINGIFY_NAME(name)
+#define RESOLVE_OPERATOR(real, name) \
+    if (!real) \
+        real = dlsym(RTLD_NEXT, REAL_NAME(name))
+
+static void* (*real_operator_new)(size_t) = NULL;
+static void* (*real_operator_new_array)(size_t) = NULL;
+static void (*real_operator_delete)(void*) = NULL;
+static void (*real_operator_delete_array)(void*) = NULL;
+static void (*real_operator_delete_sized)(void*, size_t) = NULL;
+static void (*real_operator_delete_array_sized)(void*, size_t) = NULL;
+
+// They may throw std::bad_alloc through these frames (this file is built with -fexceptions).
+void* OPERATOR_NEW(size_t size) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_OPERATOR_NEW);
+    RESOLVE_OPERATOR(real_operator_new, OPERATOR_NEW);
+    void* ret;
+    CALL_REAL(ret, real_operator_new(size));
+    return ret;
+}
+
+void* OPERATOR_NEW_ARRAY(size_t size) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_OPERATOR_NEW);
+    RESOLVE_OPERATOR(real_operator_new_array, OPERATOR_NEW_ARRAY);
+    void* ret;
+    CALL_REAL(ret, real_operator_new_array(size));
+    return ret;
+}
+
+void OPERATOR_DELETE(void* ptr) {
+    if (ptr)
+        CHECK_RT(AAP_LV2_RT_VIOLATION_OPERATOR_DELETE);
+    RESOLVE_OPERATOR(real_operator_delete, OPERATOR_DELETE);
+    in_hook++;
+    real_operator_delete(ptr);
+    in_hook--;
+}
+
+void OPERATOR_DELETE_ARRAY(void* ptr) {
+    if (ptr)
+        CHECK_RT(AAP_LV2_RT_VIOLATION_OPERATOR_DELETE);
+    RESOLVE_OPERATOR(real_operator_delete_array, OPERATOR_DELETE_ARRAY);
+    in_hook++;
+    real_operator_delete_array(ptr);
+    in_hook--;
+}
+
+void OPERATOR_DELETE_SIZED(void* ptr, size_t size) {
+    if (ptr)
+        CHECK_RT(AAP_LV2_RT_VIOLATION_OPERATOR_DELETE);
+    RESOLVE_OPERATOR(real_operator_delete_sized, OPERATOR_DELETE_SIZED);
+    in_hook++;
+    real_operator_delete_sized(ptr, size);
+    in_hook--;
+}
+
+void OPERATOR_DELETE_ARRAY_SIZED(void* ptr, size_t size) {
+    if (ptr)
+        CHECK_RT(AAP_LV2_RT_VIOLATION_OPERATOR_DELETE);
+    RESOLVE_OPERATOR(real_operator_delete_array_sized, OPERATOR_DELETE_ARRAY_SIZED);
+    in_hook++;
+    real_operator_delete_array_sized(ptr, size);
+    in_hook--;
+}
+
+static int (*real_pthread_mutex_lock)(pthread_mutex_t*) = NULL;
+static int (*real_pthread_cond_wait)(pthread_cond_t*, pthread_mutex_t*) = NULL;
+static int (*real_pthread_cond_timedwait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*) = NULL;
+static int (*real_sem_wait)(sem_t*) = NULL;
+static int (*real_sem_timedwait)(sem_t*, const struct timespec*) = NULL;
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_MUTEX_LOCK);
+    RESOLVE(pthread_mutex_lock);
+    int ret;
+    CALL_REAL(ret, real_pthread_mutex_lock(mutex));
+    return ret;
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_COND_WAIT);
+    RESOLVE(pthread_cond_wait);
+    int ret;
+    CALL_REAL(ret, real_pthread_cond_wait(cond, mutex));
+    return ret;
+}
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_COND_WAIT);
+    RESOLVE(pthread_cond_timedwait);
+    int ret;
+    CALL_REAL(ret, real_pthread_cond_timedwait(cond, mutex, abstime));
+    return ret;
+}
+
+int sem_wait(sem_t* sem) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_SEM_WAIT);
+    RESOLVE(sem_wait);
+    int ret;
+    CALL_REAL(ret, real_sem_wait(sem));
+    return ret;
+}
+
+int sem_timedwait(sem_t* sem, const struct timespec* abstime) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_SEM_WAIT);
+    RESOLVE(sem_timedwait);
+    int ret;
+    CALL_REAL(ret, real_sem_timedwait(sem, abstime));
+    return ret;
+}
+
+#if ANDROID
+static int (*real___android_log_write)(int, const char*, const char*) = NULL;
+static int (*real___android_log_vprint)(int, const char*, const char*, va_list) = NULL;
+
+int __android_log_write(int prio, const char* tag, const char* text) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_LOG);
+    RESOLVE(__android_log_write);
+    int ret;
+    CALL_REAL(ret, real___android_log_write(prio, tag, text));
+    return ret;
+}
+
+int __android_log_vprint(int prio, const char* tag, const char* fmt, va_list ap) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_LOG);
+    RESOLVE(__android_log_vprint);
+    int ret;
+    CALL_REAL(ret, real___android_log_vprint(prio, tag, fmt, ap));
+    return ret;
+}
+
+int __android_log_print(int prio, const char* tag, const char* fmt, ...) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_LOG);
+    RESOLVE(__android_log_vprint);
+    va_list ap;
+    va_start(ap, fmt);
+    int ret;
+    CALL_REAL(ret, real___android_log_vprint(prio, tag, fmt, ap));
+    va_end(ap);
+    return ret;
+}
+#else
+static int (*real_vfprintf)(FILE*, const char*, va_list) = NULL;
+
+int vfprintf(FILE* stream, const char* fmt, va_list ap) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_LOG);
+    RESOLVE(vfprintf);
+    int ret;
+    CALL_REAL(ret, real_vfprintf(stream, fmt, ap));
+    return ret;
+}
+
+int vprintf(const char* fmt, va_list ap) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_LOG);
+    RESOLVE(vfprintf);
+    int ret;
+    CALL_REAL(ret, real_vfprintf(stdout, fmt, ap));
+    return ret;
+}
+
+int fprintf(FILE* stream, const char* fmt, ...) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_LOG);
+    RESOLVE(vfprintf);
+    va_list ap;
+    va_start(ap, fmt);
+    int ret;
+    CALL_REAL(ret, real_vfprintf(stream, fmt, ap));
+    va_end(ap);
+    return ret;
+}
+
+int printf(const char* fmt, ...) {
+    CHECK_RT(AAP_LV2_RT_VIOLATION_LOG);
+    RESOLVE(vfprintf);
+    va_list ap;
+    va_start(ap, fmt);
+    int ret;
+    CALL_REAL(ret, real_vfprintf(stdout, fmt, ap));
+    va_end(ap);
+    return ret;
+}
+#endif
+
+// Resolve them before any instance starts processing, so that dlsym() does not run on the audio thread.
+__attribute__((constructor))
+static void aap_lv2_rt_check_init() {
+    RESOLVE(pthread_mutex_lock);
+    RESOLVE(pthread_cond_wait);
+    RESOLVE(pthread_cond_timedwait);
+    RESOLVE(sem_wait);
+    RESOLVE(sem_timedwait);
+#if ANDROID
+    RESOLVE(__android_log_write);
+    RESOLVE(__android_log_vprint);
+#else
+    RESOLVE(vfprintf);
+#endif
+    RESOLVE_OPERATOR(real_operator_new, OPERATOR_NEW);
+    RESOLVE_OPERATOR(real_operator_new_array, OPERATOR_NEW_ARRAY);
+    RESOLVE_OPERATOR(real_operator_delete, OPERATOR_DELETE);
+    RESOLVE_OPERATOR(real_operator_delete_array, OPERATOR_DELETE_ARRAY);
+    RESOLVE_OPERATOR(real_operator_delete_sized, OPERATOR_DELETE_SIZED);
+    RESOLVE_OPERATOR(real_operator_delete_array_sized, OPERATOR_DELETE_ARRAY_SIZED);
+#if !defined(__GLIBC__)
+    resolve_malloc();
+    resolve_free();
+    resolve_realloc();
+    resolve_calloc();
+#endif
+}
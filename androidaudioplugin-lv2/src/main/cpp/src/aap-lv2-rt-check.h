@@ -0,0 +1,96 @@
+#ifndef AAP_LV2_RT_CHECK_INCLUDED
+#define AAP_LV2_RT_CHECK_INCLUDED 1
+
+// Real-time safety checking mode.
+//
+// When the library is built with AAP_LV2_ENABLE_RT_CHECK, the span of aap_lv2_plugin_process()
+// is marked as real-time, and any call to malloc()/free()/realloc()/calloc(), operator new/delete,
+// blocking mutex/semaphore/condition waits, or logging that happens within that span on the same
+// thread (including calls from the plugin) is counted as a violation, along with its call site.
+// The counters belong to each plugin instance, and are reported when the instance is deleted.
+//
+// The checks work by symbol interposition, which means that calls from other libraries are
+// caught only if this library comes before libc in the symbol lookup scope (e.g. when the
+// test executable links to it, or it is LD_PRELOAD-ed). It is meant for desktop Linux test runs.
+// Without the build option, everything here compiles to nothing.
+
+#include <stdint.h>
+
+enum AAPLV2RealtimeViolationKind {
+    AAP_LV2_RT_VIOLATION_MALLOC,
+    AAP_LV2_RT_VIOLATION_FREE,
+    AAP_LV2_RT_VIOLATION_REALLOC,
+    AAP_LV2_RT_VIOLATION_CALLOC,
+    AAP_LV2_RT_VIOLATION_OPERATOR_NEW,
+    AAP_LV2_RT_VIOLATION_OPERATOR_DELETE,
+    AAP_LV2_RT_VIOLATION_MUTEX_LOCK,
+    AAP_LV2_RT_VIOLATION_SEM_WAIT,
+    AAP_LV2_RT_VIOLATION_COND_WAIT,
+    AAP_LV2_RT_VIOLATION_LOG,
+    AAP_LV2_RT_VIOLATION_NUM_KINDS
+};
+
+#if AAP_LV2_RT_CHECK
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Violation counters (and call sites). They are never reset.
+typedef struct AAPLV2RealtimeCounters AAPLV2RealtimeCounters;
+
+AAPLV2RealtimeCounters* aap_lv2_rt_check_counters_new();
+void aap_lv2_rt_check_counters_free(AAPLV2RealtimeCounters* counters);
+
+// Marks the calling thread as real-time, counting the violations into `counters`, until leave().
+// Returns the counters of the enclosing span (if any), which has to be passed to leave().
+AAPLV2RealtimeCounters* aap_lv2_rt_check_enter(AAPLV2RealtimeCounters* counters);
+void aap_lv2_rt_check_leave(AAPLV2RealtimeCounters* previous);
+// Returns the number of violations of the kind so far (all kinds if `kind` is negative).
+uint64_t aap_lv2_rt_check_get_violation_count(const AAPLV2RealtimeCounters* counters, int32_t kind);
+// Stores up to `maxSites` call sites of the violations of the kind, and returns the number of them.
+int32_t aap_lv2_rt_check_get_violation_sites(const AAPLV2RealtimeCounters* counters, int32_t kind, void** sites, int32_t maxSites);
+// Logs the violations with their call sites.
+void aap_lv2_rt_check_report(const AAPLV2RealtimeCounters* counters, const char* name);
+
+#ifdef __cplusplus
+}
+
+// Owns the counters of a plugin instance.
+class AAPLV2RealtimeCheck {
+    AAPLV2RealtimeCounters* counters{aap_lv2_rt_check_counters_new()};
+
+public:
+    AAPLV2RealtimeCheck() = default;
+    AAPLV2RealtimeCheck(const AAPLV2RealtimeCheck&) = delete;
+    AAPLV2RealtimeCheck& operator=(const AAPLV2RealtimeCheck&) = delete;
+    ~AAPLV2RealtimeCheck() { aap_lv2_rt_check_counters_free(counters); }
+
+    AAPLV2RealtimeCounters* get() const { return counters; }
+};
+
+class AAPLV2RealtimeScope {
+    AAPLV2RealtimeCounters* previous;
+
+public:
+    explicit AAPLV2RealtimeScope(const AAPLV2RealtimeCheck& check) : previous(aap_lv2_rt_check_enter(check.get())) {}
+    ~AAPLV2RealtimeScope() { aap_lv2_rt_check_leave(previous); }
+};
+
+#define AAP_LV2_RT_SCOPE(check) AAPLV2RealtimeScope aap_lv2_rt_scope{check}
+#define AAP_LV2_RT_CHECK_REPORT(check, name) aap_lv2_rt_check_report((check).get(), name)
+#endif
+
+#else
+
+#ifdef __cplusplus
+// (nothing to count.)
+class AAPLV2RealtimeCheck {};
+#endif
+
+#define AAP_LV2_RT_SCOPE(check)
+#define AAP_LV2_RT_CHECK_REPORT(check, name)
+
+#endif // AAP_LV2_RT_CHECK
+
+#endif // ifndef AAP_LV2_RT_CHECK_INCLUDED
@@ -0,0 +1,126 @@
+#ifndef AAP_LV2_SPSC_RING_INCLUDED
+#define AAP_LV2_SPSC_RING_INCLUDED 1
+
+// A single-producer single-consumer ring buffer of variable size messages, for the LV2 worker.
+// The storage is allocated (and mlock()-ed) once, and reading and writing never allocate or block.
+//
+// A message is written as a whole (its header and body are copied in one bulk write, then published
+// by one release store), so the reader never sees a partial message, and a message that does not fit
+// is rejected as a whole. The read and write positions are on their own cache lines, so that the
+// producer and the consumer do not keep invalidating each other's cache line.
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#define AAP_LV2_CACHE_LINE_SIZE 64
+
+class AAPLV2SpscRing {
+    // positions are free-running (they wrap around at 2^32), and masked on access.
+    alignas(AAP_LV2_CACHE_LINE_SIZE) std::atomic<uint32_t> write_position{0};
+    alignas(AAP_LV2_CACHE_LINE_SIZE) std::atomic<uint32_t> read_position{0};
+    alignas(AAP_LV2_CACHE_LINE_SIZE) uint8_t *buffer{nullptr};
+    uint32_t capacity{0};
+    uint32_t mask{0};
+    bool locked{false};
+
+    void copyIn(uint32_t position, const void *src, uint32_t size) {
+        auto offset = position & mask;
+        auto first = std::min(size, capacity - offset);
+        memcpy(buffer + offset, src, first);
+        if (first < size)
+            memcpy(buffer, (const uint8_t *) src + first, size - first);
+    }
+
+    void copyOut(uint32_t position, void *dst, uint32_t size) const {
+        auto offset = position & mask;
+        auto first = std::min(size, capacity - offset);
+        memcpy(dst, buffer + offset, first);
+        if (first < size)
+            memcpy((uint8_t *) dst + first, buffer, size - first);
+    }
+
+public:
+    AAPLV2SpscRing() = default;
+    AAPLV2SpscRing(const AAPLV2SpscRing &) = delete;
+    AAPLV2SpscRing &operator=(const AAPLV2SpscRing &) = delete;
+    ~AAPLV2SpscRing() { release(); }
+
+    // `size` is rounded up to a power of two. Returns false if it could not be allocated.
+    bool allocate(uint32_t size) {
+        release();
+        uint32_t actual = 64;
+        while (actual < size && actual < 0x80000000u)
+            actual <<= 1;
+        buffer = (uint8_t *) calloc(actual, 1);
+        if (!buffer)
+            return false;
+        capacity = actual;
+        mask = actual - 1;
+        locked = mlock(buffer, actual) == 0;
+        write_position.store(0, std::memory_order_relaxed);
+        read_position.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    void release() {
+        if (!buffer)
+            return;
+        if (locked)
+            munlock(buffer, capacity);
+        free(buffer);
+        buffer = nullptr;
+        capacity = 0;
+        mask = 0;
+        locked = false;
+    }
+
+    uint32_t size() const { return capacity; }
+
+    // Can be called from either side (the result is a snapshot).
+    uint32_t readSpace() const {
+        return write_position.load(std::memory_order_acquire) - read_position.load(std::memory_order_acquire);
+    }
+
+    uint32_t writeSpace() const { return capacity - readSpace(); }
+
+    // Producer side: writes the header and the body as one message. Returns false (writing nothing)
+    // if they do not fit.
+    bool write(const void *header, uint32_t headerSize, const void *body, uint32_t bodySize) {
+        auto w = write_position.load(std::memory_order_relaxed);
+        auto r = read_position.load(std::memory_order_acquire);
+        if ((uint64_t) headerSize + bodySize > capacity - (w - r))
+            return false;
+        copyIn(w, header, headerSize);
+        copyIn(w + headerSize, body, bodySize);
+        write_position.store(w + headerSize + bodySize, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: copies `size` bytes at `offset` from the read position without consuming them.
+    // Returns false if there are not as many bytes.
+    bool peek(void *dst, uint32_t offset, uint32_t size) const {
+        auto r = read_position.load(std::memory_order_relaxed);
+        auto w = write_position.load(std::memory_order_acquire);
+        if ((uint64_t) offset + size > w - r)
+            return false;
+        copyOut(r + offset, dst, size);
+        return true;
+    }
+
+    // Consumer side: consumes `size` bytes (that were peek()-ed).
+    void skip(uint32_t size) {
+        read_position.store(read_position.load(std::memory_order_relaxed) + size, std::memory_order_release);
+    }
+
+    // Consumer side: discards everything (e.g. when the instance is reset).
+    void clear() {
+        read_position.store(write_position.load(std::memory_order_acquire), std::memory_order_release);
+    }
+};
+
+#endif // ifndef AAP_LV2_SPSC_RING_INCLUDED
@@ -0,0 +1,128 @@
+#ifndef AAP_LV2_UMP_DEMUX_INCLUDED
+#define AAP_LV2_UMP_DEMUX_INCLUDED 1
+
+// Demultiplexing of the UMP input of a block, in process().
+// The UMP buffer is classified in one pass into per-group event lists (with their frame offsets
+// already computed), so that each Atom input port is forged in one batch afterwards, and ports
+// that receive nothing are not touched at all.
+//
+// The message type and group of a UMP are in the top byte of its first word. They are extracted
+// for every word at once (16 or 8 words per vector op), and then the scan only hops over the
+// message boundaries, looking up the message size by the message type.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define AAP_LV2_UMP_DEMUX_NUM_GROUPS 16
+// The extra bucket for patch:Set parameter changes, which go to the patch Atom port.
+#define AAP_LV2_UMP_DEMUX_PATCH_BUCKET AAP_LV2_UMP_DEMUX_NUM_GROUPS
+#define AAP_LV2_UMP_DEMUX_NUM_BUCKETS (AAP_LV2_UMP_DEMUX_NUM_GROUPS + 1)
+
+// Stores the top byte (message type and group) of each of `count` words into `headers`.
+inline void aap_lv2_extract_ump_headers(const uint32_t *words, uint8_t *headers, size_t count) {
+    size_t i = 0;
+#if defined(__aarch64__)
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t high = vcombine_u16(vshrn_n_u32(vld1q_u32(words + i), 16),
+                                       vshrn_n_u32(vld1q_u32(words + i + 4), 16));
+        vst1_u8(headers + i, vshrn_n_u16(high, 8));
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= count; i += 16) {
+        auto w = (const __m128i*) (words + i);
+        __m128i lo = _mm_packs_epi32(_mm_srli_epi32(_mm_loadu_si128(w), 24), _mm_srli_epi32(_mm_loadu_si128(w + 1), 24));
+        __m128i hi = _mm_packs_epi32(_mm_srli_epi32(_mm_loadu_si128(w + 2), 24), _mm_srli_epi32(_mm_loadu_si128(w + 3), 24));
+        _mm_storeu_si128((__m128i*) (headers + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < count; i++)
+        headers[i] = (uint8_t) (words[i] >> 24);
+}
+
+// The number of words of a UMP, by its message type.
+inline uint32_t aap_lv2_ump_words_for_message_type(uint8_t messageType) {
+    static const uint8_t sizes[16]{1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4};
+    return sizes[messageType & 0xF];
+}
+
+// A UMP (by its word offset in the block's UMP buffer) and the frame it is delivered at.
+struct AAPLV2UmpEventRef {
+    uint32_t word;
+    int32_t frame;
+};
+
+// Per-instance buffers for demultiplexing. They are allocated at prepare() for the size of
+// the AAP MIDI2 input buffer, and process() never allocates.
+struct AAPLV2UmpDemux {
+    std::vector<uint8_t> headers{};
+    // events in the stream order, then sorted by bucket (the stream order is kept in each bucket).
+    std::vector<AAPLV2UmpEventRef> events{};
+    std::vector<uint8_t> event_buckets{};
+    std::vector<AAPLV2UmpEventRef> sorted_events{};
+    uint32_t bucket_begin[AAP_LV2_UMP_DEMUX_NUM_BUCKETS + 1]{};
+    size_t num_events{0};
+
+    void reserve(size_t numWords) {
+        headers.assign(numWords, 0);
+        events.assign(numWords, AAPLV2UmpEventRef{});
+        event_buckets.assign(numWords, 0);
+        sorted_events.assign(numWords, AAPLV2UmpEventRef{});
+        num_events = 0;
+    }
+
+    size_t capacityInWords() const { return headers.size(); }
+
+    void clear() { num_events = 0; }
+
+    // `events` must have the room (which is the case as long as there is one event per word at most).
+    void add(uint32_t word, int32_t frame, uint8_t bucket) {
+        events[num_events] = AAPLV2UmpEventRef{word, frame};
+        event_buckets[num_events++] = bucket;
+    }
+
+    // Sorts the events by bucket (counting sort), so that bucketBegin()/bucketEnd() give the list.
+    void sortByBucket() {
+        uint32_t counts[AAP_LV2_UMP_DEMUX_NUM_BUCKETS]{};
+        for (size_t i = 0; i < num_events; i++)
+            counts[event_buckets[i]]++;
+        bucket_begin[0] = 0;
+        for (int b = 0; b < AAP_LV2_UMP_DEMUX_NUM_BUCKETS; b++)
+            bucket_begin[b + 1] = bucket_begin[b] + counts[b];
+        uint32_t next[AAP_LV2_UMP_DEMUX_NUM_BUCKETS];
+        for (int b = 0; b < AAP_LV2_UMP_DEMUX_NUM_BUCKETS; b++)
+            next[b] = bucket_begin[b];
+        for (size_t i = 0; i < num_events; i++)
+            sorted_events[next[event_buckets[i]]++] = events[i];
+    }
+
+    // Demultiplexes the UMPs of a block: it extracts the headers, hops over the message boundaries (an
+    // incomplete message at the end is ignored), and calls `classify(word, messageType)` for each
+    // message in the stream order, which add()s it to a bucket (or not). Then the events are sorted.
+    template <typename F>
+    void demultiplex(const uint32_t *words, size_t numWords, F &&classify) {
+        clear();
+        aap_lv2_extract_ump_headers(words, headers.data(), numWords);
+        auto h = headers.data();
+        for (size_t w = 0; w < numWords;) {
+            uint8_t messageType = h[w] >> 4;
+            auto size = aap_lv2_ump_words_for_message_type(messageType);
+            if (w + size > numWords)
+                break;
+            auto word = (uint32_t) w;
+            w += size;
+            classify(word, messageType);
+        }
+        sortByBucket();
+    }
+
+    const AAPLV2UmpEventRef* bucketBegin(int bucket) const { return sorted_events.data() + bucket_begin[bucket]; }
+    const AAPLV2UmpEventRef* bucketEnd(int bucket) const { return sorted_events.data() + bucket_begin[bucket + 1]; }
+};
+
+#endif // ifndef AAP_LV2_UMP_DEMUX_INCLUDED
@@ -0,0 +1,168 @@
+#ifndef AAP_LV2_URID_MAP_INCLUDED
+#define AAP_LV2_URID_MAP_INCLUDED 1
+
+// The process-wide URID map, shared by all the plugin instances (and their threads).
+//
+// Lookups are wait-free: a URI is found in a hash table of chains, which are only ever prepended to,
+// and a URID is unmapped by indexing into segments that never move. Inserts are serialized by a mutex
+// (so there is only one writer at a time), and each one is published by a release store, so that
+// readers never see a partially inserted entry. Entries are never removed.
+// The well-known URIs below are mapped in advance, to fixed URIDs (their index + 1).
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include <lv2/urid/urid.h>
+#include <lv2/atom/atom.h>
+#include <lv2/midi/midi.h>
+#include <lv2/patch/patch.h>
+#include <lv2/time/time.h>
+#include <lv2/buf-size/buf-size.h>
+#include <lv2/options/options.h>
+
+static const char *const aap_lv2_well_known_uris[] = {
+        LV2_ATOM__Atom, LV2_ATOM__AtomPort, LV2_ATOM__Blank, LV2_ATOM__Bool, LV2_ATOM__Chunk,
+        LV2_ATOM__Double, LV2_ATOM__Event, LV2_ATOM__Float, LV2_ATOM__Int, LV2_ATOM__Literal,
+        LV2_ATOM__Long, LV2_ATOM__Number, LV2_ATOM__Object, LV2_ATOM__Path, LV2_ATOM__Property,
+        LV2_ATOM__Resource, LV2_ATOM__Sequence, LV2_ATOM__Sound, LV2_ATOM__String, LV2_ATOM__Tuple,
+        LV2_ATOM__URI, LV2_ATOM__URID, LV2_ATOM__Vector, LV2_ATOM__atomTransfer, LV2_ATOM__beatTime,
+        LV2_ATOM__bufferType, LV2_ATOM__eventTransfer, LV2_ATOM__frameTime, LV2_ATOM__supports,
+        LV2_MIDI__MidiEvent,
+        LV2_PATCH__Ack, LV2_PATCH__Delete, LV2_PATCH__Error, LV2_PATCH__Get, LV2_PATCH__Message,
+        LV2_PATCH__Patch, LV2_PATCH__Put, LV2_PATCH__Response, LV2_PATCH__Set, LV2_PATCH__add,
+        LV2_PATCH__body, LV2_PATCH__property, LV2_PATCH__readable, LV2_PATCH__remove,
+        LV2_PATCH__sequenceNumber, LV2_PATCH__subject, LV2_PATCH__value, LV2_PATCH__wildcard,
+        LV2_PATCH__writable,
+        LV2_TIME__Position, LV2_TIME__Rate, LV2_TIME__Time, LV2_TIME__bar, LV2_TIME__barBeat,
+        LV2_TIME__beat, LV2_TIME__beatUnit, LV2_TIME__beatsPerBar, LV2_TIME__beatsPerMinute,
+        LV2_TIME__frame, LV2_TIME__framesPerSecond, LV2_TIME__speed,
+        LV2_BUF_SIZE__boundedBlockLength, LV2_BUF_SIZE__fixedBlockLength, LV2_BUF_SIZE__maxBlockLength,
+        LV2_BUF_SIZE__minBlockLength, LV2_BUF_SIZE__nominalBlockLength, LV2_BUF_SIZE__powerOf2BlockLength,
+        LV2_BUF_SIZE__sequenceSize,
+        LV2_OPTIONS__Option, LV2_OPTIONS__interface, LV2_OPTIONS__options, LV2_OPTIONS__requiredOption,
+        LV2_OPTIONS__supportedOption
+};
+
+#define AAP_LV2_URID_MAP_NUM_BUCKETS 4096
+// Segment k has (this << k) entries.
+#define AAP_LV2_URID_MAP_FIRST_SEGMENT_SIZE 256
+#define AAP_LV2_URID_MAP_MAX_SEGMENTS 24
+
+class AAPLV2UridMap {
+    struct Entry {
+        char *uri;
+        uint32_t hash;
+        LV2_URID urid;
+        // immutable once the entry is published.
+        Entry *next;
+    };
+
+    std::atomic<Entry *> buckets[AAP_LV2_URID_MAP_NUM_BUCKETS]{};
+    // URID - 1 -> entry.
+    std::atomic<Entry **> segments[AAP_LV2_URID_MAP_MAX_SEGMENTS]{};
+    std::atomic<uint32_t> num_urids{0};
+    std::mutex write_lock{};
+
+    // FNV-1a
+    static uint32_t hashOf(const char *uri) {
+        uint32_t hash = 0x811c9dc5u;
+        for (auto p = (const uint8_t *) uri; *p; p++)
+            hash = (hash ^ *p) * 0x01000193u;
+        return hash;
+    }
+
+    // segment k has the indices from FIRST * (2^k - 1).
+    static void locate(uint32_t index, uint32_t &segment, uint32_t &offset) {
+        auto n = index / AAP_LV2_URID_MAP_FIRST_SEGMENT_SIZE + 1;
+        segment = 31 - __builtin_clz(n);
+        offset = index - AAP_LV2_URID_MAP_FIRST_SEGMENT_SIZE * ((1u << segment) - 1);
+    }
+
+    Entry *find(const char *uri, uint32_t hash) const {
+        for (auto e = buckets[hash % AAP_LV2_URID_MAP_NUM_BUCKETS].load(std::memory_order_acquire); e; e = e->next)
+            if (e->hash == hash && !strcmp(e->uri, uri))
+                return e;
+        return nullptr;
+    }
+
+    // write_lock must be held. Returns 0 if it ran out of memory.
+    LV2_URID insert(const char *uri, uint32_t hash) {
+        auto index = num_urids.load(std::memory_order_relaxed);
+        uint32_t segmentIndex, offset;
+        locate(index, segmentIndex, offset);
+        if (segmentIndex >= AAP_LV2_URID_MAP_MAX_SEGMENTS)
+            return 0;
+        auto segment = segments[segmentIndex].load(std::memory_order_relaxed);
+        if (!segment) {
+            segment = (Entry **) calloc((size_t) AAP_LV2_URID_MAP_FIRST_SEGMENT_SIZE << segmentIndex, sizeof(Entry *));
+            if (!segment)
+                return 0;
+            segments[segmentIndex].store(segment, std::memory_order_release);
+        }
+        auto copy = strdup(uri);
+        if (!copy)
+            return 0;
+        auto &bucket = buckets[hash % AAP_LV2_URID_MAP_NUM_BUCKETS];
+        auto entry = new Entry{copy, hash, index + 1, bucket.load(std::memory_order_relaxed)};
+        segment[offset] = entry;
+        num_urids.store(index + 1, std::memory_order_release);
+        bucket.store(entry, std::memory_order_release);
+        return entry->urid;
+    }
+
+public:
+    AAPLV2UridMap() {
+        std::lock_guard<std::mutex> guard{write_lock};
+        for (auto uri : aap_lv2_well_known_uris)
+            insert(uri, hashOf(uri));
+    }
+
+    AAPLV2UridMap(const AAPLV2UridMap &) = delete;
+    AAPLV2UridMap &operator=(const AAPLV2UridMap &) = delete;
+
+    ~AAPLV2UridMap() {
+        auto count = num_urids.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t segment, offset;
+            locate(i, segment, offset);
+            auto entry = segments[segment].load(std::memory_order_relaxed)[offset];
+            free(entry->uri);
+            delete entry;
+        }
+        for (auto &segment : segments)
+            free(segment.load(std::memory_order_relaxed));
+    }
+
+    // The instance for the process. It is never destroyed, as plugin threads may still use it at exit.
+    static AAPLV2UridMap *instance() {
+        static auto map = new AAPLV2UridMap();
+        return map;
+    }
+
+    // Wait-free if the URI is already mapped (it takes the insert lock and allocates otherwise).
+    LV2_URID map(const char *uri) {
+        if (!uri)
+            return 0;
+        auto hash = hashOf(uri);
+        if (auto entry = find(uri, hash))
+            return entry->urid;
+        std::lock_guard<std::mutex> guard{write_lock};
+        if (auto entry = find(uri, hash))
+            return entry->urid;
+        return insert(uri, hash);
+    }
+
+    // Wait-free. Returns nullptr for a URID that is not mapped.
+    const char *unmap(LV2_URID urid) const {
+        if (urid == 0 || urid > num_urids.load(std::memory_order_acquire))
+            return nullptr;
+        uint32_t segment, offset;
+        locate(urid - 1, segment, offset);
+        return segments[segment].load(std::memory_order_acquire)[offset]->uri;
+    }
+};
+
+#endif // ifndef AAP_LV2_URID_MAP_INCLUDED
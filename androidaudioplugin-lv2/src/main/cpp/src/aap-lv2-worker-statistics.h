@@ -0,0 +1,44 @@
+#ifndef AAP_LV2_WORKER_STATISTICS_INCLUDED
+#define AAP_LV2_WORKER_STATISTICS_INCLUDED 1
+
+// LV2 worker statistics, as they are logged at deactivation.
+// (There is no extension to query them from the host; it would need AAPXS serialization to
+// work across the service boundary.)
+
+#include <stdint.h>
+
+enum aap_lv2_worker_latency_kind {
+    // from schedule_work() to the beginning of work().
+    AAP_LV2_WORKER_LATENCY_SCHEDULE_TO_WORK = 0,
+    // the duration of work().
+    AAP_LV2_WORKER_LATENCY_WORK = 1,
+    // from the worker's respond() to the beginning of work_response() (on the audio thread).
+    AAP_LV2_WORKER_LATENCY_RESPONSE = 2,
+    AAP_LV2_WORKER_NUM_LATENCY_KINDS = 3
+};
+
+typedef struct aap_lv2_latency_summary_t {
+    uint64_t count;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} aap_lv2_latency_summary_t;
+
+typedef struct aap_lv2_worker_statistics_t {
+    uint64_t requests;
+    uint64_t responses;
+    // requests and responses that were rejected with LV2_WORKER_ERR_NO_SPACE.
+    uint64_t rejected_requests;
+    uint64_t rejected_responses;
+    // blocks that left responses to the next block, as the response time budget ran out.
+    uint64_t deferred_response_blocks;
+    // high-water marks of the queues, in bytes.
+    uint32_t max_request_queue_bytes;
+    uint32_t max_response_queue_bytes;
+    aap_lv2_latency_summary_t latencies[AAP_LV2_WORKER_NUM_LATENCY_KINDS];
+} aap_lv2_worker_statistics_t;
+
+#endif // ifndef AAP_LV2_WORKER_STATISTICS_INCLUDED
@@ -6,73 +6,41 @@
 
 namespace aaplv2bridge {
 
-#define PORTCHECKER_SINGLE(_name_, _type_) inline bool _name_ (AAPLV2PluginContext *ctx, const LilvPlugin* plugin, const LilvPort* port) { return lilv_port_is_a (plugin, port, ctx->statics->_type_); }
-#define PORTCHECKER_AND(_name_, _cond1_, _cond2_) inline bool _name_ (AAPLV2PluginContext *ctx, const LilvPlugin* plugin, const LilvPort* port) { return _cond1_ (ctx, plugin, port) && _cond2_ (ctx, plugin, port); }
-
-PORTCHECKER_SINGLE (IS_AUDIO_PORT, audio_port_uri_node)
-
-PORTCHECKER_SINGLE (IS_INPUT_PORT, input_port_uri_node)
-
-PORTCHECKER_SINGLE (IS_OUTPUT_PORT, output_port_uri_node)
-
-PORTCHECKER_SINGLE (IS_CONTROL_PORT, control_port_uri_node)
-
-PORTCHECKER_SINGLE (IS_ATOM_PORT, atom_port_uri_node)
-
-PORTCHECKER_AND (IS_AUDIO_IN, IS_AUDIO_PORT, IS_INPUT_PORT)
-
-PORTCHECKER_AND (IS_AUDIO_OUT, IS_AUDIO_PORT, IS_OUTPUT_PORT)
-
-PORTCHECKER_AND (IS_CONTROL_IN, IS_CONTROL_PORT, IS_INPUT_PORT)
-
-PORTCHECKER_AND (IS_CONTROL_OUT, IS_CONTROL_PORT, IS_OUTPUT_PORT)
-
-PORTCHECKER_AND (IS_ATOM_IN, IS_ATOM_PORT, IS_INPUT_PORT)
-
-PORTCHECKER_AND (IS_ATOM_OUT, IS_ATOM_PORT, IS_OUTPUT_PORT)
-
-static size_t getAtomPortBufferSize(AAPLV2PluginContext* ctx, int32_t port) {
-    auto explicitSize = ctx->explicit_port_buffer_sizes.find(port);
-    if (explicitSize != ctx->explicit_port_buffer_sizes.end())
-        return explicitSize->second;
-    return ctx->atom_buffer_size;
+// Allocates a local buffer for the port and registers it as an Atom port if it is.
+static void addLocalPortRoute(AAPLV2PluginContext* ctx, uint32_t lv2Port, AAPLV2PortRouteKind kind,
+                              bool isInput, size_t bufferSize) {
+    auto &route = ctx->mappings.routes[lv2Port];
+    route.kind = kind;
+    route.is_input = isInput;
+    route.buffer_size = (uint32_t) bufferSize;
+    route.buffer = calloc(bufferSize, 1);
 }
 
-void resetMidiAtomBuffers(AAPLV2PluginContext* ctx, aap_buffer_t* buffer, std::map<int32_t, LV2_Atom_Sequence*> &map, bool isInput) {
-    for (auto p : map) {
-        lv2_atom_sequence_clear(p.second);
-        auto bufferSize = getAtomPortBufferSize(ctx, p.first);
-        auto *forge = isInput ? &ctx->midi_forges_in[p.first] : &ctx->midi_forges_out[p.first];
-        lv2_atom_forge_set_buffer(forge, (uint8_t *) p.second, bufferSize);
-        if (isInput)
-            continue;
-
-        LV2_Atom_Forge_Frame frame;
-        lv2_atom_forge_sequence_head(forge, &frame, ctx->urids.urid_time_frame);
-        lv2_atom_forge_pop(forge, &frame);
+static void addAtomPort(AAPLV2PluginContext* ctx, uint32_t lv2Port, int8_t umpGroup, bool umpNative) {
+    auto &route = ctx->mappings.routes[lv2Port];
+    route.atom_port = (int16_t) ctx->mappings.atom_ports.size();
+    AAPLV2AtomPort atomPort{lv2Port, route.kind, route.is_input, umpGroup, umpNative, route.buffer_size,
+                            static_cast<LV2_Atom_Sequence *>(route.buffer)};
+    lv2_atom_forge_init(&atomPort.forge, &ctx->features.urid_map_feature_data);
+    if (ctx->options.sub_block_processing)
+        atomPort.sub_block_staging = static_cast<LV2_Atom_Sequence *>(calloc(route.buffer_size, 1));
+    if (route.kind == AAP_LV2_PORT_ROUTE_MIDI_ATOM && route.is_input && !umpNative)
+        atomPort.sysex_buffer = static_cast<uint8_t *>(calloc(std::min(route.buffer_size, (uint32_t) AAP_LV2_MAX_SYSEX7_SIZE), 1));
+    if (route.is_input) {
+        atomPort.pending = static_cast<LV2_Atom_Sequence *>(calloc(route.buffer_size, 1));
+        atomPort.next_pending = static_cast<LV2_Atom_Sequence *>(calloc(route.buffer_size, 1));
+        lv2_atom_forge_init(&atomPort.pending_forge, &ctx->features.urid_map_feature_data);
     }
-}
-
-void resetPatchAtomBuffer(AAPLV2PluginContext* ctx, aap_buffer_t* buffer, int32_t port) {
-    if (port < 0)
-        return;
-    auto buf = ctx->explicitly_allocated_port_buffers[port];
-    if (!buf)
-        buf = buffer->get_buffer(buffer, ctx->mappings.lv2_to_aap_portmap[port]);
-    auto seq = static_cast<LV2_Atom_Sequence*>(buf);
-    lv2_atom_sequence_clear(seq);
-    auto bufferSize = getAtomPortBufferSize(ctx, port);
-    seq->atom.size = bufferSize - sizeof(LV2_Atom);
+    ctx->mappings.atom_ports.emplace_back(atomPort);
 }
 
 void allocatePortBuffers(AndroidAudioPlugin *plugin, aap_buffer_t *buffer) {
     auto ctx = (AAPLV2PluginContext *) plugin->plugin_specific;
-    auto lilvPlugin = ctx->plugin;
-    auto instance = ctx->instance;
+    auto descriptor = ctx->descriptor;
 
     assert(buffer != nullptr);
 
-    uint32_t numLV2Ports = lilv_plugin_get_num_ports(lilvPlugin);
+    uint32_t numLV2Ports = descriptor->numPorts();
 
     auto aapPluginExt = (aap_host_plugin_info_extension_t *) ctx->aap_host->get_extension(
             ctx->aap_host, AAP_PLUGIN_INFO_EXTENSION_URI);
@@ -107,74 +75,89 @@ void allocatePortBuffers(AndroidAudioPlugin *plugin, aap_buffer_t *buffer) {
     //     They also have to be assigned default control values.
     // (4) For other ports, we assign audio pointer from `buffer` as they do not likely move at `process()`,
     //     and IF they indeed moved (we store `cached_buffer`), then we can call `connect_port()` at any time.
+    // Each port is classified into `mappings.routes` here, and Atom ports are also packed
+    // into `mappings.atom_ports`, so that process() does not have to look up anything.
 
     // (3) ^
     if (ctx->control_buffer_pointers)
         free(ctx->control_buffer_pointers);
     ctx->control_buffer_pointers = static_cast<float *>(calloc(numLV2Ports, sizeof(float)));
     ctx->markAllParameterValuesDirty();
+    auto outputRate = ctx->options.output_parameter_rate;
+    ctx->parameter_changes.output_interval_frames = outputRate > 0 ? ctx->sample_rate / outputRate : 0;
+
+    ctx->mappings.releaseBuffers();
+    ctx->mappings.routes.resize(numLV2Ports);
+    uint32_t numAtomPorts = 0;
+    for (uint32_t i = 0; i < numLV2Ports; i++)
+        if (aap_lv2_port_is(descriptor, i, AAP_LV2_DESCRIPTOR_PORT_ATOM))
+            numAtomPorts++;
+    ctx->mappings.atom_ports.reserve(numAtomPorts);
+    ctx->pending_control_changes.clear();
+    if (ctx->options.sub_block_processing)
+        ctx->pending_control_changes.reserve(AAP_LV2_MAX_PENDING_CONTROL_CHANGES);
+    // Every UMP takes at least one word, so there cannot be more events than words.
+    auto midiInSize = ctx->mappings.aap_midi_in_port < 0 ? 0 : buffer->get_buffer_size(buffer, ctx->mappings.aap_midi_in_port);
+    ctx->ump_demux.reserve(midiInSize > (int32_t) sizeof(AAPMidiBufferHeader) ?
+                           (midiInSize - sizeof(AAPMidiBufferHeader)) / sizeof(uint32_t) : 0);
 
     int32_t numLV2MidiInPorts = 0;
     int32_t numLV2MidiOutPorts = 0;
     int32_t currentAAPPortIndex = 0;
-    for (int i = 0; i < numLV2Ports; i++) {
-        ctx->mappings.lv2_to_aap_portmap[i] = -1;
-        const LilvPort *lilvPort = lilv_plugin_get_port_by_index(lilvPlugin, i);
-
-        if (IS_CONTROL_IN(ctx, lilvPlugin, lilvPort)) {
-            auto defaultNode = lilv_port_get(lilvPlugin, lilvPort, ctx->statics->default_uri_node);
-            if (defaultNode)
-                ctx->control_buffer_pointers[i] = lilv_node_as_float(defaultNode);
+    for (uint32_t i = 0; i < numLV2Ports; i++) {
+        auto port = descriptor->port(i);
+        bool isInput = port->flags & AAP_LV2_DESCRIPTOR_PORT_INPUT;
+
+        if (aap_lv2_port_is(descriptor, i, AAP_LV2_DESCRIPTOR_PORT_CONTROL | AAP_LV2_DESCRIPTOR_PORT_INPUT)) {
+            if (port->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_DEFAULT)
+                ctx->control_buffer_pointers[i] = port->default_value;
         }
 
-        // Try to get rsz:minimumSize. If it exists, we have to allocate sufficient buffer.
-        LilvNode *minimumSizeNode = lilv_port_get(lilvPlugin, lilvPort,
-                                                  ctx->statics->resize_port_minimum_size_node);
-        auto rszMinimumSize = minimumSizeNode ? (size_t) lilv_node_as_int(minimumSizeNode) : 0;
-        if (minimumSizeNode)
-            ctx->explicit_port_buffer_sizes[i] = rszMinimumSize;
+        // If there is rsz:minimumSize, we have to allocate sufficient buffer.
+        bool hasMinimumSize = port->flags & AAP_LV2_DESCRIPTOR_PORT_HAS_MINIMUM_SIZE;
+        auto rszMinimumSize = hasMinimumSize ? (size_t) port->minimum_size : 0;
 
-        if (IS_ATOM_PORT(ctx, lilvPlugin, lilvPort)) {
-            auto bufferSize = minimumSizeNode ? ctx->explicit_port_buffer_sizes[i]
-                                              : ctx->atom_buffer_size;
+        if (port->flags & AAP_LV2_DESCRIPTOR_PORT_ATOM) {
+            auto bufferSize = hasMinimumSize ? rszMinimumSize : (size_t) ctx->atom_buffer_size;
+            // A port that supports UMP events receives UMPs as is, even if it also supports midi:MidiEvent.
+            bool supportsUmp = port->flags & AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_UMP_EVENT;
+            bool supportsMidi = supportsUmp || (port->flags & AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_MIDI_EVENT);
+            bool supportsPatch = port->flags & AAP_LV2_DESCRIPTOR_PORT_SUPPORTS_PATCH_MESSAGE;
 
             // (2) ^
-            if (IS_INPUT_PORT(ctx, lilvPlugin, lilvPort)) {
-                if (lilv_port_supports_event(lilvPlugin, lilvPort,
-                                             ctx->statics->midi_event_uri_node)) {
-                    ctx->mappings.ump_group_to_atom_in_port[numLV2MidiInPorts++] = i;
-                    ctx->midi_atom_inputs[i] = static_cast<LV2_Atom_Sequence *>(calloc(
-                            bufferSize, 1));
-                } else {
-                    // it may be unused in AAP, but we have to allocate a buffer for such an Atom port anyways.
-                    ctx->explicitly_allocated_port_buffers[i] = calloc(bufferSize, 1);
-                    if (lilv_port_supports_event(lilvPlugin, lilvPort,
-                                                 ctx->statics->patch_message_uri_node))
-                        ctx->mappings.lv2_patch_in_port = i;
-                }
+            // Non-MIDI ones may be unused in AAP, but we have to allocate a buffer for such an Atom port anyways.
+            // They are still reset in every cycle (and staged for sub-blocks) like the other Atom ports.
+            if (supportsMidi) {
+                addLocalPortRoute(ctx, i, AAP_LV2_PORT_ROUTE_MIDI_ATOM, isInput, bufferSize);
+                auto group = isInput ? numLV2MidiInPorts++ : numLV2MidiOutPorts++;
+                if (group >= AAP_LV2_NUM_UMP_GROUPS)
+                    aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 MIDI port %d cannot be mapped to any UMP group.", i);
+                addAtomPort(ctx, i, group < AAP_LV2_NUM_UMP_GROUPS ? (int8_t) group : -1, supportsUmp);
+            } else if (supportsPatch) {
+                addLocalPortRoute(ctx, i, AAP_LV2_PORT_ROUTE_PATCH_ATOM, isInput, bufferSize);
+                addAtomPort(ctx, i, -1, false);
             } else {
-                if (lilv_port_supports_event(lilvPlugin, lilvPort,
-                                             ctx->statics->midi_event_uri_node)) {
-                    ctx->mappings.atom_out_port_to_ump_group[i] = numLV2MidiOutPorts++;
-                    ctx->midi_atom_outputs[i] = static_cast<LV2_Atom_Sequence *>(calloc(
-                            bufferSize, 1));
-                } else {
-                    // it may be unused in AAP, but we have to allocate a buffer for such an Atom port anyways.
-                    ctx->explicitly_allocated_port_buffers[i] = calloc(bufferSize, 1);
-                    if (lilv_port_supports_event(lilvPlugin, lilvPort,
-                                                 ctx->statics->patch_message_uri_node))
-                        ctx->mappings.lv2_patch_out_port = i;
-                }
+                addLocalPortRoute(ctx, i, AAP_LV2_PORT_ROUTE_LOCAL_BUFFER, isInput, bufferSize);
+                addAtomPort(ctx, i, -1, false);
+            }
+
+            // The patch port may be shared with MIDI. If there are more than one, the first one is used.
+            auto &mappings = ctx->mappings;
+            if (supportsPatch && isInput && mappings.lv2_patch_in_port < 0) {
+                mappings.lv2_patch_in_port = i;
+                mappings.patch_in_atom_port = mappings.routes[i].atom_port;
+            } else if (supportsPatch && !isInput && mappings.lv2_patch_out_port < 0) {
+                mappings.lv2_patch_out_port = i;
+                mappings.patch_out_atom_port = mappings.routes[i].atom_port;
             }
         }
         // (1) ^
         else if (rszMinimumSize > buffer->num_frames(buffer) * sizeof(float)) {
-            if (ctx->explicitly_allocated_port_buffers[i])
-                free(ctx->explicitly_allocated_port_buffers[i]);
-            ctx->explicitly_allocated_port_buffers[i] = calloc(rszMinimumSize, 1);
-        } else if (IS_CONTROL_PORT(ctx, lilvPlugin, lilvPort)) {
+            addLocalPortRoute(ctx, i, AAP_LV2_PORT_ROUTE_LOCAL_BUFFER, isInput, rszMinimumSize);
+        } else if (port->flags & AAP_LV2_DESCRIPTOR_PORT_CONTROL) {
             // (3) ^ (we don't allocate for each ControlPort)
-            ctx->mappings.lv2_index_to_port[lilv_port_get_index(lilvPlugin, lilvPort)] = i;
+            ctx->mappings.routes[i].kind = AAP_LV2_PORT_ROUTE_CONTROL;
+            ctx->mappings.routes[i].is_input = isInput;
         } else {
             // (4) ^
             while (currentAAPPortIndex < buffer->num_ports(buffer)) {
@@ -183,63 +166,58 @@ void allocatePortBuffers(AndroidAudioPlugin *plugin, aap_buffer_t *buffer) {
                     break;
                 currentAAPPortIndex++;
             }
-            ctx->mappings.aap_to_lv2_portmap[currentAAPPortIndex] = i;
-            ctx->mappings.lv2_to_aap_portmap[i] = currentAAPPortIndex;
+            ctx->mappings.routes[i].kind = AAP_LV2_PORT_ROUTE_AAP_BUFFER;
+            ctx->mappings.routes[i].is_input = isInput;
+            ctx->mappings.routes[i].aap_port = currentAAPPortIndex;
             currentAAPPortIndex++;
         }
     }
 }
 
+// LV2 hosts pass output Atom buffers as a Chunk that tells the capacity. The plugin writes a sequence there.
+static void resetAtomOutputBuffer(AAPLV2AtomPort &atomPort) {
+    atomPort.sequence->atom.type = atomPort.forge.Chunk;
+    atomPort.sequence->atom.size = atomPort.buffer_size - sizeof(LV2_Atom);
+}
+
 void clearBufferForRun(AAPLV2PluginContext* ctx, aap_buffer_t *buffer) {
-    auto lilvPlugin = ctx->plugin;
     auto instance = ctx->instance;
-    uint32_t numLV2Ports = lilv_plugin_get_num_ports(lilvPlugin);
-
-    auto uridMap = &ctx->features.urid_map_feature_data;
-    for (auto p : ctx->midi_atom_inputs)
-        lv2_atom_forge_init(&ctx->midi_forges_in[p.first], uridMap);
-    for (auto p : ctx->midi_atom_outputs)
-        lv2_atom_forge_init(&ctx->midi_forges_out[p.first], uridMap);
-    lv2_atom_forge_init(&ctx->patch_forge_in, uridMap);
-    lv2_atom_forge_init(&ctx->patch_forge_out, uridMap);
+    auto &routes = ctx->mappings.routes;
 
     if (buffer != ctx->cached_buffer) {
-        for (int p = 0; p < numLV2Ports; p++) {
-            auto epbIter = ctx->explicitly_allocated_port_buffers.find(p);
-            if (epbIter != ctx->explicitly_allocated_port_buffers.end()) {
-                lilv_instance_connect_port(instance, p, epbIter->second);
-                continue;
-            }
-            auto midiInIter = ctx->midi_atom_inputs.find(p);
-            if (midiInIter != ctx->midi_atom_inputs.end()) {
-                lilv_instance_connect_port(instance, p, midiInIter->second);
-                continue;
-            }
-            auto midiOutIter = ctx->midi_atom_outputs.find(p);
-            if (midiOutIter != ctx->midi_atom_outputs.end()) {
-                lilv_instance_connect_port(instance, p, midiOutIter->second);
-                continue;
-            }
-
-            const LilvPort *lilvPort = lilv_plugin_get_port_by_index(lilvPlugin, p);
-            if (IS_CONTROL_PORT(ctx, lilvPlugin, lilvPort)) {
-                lilv_instance_connect_port(instance, p, ctx->control_buffer_pointers + p);
-                continue;
+        for (uint32_t p = 0; p < routes.size(); p++) {
+            auto &route = routes[p];
+            switch (route.kind) {
+                case AAP_LV2_PORT_ROUTE_NONE:
+                    break;
+                case AAP_LV2_PORT_ROUTE_AAP_BUFFER:
+                    // otherwise, it is either an audio port or CV port or whatever.
+                    lilv_instance_connect_port(instance, p, buffer->get_buffer(buffer, route.aap_port));
+                    break;
+                case AAP_LV2_PORT_ROUTE_CONTROL:
+                    lilv_instance_connect_port(instance, p, ctx->control_buffer_pointers + p);
+                    break;
+                default:
+                    lilv_instance_connect_port(instance, p, route.buffer);
+                    break;
             }
-
-            // otherwise, it is either an audio port or CV port or whatever.
-            int32_t aapPortIndex = ctx->mappings.lv2_to_aap_portmap[p];
-            if (aapPortIndex >= 0)
-                lilv_instance_connect_port(instance, p, buffer->get_buffer(buffer, aapPortIndex));
         }
         ctx->cached_buffer = buffer;
     }
 
-    // Clean up Atom output sequences.
-    resetMidiAtomBuffers(ctx, buffer, ctx->midi_atom_inputs, true);
-    resetMidiAtomBuffers(ctx, buffer, ctx->midi_atom_outputs, false);
-    resetPatchAtomBuffer(ctx, buffer, ctx->mappings.lv2_patch_in_port);
-    resetPatchAtomBuffer(ctx, buffer, ctx->mappings.lv2_patch_out_port);
+    // Clean up Atom sequences.
+    for (auto &atomPort : ctx->mappings.atom_ports) {
+        if (!atomPort.is_input) {
+            resetAtomOutputBuffer(atomPort);
+            continue;
+        }
+        auto seq = atomPort.sequence;
+        seq->atom.type = ctx->urids.urid_atom_sequence_type;
+        seq->body.unit = ctx->urids.urid_time_frame;
+        seq->body.pad = 0;
+        lv2_atom_sequence_clear(seq);
+        lv2_atom_forge_set_buffer(&atomPort.forge, (uint8_t *) seq, atomPort.buffer_size);
+    }
 }
 
 void aap_lv2_plugin_prepare(AndroidAudioPlugin *plugin, int32_t sampleRate, aap_buffer_t *buffer) {
@@ -254,6 +232,7 @@ void aap_lv2_plugin_prepare(AndroidAudioPlugin *plugin, int32_t sampleRate, aap_
 
     // We set this here, but LV2 requires sample rate at instantiation time.
     ctx->sample_rate = sampleRate;
+    ctx->midi_timing.setSampleRate(sampleRate);
 
     allocatePortBuffers(plugin, buffer);
     clearBufferForRun(ctx, buffer);
@@ -271,6 +250,15 @@ void aap_lv2_plugin_activate(AndroidAudioPlugin *plugin) {
         return;
     if (ctx->instance_state == AAP_LV2_INSTANCE_STATE_PREPARED) {
         lilv_instance_activate(ctx->instance);
+        // the sender clock kept going while we were inactive.
+        ctx->midi_timing.reset();
+        // events that were carried over belong to the stream before deactivation.
+        for (auto &atomPort : ctx->mappings.atom_ports) {
+            if (atomPort.pending)
+                atomPort.pending->atom.size = 0;
+            if (atomPort.next_pending)
+                atomPort.next_pending->atom.size = 0;
+        }
         ctx->instance_state = AAP_LV2_INSTANCE_STATE_ACTIVE;
     } else {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s is not at prepared state.", ctx->aap_plugin_id.c_str());
@@ -285,144 +273,477 @@ bool readMidi2Parameter(uint8_t *group, uint8_t* channel, uint8_t* key, uint8_t*
                                        *raw, *(raw + 1), *(raw + 2), *(raw + 3));
 }
 
-bool
-write_midi2_events_as_midi1_to_lv2_forge(AAPLV2PluginContext* ctx, aap_buffer_t *buffer, int32_t frameCount) {
+static bool forgeAtomNumber(LV2_Atom_Forge *forge, LV2_URID type, double value) {
+    if (type == forge->Double)
+        return lv2_atom_forge_double(forge, value);
+    if (type == forge->Int)
+        return lv2_atom_forge_int(forge, (int32_t) value);
+    if (type == forge->Long)
+        return lv2_atom_forge_long(forge, (int64_t) value);
+    if (type == forge->Bool)
+        return lv2_atom_forge_bool(forge, value != 0);
+    return lv2_atom_forge_float(forge, (float) value);
+}
 
-    int32_t aapInPort = ctx->mappings.aap_midi_in_port;
-    void *src = buffer->get_buffer(buffer, aapInPort);
+static bool readAtomNumber(const LV2_Atom_Forge *forge, const LV2_Atom *atom, double *result) {
+    if (atom->type == forge->Float)
+        *result = ((const LV2_Atom_Float*) atom)->body;
+    else if (atom->type == forge->Double)
+        *result = ((const LV2_Atom_Double*) atom)->body;
+    else if (atom->type == forge->Int)
+        *result = ((const LV2_Atom_Int*) atom)->body;
+    else if (atom->type == forge->Long)
+        *result = (double) ((const LV2_Atom_Long*) atom)->body;
+    else if (atom->type == forge->Bool)
+        *result = ((const LV2_Atom_Bool*) atom)->body ? 1 : 0;
+    else
+        return false;
+    return true;
+}
 
-    if (src == nullptr) {
-        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "AAP input port %d is not assigned a valid buffer.", aapInPort);
+// Returns the forge for an input event at `frameTime`: the port's sequence if it is within the current
+// block, or the pending sequence otherwise (then `frameTime` is made relative to the next block).
+static LV2_Atom_Forge* selectInputForge(AAPLV2AtomPort *port, int64_t *frameTime) {
+    if (*frameTime < port->block_frames)
+        return &port->forge;
+    *frameTime -= port->block_frames;
+    port->carried_events++;
+    return &port->pending_forge;
+}
+
+// Handles a forge overflow, after the caller rolled back what was written of the event. Overflow in the
+// pending sequence only drops the event (and is counted), so it returns true, while overflow in the
+// port's sequence is an error, so it returns false.
+static bool handleInputForgeOverflow(AAPLV2AtomPort *port, LV2_Atom_Forge *forge) {
+    if (forge != &port->pending_forge)
         return false;
+    port->carried_events--;
+    port->dropped_carried_events++;
+    return true;
+}
+
+// Writes a patch:Set event for the property parameter. Nothing is written if it does not fit.
+static bool forgePatchSet(AAPLV2PluginContext* ctx, AAPLV2AtomPort *port, int64_t frameTime,
+                          const AAPLV2ParameterMetadata *meta, double value) {
+    auto forge = selectInputForge(port, &frameTime);
+    auto sequence = (LV2_Atom*) forge->buf;
+    auto savedOffset = forge->offset;
+    auto savedSize = sequence->size;
+
+    LV2_Atom_Forge_Frame frame;
+    bool ok = lv2_atom_forge_frame_time(forge, frameTime) &&
+              lv2_atom_forge_object(forge, &frame, 0, ctx->urids.urid_patch_set);
+    if (ok) {
+        ok = lv2_atom_forge_key(forge, ctx->urids.urid_patch_property) &&
+             lv2_atom_forge_urid(forge, meta->property_urid) &&
+             lv2_atom_forge_key(forge, ctx->urids.urid_patch_value) &&
+             forgeAtomNumber(forge, meta->value_type, value);
+        lv2_atom_forge_pop(forge, &frame);
     }
+    if (!ok) {
+        forge->offset = savedOffset;
+        sequence->size = savedSize;
+        return handleInputForgeOverflow(port, forge);
+    }
+    return true;
+}
 
-    volatile auto aapmb = (AAPMidiBufferHeader*) src;
-    uint64_t currentJRTimestamp = 0; // unit of 1/31250 sec. (JR_TIMESTAMP_TICKS_PER_SECOND)
+// Writes an event to the MIDI Atom input port. Nothing is written if it does not fit.
+static bool forgeMidiEvent(AAPLV2AtomPort *port, int64_t frameTime, LV2_URID type, const void *data, uint32_t size) {
+    auto forge = selectInputForge(port, &frameTime);
+    auto sequence = (LV2_Atom*) forge->buf;
+    auto savedOffset = forge->offset;
+    auto savedSize = sequence->size;
+
+    bool ok = lv2_atom_forge_frame_time(forge, frameTime) &&
+              lv2_atom_forge_atom(forge, size, type) &&
+              lv2_atom_forge_write(forge, data, size);
+    if (!ok) {
+        // (the frame time or the atom header may have been written already.)
+        forge->offset = savedOffset;
+        sequence->size = savedSize;
+        return handleInputForgeOverflow(port, forge);
+    }
+    sequence->size = forge->offset - sizeof(LV2_Atom);
+    return true;
+}
+
+// Writes an event that was carried from the previous block, either to the port's sequence if it
+// is due in this block, or to the pending sequence again. Nothing is written if it does not fit.
+static bool forgeCarriedEvent(AAPLV2AtomPort *port, const LV2_Atom_Event *ev) {
+    int64_t frameTime = ev->time.frames;
+    LV2_Atom_Forge *forge = &port->forge;
+    if (frameTime >= port->block_frames) {
+        frameTime -= port->block_frames;
+        forge = &port->pending_forge;
+    }
+    auto sequence = (LV2_Atom*) forge->buf;
+    auto savedOffset = forge->offset;
+    auto savedSize = sequence->size;
+    if (lv2_atom_forge_frame_time(forge, frameTime) &&
+        lv2_atom_forge_write(forge, &ev->body, (uint32_t) lv2_atom_total_size(&ev->body)))
+        return true;
+    forge->offset = savedOffset;
+    sequence->size = savedSize;
+    if (forge != &port->pending_forge)
+        return false;
+    port->dropped_carried_events++;
+    return true;
+}
+
+// Returns the length of the MIDI 1.0 message that starts at `bytes`, within `size`.
+static size_t getMidi1MessageLength(const uint8_t *bytes, size_t size) {
+    uint8_t status = bytes[0];
+    size_t length;
+    if (status < 0xF0)
+        length = (status & 0xE0) == 0xC0 ? 2 : 3;
+    else if (status == 0xF1 || status == 0xF3)
+        length = 2;
+    else if (status == 0xF2)
+        length = 3;
+    else
+        length = 1;
+    return std::min(length, size);
+}
+
+// Appends a SysEx7 UMP to the port's SysEx buffer. Returns true when the SysEx message is complete
+// (F0 ... F7) in the buffer. A message that does not fit in the buffer is discarded.
+static bool appendSysex7Packet(AAPLV2AtomPort *port, const cmidi2_ump *ump) {
+    auto words = (const uint32_t*) ump;
+    uint8_t status = (words[0] >> 20) & 0xF;
+    uint8_t numBytes = std::min((words[0] >> 16) & 0xF, (uint32_t) 6);
+    uint8_t bytes[6]{(uint8_t) (words[0] >> 8), (uint8_t) words[0],
+                     (uint8_t) (words[1] >> 24), (uint8_t) (words[1] >> 16), (uint8_t) (words[1] >> 8), (uint8_t) words[1]};
+    auto capacity = std::min(port->buffer_size, (uint32_t) AAP_LV2_MAX_SYSEX7_SIZE);
+
+    bool isStart = status == 0 || status == 1;
+    bool isEnd = status == 0 || status == 3;
+    if (isStart) {
+        port->sysex_buffer[0] = 0xF0;
+        port->sysex_length = 1;
+    } else if (port->sysex_length == 0)
+        return false; // the start packet was missing or discarded.
+    if (port->sysex_length + numBytes + 1 > capacity) {
+        port->sysex_length = 0;
+        return false;
+    }
+    memcpy(port->sysex_buffer + port->sysex_length, bytes, numBytes);
+    port->sysex_length += numBytes;
+    if (!isEnd)
+        return false;
+    port->sysex_buffer[port->sysex_length++] = 0xF7;
+    return true;
+}
+
+// Converts a UMP into MIDI 1.0 messages and writes each of them as a separate midi:MidiEvent
+// (a MIDI 2.0 RPN, NRPN or Program Change with bank select becomes multiple Control Changes).
+static bool forgeUmpAsMidi1Events(AAPLV2PluginContext* ctx, AAPLV2AtomPort *port, int64_t frameTime, cmidi2_ump *ump) {
+    auto midiEventType = ctx->urids.urid_midi_event_type;
+    if (cmidi2_ump_get_message_type(ump) == CMIDI2_MESSAGE_TYPE_SYSEX7) {
+        if (!appendSysex7Packet(port, ump))
+            return true;
+        auto ok = forgeMidiEvent(port, frameTime, midiEventType, port->sysex_buffer, port->sysex_length);
+        port->sysex_length = 0;
+        return ok;
+    }
 
     uint8_t midi1Bytes[16];
+    auto size = cmidi2_convert_single_ump_to_midi1(midi1Bytes, sizeof(midi1Bytes), ump);
+    for (size_t offset = 0; size > 0 && offset < (size_t) size; ) {
+        auto length = getMidi1MessageLength(midi1Bytes + offset, size - offset);
+        if (!forgeMidiEvent(port, frameTime, midiEventType, midi1Bytes + offset, length))
+            return false;
+        offset += length;
+    }
+    return true;
+}
 
-    // We deal with both MIDI and Patch (parameter changes) from the unified UMP sequence, while
-    // this function has to deal with multiple use-cases, in particular:
-    // - The Patch Atom sequence and the MIDI Atom sequence might be the only one, then
-    //   they have to be unified, ordered by the event timestamp.
-    // - The Patch Atom sequence and the MIDI Atom sequence might be different, then
-    //   we have to store them separately.
-    // - There may not be a Patch Atom sequence, then it may be ControlPort.
-    //   In that case, there may be no Atom output.
-    // - There may be no Atom sequence at all, when it is an effect plugin and has only ControlPorts.
-    // - There may be more than one MIDI Atom sequences. We differentiate the destination
-    //   (input to LV2) by UMP "group".
+// Writes the UMP as a MIDI event to the port, either as is or converted to MIDI 1.0.
+static bool forgeUmpEvent(AAPLV2PluginContext* ctx, AAPLV2AtomPort *port, int64_t frameTime, cmidi2_ump *ump) {
+    // Ports that support UMP events get the UMP as is (one copy, no conversion). Others get it
+    // downconverted to MIDI 1.0 bytestream, using the same helper path that AAPInstrumentSample relies on.
+    if (port->ump_native)
+        return forgeMidiEvent(port, frameTime, ctx->urids.urid_ump_event_type, ump,
+                              (uint32_t) cmidi2_ump_get_message_size_bytes(ump));
+    return forgeUmpAsMidi1Events(ctx, port, frameTime, ump);
+}
 
-    int32_t prevGroup{-1};
-    int32_t atomMidiIn{-1};
-    // I want to initialize it with nullptr, but clang analyzer in Android Studio is somehow stupid
-    // and treats as if it were always nullptr (flow analysis wise, it is always initialized to some value).
-    LV2_Atom_Forge *midiForge;
-    LV2_Atom_Sequence *midiSeq{nullptr};
-    std::map<int32_t, LV2_Atom_Forge_Frame> inputFrames{};
-    for (auto& p : ctx->midi_atom_inputs)
-        lv2_atom_forge_sequence_head(&ctx->midi_forges_in[p.first], &inputFrames[p.first], ctx->urids.urid_time_frame);
-    auto &portmap = ctx->mappings.ump_group_to_atom_in_port;
-
-    CMIDI2_UMP_SEQUENCE_FOREACH((uint8_t*) src + sizeof(AAPMidiBufferHeader), aapmb->length, iter) {
-        auto ump = (cmidi2_ump*) iter;
-
-        auto targetUmpGroup = cmidi2_ump_get_group(ump);
-        if (prevGroup != targetUmpGroup) {
-            prevGroup = targetUmpGroup;
-            atomMidiIn = portmap.find(targetUmpGroup) == portmap.end() ?
-                    -1 : ctx->mappings.ump_group_to_atom_in_port[targetUmpGroup];
-            midiForge = atomMidiIn < 0 ? nullptr : &ctx->midi_forges_in[atomMidiIn];
-            midiSeq = atomMidiIn < 0 ? nullptr : ctx->midi_atom_inputs[atomMidiIn];
+// Forges the events that were carried from the previous block, the MIDI events of the port's UMP group,
+// and the patch:Set events if it is the patch port, merged in time order. Events that are not due in
+// this block go to the pending sequence (which is kept in time order too).
+static void forgeAtomInputPort(AAPLV2PluginContext* ctx, AAPLV2AtomPort *port, const uint32_t *words,
+                               const AAPLV2UmpEventRef *midi, const AAPLV2UmpEventRef *midiEnd,
+                               const AAPLV2UmpEventRef *patch, const AAPLV2UmpEventRef *patchEnd) {
+    auto pendingBody = &port->pending->body;
+    auto pendingSize = port->pending->atom.size;
+    auto carried = lv2_atom_sequence_begin(pendingBody);
+    bool overflow = false;
+
+    lv2_atom_forge_sequence_head(&port->forge, &port->frame, ctx->urids.urid_time_frame);
+    while (true) {
+        bool hasCarried = !lv2_atom_sequence_is_end(pendingBody, pendingSize, carried);
+        bool hasMidi = midi != midiEnd;
+        bool hasPatch = patch != patchEnd;
+        if (!hasCarried && !hasMidi && !hasPatch)
+            break;
+        // new events are in the stream order. Carried events come first at the same frame, as they arrived earlier.
+        bool isPatch = hasPatch && (!hasMidi || patch->word < midi->word);
+        if (hasCarried && ((!hasMidi && !hasPatch) || carried->time.frames <= (isPatch ? patch : midi)->frame)) {
+            if (!overflow && !forgeCarriedEvent(port, carried))
+                overflow = true;
+            carried = lv2_atom_sequence_next(carried);
+            continue;
         }
 
-        auto messageType = cmidi2_ump_get_message_type(ump);
-        auto statusCode = cmidi2_ump_get_status_code(ump); // may not apply, but won't break.
+        auto &ev = isPatch ? *patch++ : *midi++;
+        auto ump = (cmidi2_ump*) (words + ev.word);
+        if (overflow)
+            continue;
+        if (isPatch) {
+            uint8_t paramGroup, paramChannel, paramKey{0}, paramExtra{0};
+            uint16_t paramId;
+            uint32_t paramValue;
+            readMidi2Parameter(&paramGroup, &paramChannel, &paramKey, &paramExtra, &paramId, &paramValue, ump);
+            auto meta = ctx->getParameterMetadata(paramId);
+            double plainValue = aapParameterTransportUint32ToPlain(meta->min_value, meta->max_value, paramValue);
+            overflow = !forgePatchSet(ctx, port, ev.frame, meta, plainValue);
+        } else
+            overflow = !forgeUmpEvent(ctx, port, ev.frame, ump);
+    }
+    lv2_atom_forge_pop(&port->forge, &port->frame);
+
+    if (overflow)
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG,
+                     "Dropping input events due to Atom forge overflow on LV2 port %d (buffer=%zu)",
+                     port->lv2_port, (size_t) port->buffer_size);
+}
+
+// Classifies the UMPs of the block in one pass. Timestamps are resolved into frames here,
+// ControlPort parameter changes are applied (or queued for sub-block processing), and the rest
+// is put into the per-group (and patch:Set) event lists of `ctx->ump_demux`.
+static void demultiplexUmps(AAPLV2PluginContext* ctx, const uint32_t *words, size_t numWords, int32_t frameCount) {
+    auto &demux = ctx->ump_demux;
+    bool hasPatchPort = ctx->mappings.patch_in_atom_port >= 0;
+    auto &timing = ctx->midi_timing;
+
+    demux.demultiplex(words, numWords, [&](uint32_t word, uint8_t messageType) {
+        auto ump = (cmidi2_ump*) (words + word);
 
         // update time info if it is a utility message, and skip Atom event emission.
         if (messageType == CMIDI2_MESSAGE_TYPE_UTILITY) {
-            switch (statusCode) {
+            auto data = words[word];
+            switch (cmidi2_ump_get_status_code(ump)) {
             case CMIDI2_UTILITY_STATUS_JR_CLOCK:
-                // FIXME: take JR_CLOCK into consideration
+                timing.onJRClock((uint16_t) data);
                 break;
             case CMIDI2_UTILITY_STATUS_JR_TIMESTAMP:
-                currentJRTimestamp += cmidi2_ump_get_jr_timestamp_timestamp(ump);
+                timing.onJRTimestamp((uint16_t) data);
+                break;
+            case AAP_LV2_UTILITY_STATUS_DCTPQ:
+                timing.onDeltaClockstampTicksPerQuarterNote((uint16_t) data);
+                break;
+            case AAP_LV2_UTILITY_STATUS_DELTA_CLOCKSTAMP:
+                timing.onDeltaClockstamp(data & 0xFFFFF);
                 break;
             }
-            continue;
+            return;
         }
+        // Flex Data Set Tempo (status bank 0, status 0) changes the length of Delta Clockstamp ticks.
+        // It is still passed to the plugin.
+        if (messageType == 0xD && (words[word] & 0xFFFF) == 0)
+            timing.onSetTempo(words[word + 1]);
+
+        // Events at or past the end of the block are carried to later blocks (see forgeAtomInputPort()).
+        auto frameTime = std::min(timing.currentFrame(), (int64_t) INT32_MAX);
 
         uint8_t paramGroup, paramChannel, paramKey{0}, paramExtra{0};
         uint16_t paramId;
         uint32_t paramValue;
 
-        if (readMidi2Parameter(&paramGroup, &paramChannel, &paramKey, &paramExtra, &paramId, &paramValue, ump)) {
+        if (messageType == CMIDI2_MESSAGE_TYPE_SYSEX8_MDS &&
+            readMidi2Parameter(&paramGroup, &paramChannel, &paramKey, &paramExtra, &paramId, &paramValue, ump)) {
             // Parameter changes.
             // They are used either for Atom Sequence or ControlPort.
-            auto minValue = ctx->getAAPParameterProperty(paramId, AAP_PARAMETER_PROPERTY_MIN_VALUE);
-            auto maxValue = ctx->getAAPParameterProperty(paramId, AAP_PARAMETER_PROPERTY_MAX_VALUE);
-            float paramValueF32 = (float) aapParameterTransportUint32ToPlain(minValue, maxValue, paramValue);
-            // FIXME: there should be some normative way to identify whether we should use LV2 patch or ControlPort...
-            if (ctx->mappings.lv2_patch_in_port >= 0 &&
-                !ctx->mappings.lv2_index_to_port.contains(paramId)) {
-                // write Patch to the Atom port
-                auto patchForge = &ctx->patch_forge_in;
-
-                /*
-                LV2_Atom_Forge_Frame patchFrame;
-                lv2_atom_forge_object(patchForge, &patchFrame, 0, ctx->urids.urid_patch_set);
-                lv2_atom_forge_key(patchForge, ctx->urids.urid_patch_property);
-                 */
-
-                // FIXME: implement patch object output
-                //assert(false);
-
-                void* ptr = ctx->explicitly_allocated_port_buffers[ctx->mappings.lv2_patch_in_port];
-                ((LV2_Atom_Sequence*) ptr)->atom.size = patchForge->offset - sizeof(LV2_Atom);
-            } else {
-                // set ControlPort value.
-                uint32_t portIndex = ctx->mappings.lv2_index_to_port[paramId];
-                ctx->control_buffer_pointers[portIndex] = paramValueF32;
-            }
+            auto meta = ctx->getParameterMetadata(paramId);
+            if (!meta)
+                return;
+            if (meta->port_index >= 0) {
+                // set ControlPort value. In sub-block processing, it is deferred until its timestamp.
+                // (If there are too many changes in a block, the rest are applied from the beginning.)
+                // Changes for later blocks are not carried, but applied at the end of this block.
+                if (frameCount > 0 && frameTime >= frameCount)
+                    frameTime = frameCount - 1;
+                double plainValue = aapParameterTransportUint32ToPlain(meta->min_value, meta->max_value, paramValue);
+                auto &changes = ctx->pending_control_changes;
+                ctx->state_snapshot.markPortChanged((uint32_t) meta->port_index);
+                if (frameTime > 0 && ctx->options.sub_block_processing && changes.size() < changes.capacity())
+                    changes.emplace_back(AAPLV2ControlChange{(int32_t) frameTime, (uint32_t) meta->port_index, (float) plainValue});
+                else
+                    ctx->control_buffer_pointers[meta->port_index] = (float) plainValue;
+            } else if (meta->property_index >= 0 && hasPatchPort)
+                demux.add(word, (int32_t) frameTime, AAP_LV2_UMP_DEMUX_PATCH_BUCKET);
+            return;
+        }
+
+        // Otherwise - MIDI message, for the Atom port of its group.
+        demux.add(word, (int32_t) frameTime, demux.headers[word] & 0xF);
+    });
+}
+
+bool
+write_midi2_events_as_midi1_to_lv2_forge(AAPLV2PluginContext* ctx, aap_buffer_t *buffer, int32_t frameCount) {
+
+    int32_t aapInPort = ctx->mappings.aap_midi_in_port;
+    void *src = buffer->get_buffer(buffer, aapInPort);
+
+    if (src == nullptr) {
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "AAP input port %d is not assigned a valid buffer.", aapInPort);
+        return false;
+    }
+
+    volatile auto aapmb = (AAPMidiBufferHeader*) src;
+    auto words = (const uint32_t*) ((uint8_t*) src + sizeof(AAPMidiBufferHeader));
+    auto numWords = (size_t) aapmb->length / sizeof(uint32_t);
+    if (numWords > ctx->ump_demux.capacityInWords()) {
+        ctx->stats.dropped_midi_input_words += numWords - ctx->ump_demux.capacityInWords();
+        numWords = ctx->ump_demux.capacityInWords();
+    }
+
+    // We deal with both MIDI and Patch (parameter changes) from the unified UMP sequence, while
+    // this function has to deal with multiple use-cases, in particular:
+    // - The Patch Atom sequence and the MIDI Atom sequence might be the only one, then
+    //   they have to be unified, ordered by the event timestamp.
+    // - The Patch Atom sequence and the MIDI Atom sequence might be different, then
+    //   we have to store them separately.
+    // - There may not be a Patch Atom sequence, then it may be ControlPort.
+    //   In that case, there may be no Atom output.
+    // - There may be no Atom sequence at all, when it is an effect plugin and has only ControlPorts.
+    // - There may be more than one MIDI Atom sequences. We differentiate the destination
+    //   (input to LV2) by UMP "group".
+    // The UMPs are first demultiplexed into per-group lists, then each Atom port is forged at once.
+    // Ports that receive nothing are left as the empty sequences that clearBufferForRun() made.
 
+    ctx->midi_timing.beginBlock(frameCount);
+    demultiplexUmps(ctx, words, numWords, frameCount);
+
+    auto &demux = ctx->ump_demux;
+    auto &atomPorts = ctx->mappings.atom_ports;
+    for (int32_t i = 0; i < (int32_t) atomPorts.size(); i++) {
+        auto &atomPort = atomPorts[i];
+        if (!atomPort.is_input)
             continue;
+        auto midi = demux.bucketBegin(0), midiEnd = midi;
+        if (atomPort.ump_group >= 0) {
+            midi = demux.bucketBegin(atomPort.ump_group);
+            midiEnd = demux.bucketEnd(atomPort.ump_group);
         }
+        auto patch = demux.bucketBegin(AAP_LV2_UMP_DEMUX_PATCH_BUCKET), patchEnd = patch;
+        if (i == ctx->mappings.patch_in_atom_port)
+            patchEnd = demux.bucketEnd(AAP_LV2_UMP_DEMUX_PATCH_BUCKET);
+
+        // what was collected for this block becomes `pending`, and `next_pending` is started over.
+        std::swap(atomPort.pending, atomPort.next_pending);
+        atomPort.block_frames = frameCount;
+        lv2_atom_forge_set_buffer(&atomPort.pending_forge, (uint8_t *) atomPort.next_pending, atomPort.buffer_size);
+        lv2_atom_forge_sequence_head(&atomPort.pending_forge, &atomPort.pending_frame, ctx->urids.urid_time_frame);
+        if (midi != midiEnd || patch != patchEnd || atomPort.pending->atom.size > sizeof(LV2_Atom_Sequence_Body))
+            forgeAtomInputPort(ctx, &atomPort, words, midi, midiEnd, patch, patchEnd);
+        lv2_atom_forge_pop(&atomPort.pending_forge, &atomPort.pending_frame);
+    }
 
-        // Otherwise - MIDI message. Downconvert from UMP to bytestream using the same helper path
-        // that AAPInstrumentSample relies on.
-        auto midiEventSize = cmidi2_convert_single_ump_to_midi1(midi1Bytes, sizeof(midi1Bytes), ump);
-        if (midiEventSize <= 0)
-            continue;
+    return true;
+}
 
-        if (!midiForge)
-            continue;
+// Returns true if any input Atom port had events carried into the current block.
+static bool hasCarriedInputEvents(AAPLV2PluginContext* ctx) {
+    for (auto &atomPort : ctx->mappings.atom_ports)
+        if (atomPort.is_input && atomPort.pending && atomPort.pending->atom.size > sizeof(LV2_Atom_Sequence_Body))
+            return true;
+    return false;
+}
 
-        auto frameTime = static_cast<int64_t>(
-                (double) currentJRTimestamp / CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND * ctx->sample_rate);
-        if (frameCount > 0 && frameTime >= frameCount)
-            frameTime = frameCount - 1;
-
-        auto frameRef = lv2_atom_forge_frame_time(midiForge, frameTime);
-        auto atomRef = frameRef ? lv2_atom_forge_atom(midiForge, midiEventSize, ctx->urids.urid_midi_event_type) : 0;
-        auto writeRef = atomRef ? lv2_atom_forge_write(midiForge, midi1Bytes, midiEventSize) : 0;
-        if (!frameRef || !atomRef || !writeRef) {
-            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG,
-                         "Dropping MIDI event due to Atom forge overflow on LV2 port %d (size=%u, buffer=%zu)",
-                         atomMidiIn, midiEventSize, getAtomPortBufferSize(ctx, atomMidiIn));
-            break;
-        }
+// Returns the number of UMP words that a MIDI 1.0 bytestream event will take, or 0 if it is not convertible.
+static size_t getUmpWordCountForMidi1Event(const uint8_t *bytes, size_t size) {
+    if (size == 0 || bytes[0] < 0x80)
+        return 0; // we don't expect running status in an Atom event.
+    if (bytes[0] == 0xF0) {
+        size_t payload = size - 1 - (bytes[size - 1] == 0xF7 ? 1 : 0);
+        return (payload == 0 ? 1 : (payload + 5) / 6) * 2;
+    }
+    return 1;
+}
 
-        midiSeq->atom.size = midiForge->offset - sizeof(LV2_Atom);
+// Writes a MIDI 1.0 bytestream event as MIDI 1.0 UMPs (Message Type 1, 2 or 3).
+// `dst` must have the room for getUmpWordCountForMidi1Event() words.
+static void writeMidi1EventAsUmp(uint32_t *dst, uint8_t group, const uint8_t *bytes, size_t size) {
+    uint8_t status = bytes[0];
+    if (status == 0xF0) {
+        // SysEx7: up to 6 bytes per packet.
+        const uint8_t *payload = bytes + 1;
+        size_t remaining = size - 1 - (bytes[size - 1] == 0xF7 ? 1 : 0);
+        bool first = true;
+        do {
+            auto n = std::min(remaining, (size_t) 6);
+            uint8_t packetStatus = first ? (remaining <= 6 ? 0 : 1) : (remaining <= 6 ? 3 : 2);
+            uint8_t d[6]{0, 0, 0, 0, 0, 0};
+            memcpy(d, payload, n);
+            *dst++ = (0x3u << 28) | ((uint32_t) group << 24) | ((uint32_t) packetStatus << 20) |
+                     ((uint32_t) n << 16) | ((uint32_t) d[0] << 8) | d[1];
+            *dst++ = ((uint32_t) d[2] << 24) | ((uint32_t) d[3] << 16) | ((uint32_t) d[4] << 8) | d[5];
+            payload += n;
+            remaining -= n;
+            first = false;
+        } while (remaining > 0);
+        return;
     }
+    uint8_t d1 = size > 1 ? bytes[1] & 0x7F : 0;
+    uint8_t d2 = size > 2 ? bytes[2] & 0x7F : 0;
+    // System Common / Real Time messages are Message Type 1, channel messages are Message Type 2.
+    uint32_t messageType = status >= 0xF0 ? 0x1 : 0x2;
+    *dst = (messageType << 28) | ((uint32_t) group << 24) | ((uint32_t) status << 16) | ((uint32_t) d1 << 8) | d2;
+}
 
-    for (auto& p : ctx->midi_atom_inputs)
-        lv2_atom_forge_pop(&ctx->midi_forges_in[p.first], &inputFrames[p.first]);
+// Copies the UMPs in a UMP event into `dst`, assigning the UMP group for the port (groupless messages
+// are copied as is). Returns the number of words that were copied, which stops at a truncated UMP.
+static size_t copyUmpEventWithGroup(uint32_t *dst, uint8_t group, const uint32_t *words, size_t numWords) {
+    size_t copied = 0;
+    while (copied < numWords) {
+        auto ump = (cmidi2_ump*) (words + copied);
+        auto size = cmidi2_ump_get_message_size_bytes(ump) / sizeof(uint32_t);
+        if (size == 0 || copied + size > numWords)
+            break;
+        memcpy(dst + copied, words + copied, size * sizeof(uint32_t));
+        auto messageType = cmidi2_ump_get_message_type(ump);
+        if (messageType != CMIDI2_MESSAGE_TYPE_UTILITY && messageType != 0xF)
+            dst[copied] = (dst[copied] & 0xF0FFFFFFu) | ((uint32_t) group << 24);
+        copied += size;
+    }
+    return copied;
+}
 
-    return true;
+// Reads a patch:Set event for a property parameter from the plugin.
+static bool readPatchSetEvent(AAPLV2PluginContext* ctx, const LV2_Atom_Forge *forge, const LV2_Atom *atom,
+                              int32_t *parameterId, double *value) {
+    if (atom->type != forge->Object && atom->type != forge->Blank && atom->type != forge->Resource)
+        return false;
+    auto obj = (const LV2_Atom_Object*) atom;
+    if (obj->body.otype != ctx->urids.urid_patch_set)
+        return false;
+    const LV2_Atom *property{nullptr}, *propertyValue{nullptr};
+    lv2_atom_object_get(obj, ctx->urids.urid_patch_property, &property,
+                        ctx->urids.urid_patch_value, &propertyValue, 0);
+    if (!property || property->type != forge->URID || !propertyValue)
+        return false;
+    *parameterId = ctx->getParameterIdForPatchProperty(((const LV2_Atom_URID*) property)->body);
+    return *parameterId >= 0 && readAtomNumber(forge, propertyValue, value);
+}
+
+static uint64_t framesToJRTimestampTicks(AAPLV2PluginContext* ctx, int64_t frames) {
+    return (uint64_t) ((double) frames * CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND / ctx->sample_rate);
 }
 
 bool
-read_forge_events_as_midi2_events(AAPLV2PluginContext* ctx, aap_buffer_t * buffer) {
+read_forge_events_as_midi2_events(AAPLV2PluginContext* ctx, aap_buffer_t * buffer, int32_t frameCount) {
     int32_t aapOutPort = ctx->mappings.aap_midi_out_port;
     if (aapOutPort < 0)
         return true;
@@ -436,44 +757,334 @@ read_forge_events_as_midi2_events(AAPLV2PluginContext* ctx, aap_buffer_t * buffe
     if (outputCapacity <= static_cast<int32_t>(sizeof(AAPMidiBufferHeader)))
         return true;
 
-    auto* outputBytes = reinterpret_cast<uint8_t*>(header) + sizeof(AAPMidiBufferHeader);
-    auto remainingCapacity = static_cast<size_t>(outputCapacity - sizeof(AAPMidiBufferHeader));
+    auto* outputWords = reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(header) + sizeof(AAPMidiBufferHeader));
+    auto capacityInWords = static_cast<size_t>(outputCapacity - sizeof(AAPMidiBufferHeader)) / sizeof(uint32_t);
     size_t written = 0;
 
     auto writeParameter = [&](int32_t parameterId, double minValue, double maxValue, double value) {
-        if (written + 16 > remainingCapacity)
+        if (written + 4 > capacityInWords)
             return false;
-        auto* message = reinterpret_cast<uint32_t*>(outputBytes + written);
+        auto* message = outputWords + written;
         aapMidi2ParameterSysex8(message, message + 1, message + 2, message + 3,
                                 0, 0, 0, 0,
                                 static_cast<uint16_t>(parameterId),
                                 aapParameterPlainToTransportUint32(minValue, maxValue, value));
-        written += 16;
+        written += 4;
         return true;
     };
 
-    for (auto* parameter : ctx->aapParams) {
-        auto parameterId = parameter->stable_id;
-        if (parameterId < 0)
+    // Parameter changes come first, as they are at the beginning of the block.
+    // Changed ControlPort values are detected 64 ports at a time. Input ports are echoed as is,
+    // while output ports are sent only at the configured rate, and only beyond their deadbands.
+    // Those that did not fit are retried in the next cycle (as their last values are not updated).
+    auto &tracker = ctx->parameter_changes;
+    bool outputsDue = tracker.emit_all || tracker.frames_until_output <= 0;
+    auto current = ctx->control_buffer_pointers;
+    auto last = tracker.last_emitted_values.data();
+    auto numLV2Ports = tracker.last_emitted_values.size();
+    bool full = false;
+    for (size_t w = 0; w < tracker.input_ports.size() && !full; w++) {
+        auto eligible = tracker.input_ports[w] | (outputsDue ? tracker.output_ports[w] : 0);
+        if (!eligible)
+            continue;
+        auto first = w * AAP_LV2_CHANGE_MASK_BITS;
+        auto changed = tracker.emit_all ? eligible : eligible & aap_lv2_detect_changes(
+                current + first, last + first, tracker.deadbands.data() + first,
+                std::min(numLV2Ports - first, (size_t) AAP_LV2_CHANGE_MASK_BITS));
+        for (; changed; changed &= changed - 1) {
+            auto port = (int32_t) (first + __builtin_ctzll(changed));
+            auto meta = ctx->getParameterMetadata(port);
+            if (!writeParameter(port, meta->min_value, meta->max_value, current[port])) {
+                full = true;
+                break;
+            }
+            last[port] = current[port];
+        }
+    }
+    tracker.emit_all = false;
+    if (outputsDue)
+        tracker.frames_until_output = tracker.output_interval_frames;
+    tracker.frames_until_output -= frameCount;
+
+    // Then events from the MIDI and patch Atom output ports, merged in time order (each sequence is
+    // already ordered), with JR Timestamps in between. MIDI events (and UMP events as is) are sent to
+    // the UMP group for the port, and patch:Set events become parameter changes.
+    AAPLV2AtomPort* ports[AAP_LV2_NUM_UMP_GROUPS + 1];
+    LV2_Atom_Event* cursors[AAP_LV2_NUM_UMP_GROUPS + 1];
+    int numPorts = 0;
+    auto &atomPorts = ctx->mappings.atom_ports;
+    for (int32_t i = 0; i < (int32_t) atomPorts.size() && numPorts < AAP_LV2_NUM_UMP_GROUPS + 1; i++) {
+        auto &atomPort = atomPorts[i];
+        if (atomPort.is_input || (atomPort.ump_group < 0 && i != ctx->mappings.patch_out_atom_port))
             continue;
-        if (parameterId >= static_cast<int32_t>(ctx->last_emitted_parameter_values.size()))
+        auto seq = atomPort.sequence;
+        // the plugin did not write anything.
+        if (seq->atom.type != ctx->urids.urid_atom_sequence_type)
             continue;
+        auto begin = lv2_atom_sequence_begin(&seq->body);
+        if (lv2_atom_sequence_is_end(&seq->body, seq->atom.size, begin))
+            continue;
+        ports[numPorts] = &atomPort;
+        cursors[numPorts++] = begin;
+    }
+
+    int64_t currentFrame = 0;
+    while (numPorts > 0) {
+        int next = 0;
+        for (int k = 1; k < numPorts; k++)
+            if (cursors[k]->time.frames < cursors[next]->time.frames)
+                next = k;
+        auto ev = cursors[next];
+        auto port = ports[next];
+        auto seq = port->sequence;
+        cursors[next] = lv2_atom_sequence_next(ev);
+        if (lv2_atom_sequence_is_end(&seq->body, seq->atom.size, cursors[next])) {
+            ports[next] = ports[numPorts - 1];
+            cursors[next] = cursors[numPorts - 1];
+            numPorts--;
+        }
 
-        auto currentValue = ctx->control_buffer_pointers[parameterId];
-        auto previousValue = ctx->last_emitted_parameter_values[parameterId];
-        if (!ctx->emit_all_parameter_values && currentValue == previousValue)
+        const uint8_t *midiBytes{nullptr};
+        const uint32_t *umpWords{nullptr};
+        int32_t parameterId{-1};
+        double parameterValue{0};
+        size_t eventWords;
+        if (ev->body.type == ctx->urids.urid_midi_event_type && port->ump_group >= 0) {
+            midiBytes = (const uint8_t*) LV2_ATOM_BODY_CONST(&ev->body);
+            eventWords = getUmpWordCountForMidi1Event(midiBytes, ev->body.size);
+        } else if (ev->body.type == ctx->urids.urid_ump_event_type && port->ump_group >= 0) {
+            umpWords = (const uint32_t*) LV2_ATOM_BODY_CONST(&ev->body);
+            eventWords = ev->body.size / sizeof(uint32_t);
+        } else if (readPatchSetEvent(ctx, &port->forge, &ev->body, &parameterId, &parameterValue))
+            eventWords = 4;
+        else
             continue;
-        if (!writeParameter(parameterId, parameter->min_value, parameter->max_value, currentValue))
-            break;
-        ctx->last_emitted_parameter_values[parameterId] = currentValue;
+        if (eventWords == 0)
+            continue;
+
+        auto frame = std::max(currentFrame, (int64_t) ev->time.frames);
+        auto ticks = framesToJRTimestampTicks(ctx, frame) - framesToJRTimestampTicks(ctx, currentFrame);
+        // a JR Timestamp can hold up to 16 bits.
+        auto timestampWords = (ticks + 0xFFFF - 1) / 0xFFFF;
+        if (written + timestampWords + eventWords > capacityInWords) {
+            ctx->stats.dropped_midi_output_events++;
+            continue;
+        }
+        auto group = (uint8_t) std::max((int8_t) 0, port->ump_group);
+        while (ticks > 0) {
+            auto t = std::min(ticks, (uint64_t) 0xFFFF);
+            outputWords[written++] = ((uint32_t) group << 24) | (CMIDI2_UTILITY_STATUS_JR_TIMESTAMP << 16) | (uint32_t) t;
+            ticks -= t;
+        }
+        currentFrame = frame;
+        if (midiBytes) {
+            writeMidi1EventAsUmp(outputWords + written, group, midiBytes, ev->body.size);
+            written += eventWords;
+        } else if (umpWords) {
+            written += copyUmpEventWithGroup(outputWords + written, group, umpWords, eventWords);
+        } else {
+            auto meta = ctx->getParameterMetadata(parameterId);
+            writeParameter(parameterId, meta->min_value, meta->max_value, parameterValue);
+        }
     }
 
-    header->length = static_cast<uint32_t>(written);
-    ctx->emit_all_parameter_values = false;
+    header->length = static_cast<uint32_t>(written * sizeof(uint32_t));
 
     return true;
 }
 
+// Copies the events in [offset, offset + length) of `src` into `dst`, shifting their time by `-offset`.
+static void copySubBlockEvents(LV2_Atom_Sequence *dst, uint32_t capacity, const LV2_Atom_Sequence *src,
+                               int64_t offset, int64_t length) {
+    dst->atom.type = src->atom.type;
+    dst->body.unit = src->body.unit;
+    dst->body.pad = 0;
+    lv2_atom_sequence_clear(dst);
+    LV2_ATOM_SEQUENCE_FOREACH(src, ev) {
+        if (ev->time.frames < offset)
+            continue;
+        if (ev->time.frames >= offset + length)
+            break;
+        auto copied = lv2_atom_sequence_append_event(dst, capacity - sizeof(LV2_Atom), ev);
+        if (!copied)
+            break;
+        copied->time.frames -= offset;
+    }
+}
+
+// Appends the events in `src` to `dst`, shifting their time by `offset`.
+static void appendSubBlockEvents(LV2_Atom_Sequence *dst, uint32_t capacity, const LV2_Atom_Sequence *src, int64_t offset) {
+    LV2_ATOM_SEQUENCE_FOREACH(src, ev) {
+        auto appended = lv2_atom_sequence_append_event(dst, capacity - sizeof(LV2_Atom), ev);
+        if (!appended)
+            break;
+        appended->time.frames += offset;
+    }
+}
+
+static void runSubBlock(AAPLV2PluginContext* ctx, aap_buffer_t *buffer, int32_t offset, int32_t length) {
+    auto instance = ctx->instance;
+    auto &routes = ctx->mappings.routes;
+    for (uint32_t p = 0; p < routes.size(); p++)
+        if (routes[p].kind == AAP_LV2_PORT_ROUTE_AAP_BUFFER)
+            lilv_instance_connect_port(instance, p, (float*) buffer->get_buffer(buffer, routes[p].aap_port) + offset);
+
+    for (auto &atomPort : ctx->mappings.atom_ports) {
+        if (!atomPort.sub_block_staging)
+            continue;
+        if (atomPort.is_input)
+            copySubBlockEvents(atomPort.sequence, atomPort.buffer_size, atomPort.sub_block_staging, offset, length);
+        else
+            resetAtomOutputBuffer(atomPort);
+    }
+
+    lilv_instance_run(instance, length);
+
+    for (auto &atomPort : ctx->mappings.atom_ports)
+        if (atomPort.sub_block_staging && !atomPort.is_input &&
+            atomPort.sequence->atom.type == ctx->urids.urid_atom_sequence_type)
+            appendSubBlockEvents(atomPort.sub_block_staging, atomPort.buffer_size, atomPort.sequence, offset);
+}
+
+// Commits the ControlPort values of a restored state, if one is published, and notifies the completion
+// of the restore. It is called at the beginning of a block (or by the restoring thread when the instance
+// is not active). It never waits: if the slot is being retracted by a newer restore, it is left to it.
+void commitRestoredPortValues(AAPLV2PluginContext* ctx) {
+    auto &restore = ctx->state_restore;
+    auto slotIndex = restore.published_slot.load(std::memory_order_acquire);
+    if (slotIndex < 0)
+        return;
+    int32_t expected = AAP_LV2_RESTORE_SLOT_PUBLISHED;
+    if (!restore.slot_states[slotIndex].compare_exchange_strong(expected, AAP_LV2_RESTORE_SLOT_COMMITTING,
+                                                                std::memory_order_acquire))
+        return;
+    // (unless a newer restore has published the other slot already.)
+    int32_t published = slotIndex;
+    restore.published_slot.compare_exchange_strong(published, -1, std::memory_order_relaxed);
+
+    auto &slot = restore.slots[slotIndex];
+    auto values = ctx->control_buffer_pointers;
+    for (size_t w = 0; w < slot.mask.size(); w++) {
+        for (uint64_t bits = slot.mask[w]; bits != 0; bits &= bits - 1) {
+            auto port = w * 64 + __builtin_ctzll(bits);
+            values[port] = slot.values[port];
+            ctx->state_snapshot.markPortChanged(port);
+        }
+    }
+    // the host has to be notified of all the parameters (there may be property changes too).
+    ctx->markAllParameterValuesDirty();
+    auto nowNs = aap_lv2_monotonic_ns();
+    // (for the properties that restore() changed.)
+    ctx->state_snapshot.markChanged();
+    auto completion = slot.completion;
+    restore.slot_states[slotIndex].store(AAP_LV2_RESTORE_SLOT_FREE, std::memory_order_release);
+    completion.notify(true, nowNs);
+}
+
+// Outputs silence for the block, when run() is skipped.
+static void silenceOutputs(AAPLV2PluginContext* ctx, aap_buffer_t *buffer, int32_t frameCount) {
+    auto &routes = ctx->mappings.routes;
+    for (auto &route : routes)
+        if (route.kind == AAP_LV2_PORT_ROUTE_AAP_BUFFER && !route.is_input)
+            memset(buffer->get_buffer(buffer, route.aap_port), 0, frameCount * sizeof(float));
+}
+
+// Keeps the inputs of a block where run() is skipped. Its input events are carried to the next block
+// (at its beginning, as they are late already), ahead of the ones that were collected for it. Its
+// ControlPort changes are applied at once, as only the last value of each port matters by then.
+static void carrySkippedBlockInputs(AAPLV2PluginContext* ctx) {
+    auto &changes = ctx->pending_control_changes;
+    for (auto &change : changes)
+        ctx->control_buffer_pointers[change.port] = change.value;
+    changes.clear();
+
+    for (auto &atomPort : ctx->mappings.atom_ports) {
+        if (!atomPort.is_input || !atomPort.pending ||
+            atomPort.sequence->atom.size <= sizeof(LV2_Atom_Sequence_Body))
+            continue;
+        // `pending` (what was carried into this block) has been forged already, so the events are merged there.
+        auto merged = atomPort.pending;
+        auto capacity = atomPort.buffer_size - sizeof(LV2_Atom);
+        merged->atom.type = ctx->urids.urid_atom_sequence_type;
+        merged->body.unit = ctx->urids.urid_time_frame;
+        merged->body.pad = 0;
+        lv2_atom_sequence_clear(merged);
+        LV2_ATOM_SEQUENCE_FOREACH(atomPort.sequence, ev) {
+            auto carried = lv2_atom_sequence_append_event(merged, capacity, ev);
+            if (!carried) {
+                atomPort.dropped_carried_events++;
+                continue;
+            }
+            carried->time.frames = 0;
+            atomPort.carried_events++;
+        }
+        LV2_ATOM_SEQUENCE_FOREACH(atomPort.next_pending, ev) {
+            if (!lv2_atom_sequence_append_event(merged, capacity, ev)) {
+                atomPort.carried_events--;
+                atomPort.dropped_carried_events++;
+            }
+        }
+        std::swap(atomPort.pending, atomPort.next_pending);
+    }
+}
+
+// Runs the plugin over the block. If there are pending ControlPort changes, run() is split at
+// their frames, with audio ports connected at the sub-block offsets and Atom sequences
+// re-based to the sub-block.
+static void runPlugin(AAPLV2PluginContext* ctx, aap_buffer_t *buffer, int32_t frameCount) {
+    auto &changes = ctx->pending_control_changes;
+    if (changes.empty()) {
+        lilv_instance_run(ctx->instance, frameCount);
+        return;
+    }
+
+    auto &atomPorts = ctx->mappings.atom_ports;
+    for (auto &atomPort : atomPorts) {
+        auto staging = atomPort.sub_block_staging;
+        if (!staging)
+            continue;
+        if (atomPort.is_input)
+            memcpy(staging, atomPort.sequence, std::min(lv2_atom_total_size(&atomPort.sequence->atom), atomPort.buffer_size));
+        else {
+            staging->atom.type = ctx->urids.urid_atom_sequence_type;
+            staging->body.unit = ctx->urids.urid_time_frame;
+            staging->body.pad = 0;
+            lv2_atom_sequence_clear(staging);
+        }
+    }
+
+    auto minFrames = ctx->options.min_sub_block_frames;
+    int32_t offset = 0;
+    size_t next = 0;
+    while (offset < frameCount) {
+        // Apply the changes that are due at `offset`, until we find the next split point.
+        int32_t end = frameCount;
+        while (next < changes.size()) {
+            auto &change = changes[next];
+            auto split = std::min(change.frame, frameCount - minFrames);
+            if (split - offset >= minFrames) {
+                end = split;
+                break;
+            }
+            ctx->control_buffer_pointers[change.port] = change.value;
+            next++;
+        }
+        runSubBlock(ctx, buffer, offset, end - offset);
+        offset = end;
+    }
+    changes.clear();
+
+    // Restore the connections and the whole-block output sequences.
+    auto &routes = ctx->mappings.routes;
+    for (uint32_t p = 0; p < routes.size(); p++)
+        if (routes[p].kind == AAP_LV2_PORT_ROUTE_AAP_BUFFER)
+            lilv_instance_connect_port(ctx->instance, p, buffer->get_buffer(buffer, routes[p].aap_port));
+    for (auto &atomPort : atomPorts)
+        if (atomPort.sub_block_staging)
+            memcpy(atomPort.sequence, atomPort.sub_block_staging,
+                   std::min(lv2_atom_total_size(&atomPort.sub_block_staging->atom), atomPort.buffer_size));
+}
+
 const char *AAP_LV2_TRACE_SECTION_NAME = "aap::lv2::process";
 const char *AAP_LV2_TRACE_SECTION_RUN_NAME = "aap::lv2::lilv_run";
 
@@ -484,6 +1095,9 @@ void aap_lv2_plugin_process(AndroidAudioPlugin *plugin,
     // FIXME: use timeoutInNanoseconds?
 
     auto ctx = (AAPLV2PluginContext *) plugin->plugin_specific;
+    // Everything in process(), including the plugin's run(), must be real-time safe.
+    AAP_LV2_RT_SCOPE(ctx->rt_check);
+
     if (ctx->instance_state == AAP_LV2_INSTANCE_STATE_ERROR)
         return;
     if (ctx->instance_state == AAP_LV2_INSTANCE_STATE_TERMINATING)
@@ -505,27 +1119,52 @@ void aap_lv2_plugin_process(AndroidAudioPlugin *plugin,
 
     // pre-process
 
+    // (the block length has to be settled before the input events are split into this block and later ones.)
+    auto numFramesInBuffer = buffer->num_frames(buffer);
+    if (numFramesInBuffer < frameCount) {
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "frameCount passed to process() function is larger than num_frames() in aap_buffer_t.");
+        frameCount = numFramesInBuffer;
+    }
+
     clearBufferForRun(ctx, buffer);
 
-    /* Process any worker replies. */
-    jalv_worker_emit_responses(&ctx->state_worker, ctx->instance);
-    jalv_worker_emit_responses(&ctx->worker, ctx->instance);
+    jalv_worker_begin_block(&ctx->worker);
+
+    // restore() of a plugin without threadSafeRestore may be holding the instance (see aap_lv2_restore()).
+    // Then nothing calls into the plugin in this block: the worker responses are left queued, and run()
+    // is skipped (see carrySkippedBlockInputs()).
+    auto &instanceOwner = ctx->state_restore.instance_owner;
+    int32_t owner = AAP_LV2_INSTANCE_OWNER_NONE;
+    bool ownsInstance = instanceOwner.compare_exchange_strong(owner, AAP_LV2_INSTANCE_OWNER_RUN, std::memory_order_acquire);
+
+    /* Process any worker replies, within the time budget (the rest are left to the next block). */
+    uint32_t numResponses = 0;
+    if (ownsInstance) {
+        auto budgetUsec = ctx->options.worker_response_budget_usec;
+        auto responseDeadline = budgetUsec > 0 ? aap_lv2_monotonic_ns() + (int64_t) budgetUsec * 1000 : 0;
+        numResponses = jalv_worker_emit_responses(&ctx->state_worker, ctx->instance, responseDeadline) +
+                       jalv_worker_emit_responses(&ctx->worker, ctx->instance, responseDeadline);
+    }
+
+    // A restored state is committed as a whole at the block boundary (before the input events of
+    // this block, so that they are applied on top of it).
+    commitRestoredPortValues(ctx);
 
     /* Notify the plugin the run() cycle is finished */
-    if (ctx->worker.iface && ctx->worker.iface->end_run)
+    if (ownsInstance && ctx->worker.iface && ctx->worker.iface->end_run)
         ctx->worker.iface->end_run(ctx->instance->lv2_handle);
 
-    // Convert AAP MIDI/MIDI2 messages into Atom Sequence of MidiEvent.
-    // Here, we iterate over UMPs multiple times, which would look inefficient, but in practice
-    // there would be only one MIDI port, and there would not be many MIDI in messages.
-    if (!write_midi2_events_as_midi1_to_lv2_forge(ctx, buffer, frameCount))
+    // Convert AAP MIDI/MIDI2 messages into Atom Sequence of MidiEvent (or UMP events).
+    if (!write_midi2_events_as_midi1_to_lv2_forge(ctx, buffer, frameCount)) {
+        if (ownsInstance)
+            instanceOwner.store(AAP_LV2_INSTANCE_OWNER_NONE, std::memory_order_release);
+        jalv_worker_end_block(&ctx->worker);
         return;
-
-    auto numFramesInBuffer = buffer->num_frames(buffer);
-    if (numFramesInBuffer < frameCount) {
-        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "frameCount passed to process() function is larger than num_frames() in aap_buffer_t.");
-        frameCount = numFramesInBuffer;
     }
+    // Worker responses and input events (including the ones carried from earlier blocks) may change
+    // the plugin's own state (the ControlPort changes are counted in demultiplexUmps()).
+    if (numResponses > 0 || ctx->ump_demux.num_events > 0 || hasCarriedInputEvents(ctx))
+        ctx->state_snapshot.markChanged();
 
     // process
 #if ANDROID
@@ -535,7 +1174,13 @@ void aap_lv2_plugin_process(AndroidAudioPlugin *plugin,
     }
 #endif
 
-    lilv_instance_run(ctx->instance, frameCount);
+    if (ownsInstance) {
+        runPlugin(ctx, buffer, frameCount);
+        instanceOwner.store(AAP_LV2_INSTANCE_OWNER_NONE, std::memory_order_release);
+    } else {
+        carrySkippedBlockInputs(ctx);
+        silenceOutputs(ctx, buffer, frameCount);
+    }
 
 #if ANDROID
     if (ATrace_isEnabled()) {
@@ -548,7 +1193,10 @@ void aap_lv2_plugin_process(AndroidAudioPlugin *plugin,
 
     // post-process
 
-    read_forge_events_as_midi2_events(ctx, buffer);
+    read_forge_events_as_midi2_events(ctx, buffer, frameCount);
+
+    // wake up the worker (at most once per block) for the requests that were scheduled in this block.
+    jalv_worker_end_block(&ctx->worker);
 
 #if ANDROID
     if (ATrace_isEnabled()) {
@@ -569,6 +1217,32 @@ void aap_lv2_plugin_deactivate(AndroidAudioPlugin *plugin) {
     if (ctx->instance_state == AAP_LV2_INSTANCE_STATE_ACTIVE) {
         lilv_instance_deactivate(ctx->instance);
         ctx->cached_buffer = nullptr;
+        if (ctx->stats.dropped_midi_output_events > 0) {
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: %llu MIDI output events were dropped as the AAP MIDI2 output buffer was full.",
+                         ctx->aap_plugin_id.c_str(), (unsigned long long) ctx->stats.dropped_midi_output_events);
+            ctx->stats.dropped_midi_output_events = 0;
+        }
+        if (ctx->stats.dropped_midi_input_words > 0) {
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: %llu UMP words were ignored as the AAP MIDI2 input was longer than its buffer size.",
+                         ctx->aap_plugin_id.c_str(), (unsigned long long) ctx->stats.dropped_midi_input_words);
+            ctx->stats.dropped_midi_input_words = 0;
+        }
+        for (auto &atomPort : ctx->mappings.atom_ports) {
+            if (atomPort.dropped_carried_events > 0)
+                aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_LV2_TAG, "LV2 plugin %s: %llu input events for later blocks were dropped on LV2 port %d (%llu carried).",
+                             ctx->aap_plugin_id.c_str(), (unsigned long long) atomPort.dropped_carried_events,
+                             atomPort.lv2_port, (unsigned long long) atomPort.carried_events);
+            atomPort.carried_events = 0;
+            atomPort.dropped_carried_events = 0;
+        }
+        jalv_worker_report(ctx, &ctx->worker, "worker");
+        jalv_worker_report(ctx, &ctx->state_worker, "state worker");
+        aap_lv2_report_restores(ctx);
+        auto &timing = ctx->midi_timing;
+        if (timing.num_jr_clocks > 0)
+            aap::a_log_f(AAP_LOG_LEVEL_DEBUG, AAP_LV2_TAG, "LV2 plugin %s: %llu JR Clocks received (%llu rejected), estimated sender clock drift: %d ppm.",
+                         ctx->aap_plugin_id.c_str(), (unsigned long long) timing.num_jr_clocks,
+                         (unsigned long long) timing.num_rejected_jr_clocks, timing.driftPpm());
         ctx->instance_state = AAP_LV2_INSTANCE_STATE_PREPARED;
     } else {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_LV2_TAG, "LV2 plugin %s is not at prepared state.",
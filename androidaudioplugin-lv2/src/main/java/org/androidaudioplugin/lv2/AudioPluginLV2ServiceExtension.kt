@@ -19,6 +19,7 @@ class AudioPluginLV2ServiceExtension : AudioPluginService.Extension
     }
 
     val LV2_RESOURCE_FROM_FILE = "org.androidaudioplugin.lv2.AudioPluginLV2ServiceExtension#ResourceFromFile"
+    val LV2_PLUGIN_INDEX_FILENAME = "aap-lv2-index.txt"
 
     override fun initialize(context: Context)
     {
@@ -31,7 +32,8 @@ class AudioPluginLV2ServiceExtension : AudioPluginService.Extension
             initialize(lv2pathStr, null)
         } else {
             val lv2 = context.assets.list("lv2")
-            val paths = lv2?.map { "/lv2/$it/" }?.toTypedArray() ?: arrayOf()
+            // The plugin index file (generated by aap-import-lv2-metadata) is not a bundle.
+            val paths = lv2?.filter { it != LV2_PLUGIN_INDEX_FILENAME }?.map { "/lv2/$it/" }?.toTypedArray() ?: arrayOf()
             val lv2Paths = paths.joinToString(":")
             initialize(lv2Paths, context.assets)
         }
@@ -0,0 +1,858 @@
+// Desktop benchmarks for the LV2 bridge internals.
+//
+// Usage: aap-lv2-benchmarks [--quick] [--plugin <LV2 plugin URI>]
+//   --quick   runs only a few iterations (as a test).
+//   --plugin  the plugin to instantiate (in LV2_PATH), for the instantiation, preset and state format benchmarks.
+//
+// Exits with 1 if a benchmark found that its input does not round-trip.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aap-lv2-ump-demux.h"
+#include "aap-lv2-binary-state.h"
+#include "aap-lv2-descriptor.h"
+
+#if AAP_LV2_HAVE_LV2
+#include "aap-lv2-urid-map.h"
+#endif
+
+#if AAP_LV2_HAVE_LILV
+#include <malloc.h>
+#include <lilv/lilv.h>
+#include <lv2/atom/atom.h>
+#include <lv2/buf-size/buf-size.h>
+#include <lv2/core/lv2.h>
+#include <lv2/presets/presets.h>
+#include <lv2/state/state.h>
+#include "aap-lv2-preset-index.h"
+#endif
+
+struct BenchmarkOptions {
+    bool quick{false};
+    const char *plugin_uri{nullptr};
+
+    int iterations(int full) const { return quick ? std::max(full / 1000, 1) : full; }
+};
+
+// written by the benchmarks, so that the measured code is not optimized away.
+static volatile uint64_t benchmark_sink{0};
+
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void reportBenchmark(const char *name, int64_t totalNs, int iterations) {
+    printf("%-56s %14.1f ns/iteration (%d iterations)\n", name, (double) totalNs / iterations, iterations);
+}
+
+// Runs `body` `iterations` times and prints the mean time per iteration.
+template <typename F>
+static void runBenchmark(const char *name, int iterations, F &&body) {
+    auto start = nowNs();
+    for (int i = 0; i < iterations; i++)
+        body();
+    reportBenchmark(name, nowNs() - start, iterations);
+}
+
+static void skipBenchmark(const char *name, const char *reason) {
+    printf("%-56s skipped (%s)\n", name, reason);
+}
+
+static bool benchmark_failed{false};
+
+static void failBenchmark(const char *name, const char *reason) {
+    printf("%-56s FAILED (%s)\n", name, reason);
+    benchmark_failed = true;
+}
+
+// Instantiation: with a new LilvWorld that loads LV2_PATH for each instance, and with one shared
+// world that is loaded only for the first instance (AAPLV2SharedWorld).
+
+#if AAP_LV2_HAVE_LILV
+static LV2_URID_Map mapData{AAPLV2UridMap::instance(), [](LV2_URID_Map_Handle handle, const char *uri) {
+    return ((AAPLV2UridMap *) handle)->map(uri);
+}};
+static LV2_URID_Unmap unmapData{AAPLV2UridMap::instance(), [](LV2_URID_Unmap_Handle handle, LV2_URID urid) {
+    return ((AAPLV2UridMap *) handle)->unmap(urid);
+}};
+
+static const LilvPlugin *findPlugin(LilvWorld *world, const char *pluginUri) {
+    auto uriNode = lilv_new_uri(world, pluginUri);
+    auto plugin = lilv_plugins_get_by_uri(lilv_world_get_all_plugins(world), uriNode);
+    lilv_node_free(uriNode);
+    return plugin;
+}
+
+static bool instantiateAndFree(LilvWorld *world, const char *pluginUri) {
+    LV2_Feature mapFeature{LV2_URID__map, &mapData};
+    LV2_Feature unmapFeature{LV2_URID__unmap, &unmapData};
+    LV2_Feature bufSizeFeature{LV2_BUF_SIZE__boundedBlockLength, nullptr};
+    const LV2_Feature *features[]{&mapFeature, &unmapFeature, &bufSizeFeature, nullptr};
+
+    auto plugin = findPlugin(world, pluginUri);
+    if (!plugin)
+        return false;
+    auto instance = lilv_plugin_instantiate(plugin, 48000, features);
+    if (!instance)
+        return false;
+    lilv_instance_free(instance);
+    return true;
+}
+#endif
+
+static void benchmarkInstantiation(const BenchmarkOptions &options) {
+#if AAP_LV2_HAVE_LILV
+    if (!options.plugin_uri) {
+        skipBenchmark("instantiation", "no --plugin");
+        return;
+    }
+    auto sharedWorld = lilv_world_new();
+    lilv_world_load_all(sharedWorld);
+    if (!instantiateAndFree(sharedWorld, options.plugin_uri)) {
+        lilv_world_free(sharedWorld);
+        skipBenchmark("instantiation", "the plugin was not found or failed to instantiate");
+        return;
+    }
+    auto iterations = options.iterations(100);
+    runBenchmark("instantiation (world per instance)", iterations, [&] {
+        auto world = lilv_world_new();
+        lilv_world_load_all(world);
+        benchmark_sink = benchmark_sink + instantiateAndFree(world, options.plugin_uri);
+        lilv_world_free(world);
+    });
+    runBenchmark("instantiation (shared world)", iterations, [&] {
+        benchmark_sink = benchmark_sink + instantiateAndFree(sharedWorld, options.plugin_uri);
+    });
+    lilv_world_free(sharedWorld);
+#else
+    skipBenchmark("instantiation", "built without lilv");
+#endif
+}
+
+// Presets: what the first get_preset_count() does, i.e. building the preset index from the labels only
+// (aap-lv2-preset-index.h), and, as the bridge used to, by loading every preset and keeping it serialized
+// as Turtle. Each iteration uses a new world, so that nothing is loaded in advance. The memory is what is
+// still allocated after the index is built (the index and whatever the world loaded for it; glibc only).
+// Parsing a preset when it is first applied is measured too.
+
+#if AAP_LV2_HAVE_LILV
+static size_t getAllocatedBytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// an index entry, like AAPLV2PresetIndexEntry (and the serialized preset, for the eager index).
+struct BenchmarkPreset {
+    std::string name;
+    LilvNode *node;
+    char *turtle{nullptr};
+};
+
+static void freePresets(std::vector<BenchmarkPreset> &presets) {
+    for (auto &preset : presets) {
+        lilv_node_free(preset.node);
+        free(preset.turtle);
+    }
+    presets.clear();
+}
+
+struct PresetBenchmarkWorld {
+    LilvWorld *world;
+    const LilvPlugin *plugin{nullptr};
+    LilvNode *presetClass;
+    LilvNode *labelPredicate;
+    LilvNode *seeAlsoPredicate;
+    // (like the bridge's preset_resources.)
+    AAPLV2PresetResources resources;
+
+    explicit PresetBenchmarkWorld(const char *pluginUri)
+            : world(lilv_world_new()), presetClass(lilv_new_uri(world, LV2_PRESETS__Preset)),
+              labelPredicate(lilv_new_uri(world, LILV_NS_RDFS "label")),
+              seeAlsoPredicate(lilv_new_uri(world, LILV_NS_RDFS "seeAlso")), resources(world, seeAlsoPredicate) {
+        lilv_world_load_all(world);
+        plugin = findPlugin(world, pluginUri);
+    }
+    ~PresetBenchmarkWorld() {
+        resources.unloadAll();
+        lilv_node_free(presetClass);
+        lilv_node_free(labelPredicate);
+        lilv_node_free(seeAlsoPredicate);
+        lilv_world_free(world);
+    }
+
+    void indexLabels(std::vector<BenchmarkPreset> &presets) {
+        aap_lv2_index_presets(world, plugin, presetClass, labelPredicate, seeAlsoPredicate, [&](const LilvNode *preset, const LilvNode *label) {
+            if (label)
+                presets.emplace_back(BenchmarkPreset{lilv_node_as_string(label), lilv_node_duplicate(preset)});
+        });
+    }
+
+    // (as jalv_load_presets() and aap_lv2_on_preset_loaded() did before the index.)
+    void indexEagerly(std::vector<BenchmarkPreset> &presets) {
+        auto nodes = lilv_plugin_get_related(plugin, presetClass);
+        LILV_FOREACH(nodes, i, nodes) {
+            auto preset = lilv_nodes_get(nodes, i);
+            lilv_world_load_resource(world, preset);
+            auto labels = lilv_world_find_nodes(world, preset, labelPredicate, nullptr);
+            if (!labels)
+                continue;
+            auto state = lilv_state_new_from_world(world, &mapData, preset);
+            auto turtle = state ? lilv_state_to_string(world, &mapData, &unmapData, state, lilv_node_as_string(preset), nullptr) : nullptr;
+            presets.emplace_back(BenchmarkPreset{lilv_node_as_string(lilv_nodes_get_first(labels)), lilv_node_duplicate(preset),
+                                                 turtle ? strdup(turtle) : nullptr});
+            lilv_free(turtle);
+            if (state)
+                lilv_state_free(state);
+            lilv_nodes_free(labels);
+        }
+        lilv_nodes_free(nodes);
+    }
+
+    // (as aap_lv2_get_preset_state() does.)
+    bool parse(const LilvNode *preset) {
+        resources.load(preset);
+        auto state = lilv_state_new_from_world(world, &mapData, preset);
+        if (state)
+            lilv_state_free(state);
+        return state != nullptr;
+    }
+};
+#endif
+
+static void benchmarkPresets(const BenchmarkOptions &options) {
+#if AAP_LV2_HAVE_LILV
+    if (!options.plugin_uri) {
+        skipBenchmark("presets", "no --plugin");
+        return;
+    }
+    {
+        PresetBenchmarkWorld world{options.plugin_uri};
+        if (!world.plugin) {
+            skipBenchmark("presets", "the plugin was not found");
+            return;
+        }
+        std::vector<BenchmarkPreset> presets{};
+        world.indexLabels(presets);
+        auto numPresets = presets.size();
+        freePresets(presets);
+        if (numPresets == 0) {
+            skipBenchmark("presets", "the plugin has no presets");
+            return;
+        }
+    }
+
+    auto iterations = options.iterations(20);
+    for (bool eager : {false, true}) {
+        int64_t indexNs = 0, parseNs = 0, bytes = 0;
+        size_t numPresets = 0;
+        for (int i = 0; i < iterations; i++) {
+            PresetBenchmarkWorld world{options.plugin_uri};
+            std::vector<BenchmarkPreset> presets{};
+            auto allocated = getAllocatedBytes();
+            auto start = nowNs();
+            if (eager)
+                world.indexEagerly(presets);
+            else
+                world.indexLabels(presets);
+            indexNs += nowNs() - start;
+            bytes += (int64_t) getAllocatedBytes() - (int64_t) allocated;
+            numPresets = presets.size();
+            if (!eager && numPresets > 0) {
+                start = nowNs();
+                benchmark_sink = benchmark_sink + world.parse(presets[numPresets / 2].node);
+                parseNs += nowNs() - start;
+            }
+            freePresets(presets);
+        }
+        auto kind = eager ? "eager Turtle" : "labels";
+        char name[64];
+        snprintf(name, sizeof(name), "presets: index, %s (%zu presets)", kind, numPresets);
+        reportBenchmark(name, indexNs, iterations);
+        snprintf(name, sizeof(name), "presets: index memory, %s", kind);
+        printf("%-56s %14lld bytes\n", name, (long long) (bytes / iterations));
+        if (!eager)
+            reportBenchmark("presets: parse on first use (one preset)", parseNs, iterations);
+    }
+#else
+    skipBenchmark("presets", "built without lilv");
+#endif
+}
+
+// UMP demultiplexing (aap-lv2-ump-demux.h): header extraction, AAPLV2UmpDemux::demultiplex() (which
+// process() uses, with the classification reduced to the JR Timestamps and the groups), and the counting
+// sort by group. The baseline is the per-message loop that process() had before the demultiplexing.
+
+// MIDI 2.0 note-ons over all the groups, each with a JR Timestamp before it.
+static std::vector<uint32_t> createUmpInput(int numEvents) {
+    std::vector<uint32_t> words{};
+    for (int i = 0; i < numEvents; i++) {
+        words.emplace_back(0x00200000u | (uint32_t) (i & 0xFFFF)); // JR Timestamp
+        words.emplace_back(0x40903C00u | ((uint32_t) (i % AAP_LV2_UMP_DEMUX_NUM_GROUPS) << 24));
+        words.emplace_back(0xC0000000u);
+    }
+    return words;
+}
+
+static size_t demultiplex(AAPLV2UmpDemux &demux, const std::vector<uint32_t> &words) {
+    int32_t frame = 0;
+    demux.demultiplex(words.data(), words.size(), [&](uint32_t word, uint8_t messageType) {
+        if (messageType == 0) {
+            frame = (int32_t) (words[word] & 0xFFFF);
+            return;
+        }
+        demux.add(word, frame, demux.headers[word] & 0xF);
+    });
+    return demux.num_events;
+}
+
+// (as cmidi2_ump_get_message_size_bytes() does.)
+static uint32_t getUmpSizeInBytes(uint8_t messageType) {
+    switch (messageType) {
+    case 0: case 1: case 2: case 6: case 7:
+        return 4;
+    case 3: case 4: case 8: case 9: case 0xA:
+        return 8;
+    case 0xB: case 0xC:
+        return 12;
+    default:
+        return 16;
+    }
+}
+
+// The loop of write_midi2_events_as_midi1_to_lv2_forge() before the demultiplexing: message by message,
+// it reads the size from the first word, looks up the Atom port of the group in a std::map whenever the
+// group changes, and writes the event to that port right away (here, appends it to the port's list).
+static size_t forwardPerMessage(const std::vector<uint32_t> &words, const std::map<int32_t, int32_t> &portmap,
+                                std::vector<std::vector<AAPLV2UmpEventRef>> &ports) {
+    for (auto &port : ports)
+        port.clear();
+    int32_t prevGroup = -1;
+    std::vector<AAPLV2UmpEventRef> *target = nullptr;
+    int32_t frame = 0;
+    size_t numEvents = 0;
+    for (size_t w = 0; w < words.size();) {
+        auto word = words[w];
+        uint8_t messageType = word >> 28;
+        auto size = getUmpSizeInBytes(messageType) / 4;
+        if (w + size > words.size())
+            break;
+        int32_t group = (int32_t) (word >> 24) & 0xF;
+        if (group != prevGroup) {
+            prevGroup = group;
+            auto it = portmap.find(group);
+            target = it == portmap.end() ? nullptr : &ports[it->second];
+        }
+        if (messageType == 0)
+            frame = (int32_t) (word & 0xFFFF);
+        else if (target) {
+            target->emplace_back(AAPLV2UmpEventRef{(uint32_t) w, frame});
+            numEvents++;
+        }
+        w += size;
+    }
+    return numEvents;
+}
+
+static void benchmarkUmpDemux(const BenchmarkOptions &options) {
+    for (int numEvents : {1, 100, 10000}) {
+        auto words = createUmpInput(numEvents);
+        AAPLV2UmpDemux demux{};
+        demux.reserve(words.size());
+        // one Atom port per group.
+        std::map<int32_t, int32_t> portmap{};
+        std::vector<std::vector<AAPLV2UmpEventRef>> ports(AAP_LV2_UMP_DEMUX_NUM_GROUPS);
+        for (int g = 0; g < AAP_LV2_UMP_DEMUX_NUM_GROUPS; g++) {
+            portmap[g] = g;
+            ports[g].reserve(words.size());
+        }
+        if (demultiplex(demux, words) != (size_t) numEvents || forwardPerMessage(words, portmap, ports) != (size_t) numEvents) {
+            skipBenchmark("UMP demux", "the events were not demultiplexed as expected");
+            return;
+        }
+        char name[64];
+        auto iterations = options.iterations(10000000 / numEvents + 1000);
+        snprintf(name, sizeof(name), "UMP demux: extract headers (%d events)", numEvents);
+        runBenchmark(name, iterations, [&] {
+            aap_lv2_extract_ump_headers(words.data(), demux.headers.data(), words.size());
+            benchmark_sink = benchmark_sink + demux.headers[words.size() - 1];
+        });
+        snprintf(name, sizeof(name), "UMP demux: all (%d events)", numEvents);
+        runBenchmark(name, iterations, [&] {
+            benchmark_sink = benchmark_sink + demultiplex(demux, words);
+        });
+        snprintf(name, sizeof(name), "UMP demux: sortByBucket (%d events)", numEvents);
+        runBenchmark(name, iterations, [&] {
+            demux.sortByBucket();
+            benchmark_sink = benchmark_sink + demux.bucket_begin[AAP_LV2_UMP_DEMUX_NUM_BUCKETS];
+        });
+        snprintf(name, sizeof(name), "UMP demux: baseline, per message (%d events)", numEvents);
+        runBenchmark(name, iterations, [&] {
+            benchmark_sink = benchmark_sink + forwardPerMessage(words, portmap, ports);
+        });
+    }
+}
+
+// Binary state (aap-lv2-binary-state.h): saving and loading properties as opaque bytes, and as
+// atom:Object values whose URIDs are rewritten into the string table and mapped back.
+
+// (a URID map that is as cheap as possible, so that the rewriting itself is measured.)
+static const char *benchmarkUris[]{"http://lv2plug.in/ns/ext/atom#URID", "http://lv2plug.in/ns/ext/atom#Float",
+                                   "urn:benchmark#Thing", "urn:benchmark#a", "urn:benchmark#b", "urn:benchmark#c"};
+static const uint32_t numBenchmarkUris = sizeof(benchmarkUris) / sizeof(benchmarkUris[0]);
+
+static uint32_t mapBenchmarkUri(const char *uri) {
+    for (uint32_t i = 0; i < numBenchmarkUris; i++)
+        if (!strcmp(uri, benchmarkUris[i]))
+            return i + 1;
+    return 0;
+}
+
+static const char *unmapBenchmarkUrid(uint32_t urid) {
+    return urid >= 1 && urid <= numBenchmarkUris ? benchmarkUris[urid - 1] : nullptr;
+}
+
+static void benchmarkBinaryState(const BenchmarkOptions &options) {
+    // an object of 3 properties: a URID, a URID and a float (48 bytes).
+    std::vector<uint32_t> object{0, 3,
+                                 4, 0, 4, 1, 5, 0,
+                                 5, 0, 4, 1, 6, 0,
+                                 6, 0, 4, 2, 0x3F800000u, 0};
+    auto objectSize = (uint32_t) (object.size() * sizeof(uint32_t));
+    for (int numProperties : {1, 100}) {
+        std::vector<std::string> keys{};
+        for (int i = 0; i < numProperties; i++)
+            keys.emplace_back("urn:benchmark#property" + std::to_string(i));
+        auto save = [&](bool rewritesUrids) {
+            AAPLV2BinaryStateWriter writer{};
+            for (auto &key : keys) {
+                if (rewritesUrids)
+                    writer.addPropertyWithUrids(key.c_str(), "http://lv2plug.in/ns/ext/atom#Object", 1,
+                                                object.data(), objectSize, unmapBenchmarkUrid);
+                else
+                    writer.addProperty(key.c_str(), "urn:benchmark#Blob", 1, object.data(), objectSize);
+            }
+            std::vector<uint8_t> data(writer.size());
+            writer.writeTo(data.data());
+            return data;
+        };
+        auto load = [&](const std::vector<uint8_t> &data, std::vector<uint8_t> &value) {
+            AAPLV2BinaryState state{data.data()};
+            uint64_t sum = 0;
+            for (uint32_t i = 0; i < state.numProperties(); i++) {
+                state.copyValue(state.property(i), value, mapBenchmarkUri);
+                sum += value[24];
+            }
+            return sum;
+        };
+
+        char name[64];
+        auto iterations = options.iterations(1000000 / numProperties + 100);
+        for (bool rewritesUrids : {false, true}) {
+            auto kind = rewritesUrids ? "atom:Object" : "opaque";
+            auto data = save(rewritesUrids);
+            std::vector<uint8_t> value{};
+            if (!aap_lv2_binary_state_validate(data.data(), data.size()) || load(data, value) != (uint64_t) numProperties * 5) {
+                failBenchmark("binary state", "the state did not round-trip");
+                return;
+            }
+            snprintf(name, sizeof(name), "binary state: save (%d %s properties)", numProperties, kind);
+            runBenchmark(name, iterations, [&] {
+                benchmark_sink = benchmark_sink + save(rewritesUrids).size();
+            });
+            snprintf(name, sizeof(name), "binary state: load (%d %s properties)", numProperties, kind);
+            runBenchmark(name, iterations, [&] {
+                benchmark_sink = benchmark_sink + load(data, value);
+            });
+        }
+    }
+}
+
+// State formats: the binary state and Turtle (lilv_state_to_string() and lilv_state_new_from_string()),
+// saved from and restored into an instance of the plugin as the bridge does. Before they are measured,
+// a state that went through each format is restored into its own instance, and the states of the two
+// instances have to be equal.
+
+#if AAP_LV2_HAVE_LILV
+// an instance whose input ControlPorts are held here (like the bridge's control_buffer_pointers).
+struct StateBenchmarkInstance {
+    LilvWorld *world;
+    const LilvPlugin *plugin;
+    LilvInstance *instance{nullptr};
+    const LV2_State_Interface *iface{nullptr};
+    // the input ControlPorts.
+    std::vector<std::string> symbols{};
+    std::vector<float> values{};
+    LV2_Feature mapFeature{LV2_URID__map, &mapData};
+    LV2_Feature unmapFeature{LV2_URID__unmap, &unmapData};
+    LV2_Feature bufSizeFeature{LV2_BUF_SIZE__boundedBlockLength, nullptr};
+    const LV2_Feature *features[4]{&mapFeature, &unmapFeature, &bufSizeFeature, nullptr};
+
+    StateBenchmarkInstance(LilvWorld *lilvWorld, const LilvPlugin *lilvPlugin) : world(lilvWorld), plugin(lilvPlugin) {
+        instance = lilv_plugin_instantiate(plugin, 48000, features);
+        if (!instance)
+            return;
+        iface = (const LV2_State_Interface *) lilv_instance_get_extension_data(instance, LV2_STATE__interface);
+        auto controlClass = lilv_new_uri(world, LV2_CORE__ControlPort);
+        auto inputClass = lilv_new_uri(world, LV2_CORE__InputPort);
+        auto numPorts = lilv_plugin_get_num_ports(plugin);
+        std::vector<float> minimums(numPorts), maximums(numPorts), defaults(numPorts);
+        lilv_plugin_get_port_ranges_float(plugin, minimums.data(), maximums.data(), defaults.data());
+        for (uint32_t p = 0; p < numPorts; p++) {
+            auto port = lilv_plugin_get_port_by_index(plugin, p);
+            if (!lilv_port_is_a(plugin, port, controlClass) || !lilv_port_is_a(plugin, port, inputClass))
+                continue;
+            symbols.emplace_back(lilv_node_as_string(lilv_port_get_symbol(plugin, port)));
+            // (not the default, so that a port that is not restored is noticed.)
+            bool bounded = !std::isnan(minimums[p]) && !std::isnan(maximums[p]);
+            values.emplace_back(bounded ? (minimums[p] + maximums[p]) / 2 : std::isnan(defaults[p]) ? 0 : defaults[p]);
+        }
+        lilv_node_free(controlClass);
+        lilv_node_free(inputClass);
+    }
+    ~StateBenchmarkInstance() {
+        if (instance)
+            lilv_instance_free(instance);
+    }
+
+    float *findPort(const char *symbol) {
+        for (size_t i = 0; i < symbols.size(); i++)
+            if (symbols[i] == symbol)
+                return &values[i];
+        return nullptr;
+    }
+
+    // Turtle, as aap_lv2_capture_state() does.
+    LilvState *capture() {
+        return lilv_state_new_from_instance(plugin, instance, &mapData, nullptr, nullptr, nullptr, nullptr,
+                                            [](const char *symbol, void *userData, uint32_t *size, uint32_t *type) -> const void * {
+            auto value = ((StateBenchmarkInstance *) userData)->findPort(symbol);
+            *size = sizeof(float);
+            *type = mapData.map(mapData.handle, LV2_ATOM__Float);
+            return value;
+        }, this, 0, features);
+    }
+
+    char *saveTurtle() {
+        auto state = capture();
+        auto turtle = lilv_state_to_string(world, &mapData, &unmapData, state, "urn:aap_state:benchmark", nullptr);
+        lilv_state_free(state);
+        return turtle;
+    }
+
+    bool restoreTurtle(const char *turtle) {
+        auto state = lilv_state_new_from_string(world, &mapData, turtle);
+        if (!state)
+            return false;
+        lilv_state_restore(state, instance, [](const char *symbol, void *userData, const void *value, uint32_t size, uint32_t type) {
+            auto port = ((StateBenchmarkInstance *) userData)->findPort(symbol);
+            if (port && size == sizeof(float) && type == mapData.map(mapData.handle, LV2_ATOM__Float))
+                *port = *(const float *) value;
+        }, this, 0, features);
+        lilv_state_free(state);
+        return true;
+    }
+
+    // Binary, as aap_lv2_save_binary_state() does. Returns false if a property cannot be saved in the format.
+    bool saveBinary(std::vector<uint8_t> &data) {
+        AAPLV2BinaryStateWriter writer{};
+        for (size_t i = 0; i < symbols.size(); i++)
+            writer.addPort(symbols[i].c_str(), values[i]);
+        struct Store {
+            AAPLV2BinaryStateWriter *writer;
+            bool failed{false};
+        } store{&writer};
+        if (iface && iface->save)
+            iface->save(lilv_instance_get_handle(instance), [](LV2_State_Handle handle, uint32_t key, const void *value,
+                                                                size_t size, uint32_t type, uint32_t flags) {
+                auto s = (Store *) handle;
+                auto keyUri = unmapData.unmap(unmapData.handle, key);
+                auto typeUri = unmapData.unmap(unmapData.handle, type);
+                if (!(flags & LV2_STATE_IS_POD) || !keyUri || !typeUri || size > UINT32_MAX ||
+                    !s->writer->addPropertyWithUrids(keyUri, typeUri, flags, value, (uint32_t) size, [](uint32_t urid) {
+                        return unmapData.unmap(unmapData.handle, urid);
+                    })) {
+                    s->failed = true;
+                    return LV2_STATE_ERR_BAD_TYPE;
+                }
+                return LV2_STATE_SUCCESS;
+            }, &store, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE, features);
+        data.resize(writer.size());
+        writer.writeTo(data.data());
+        return !store.failed;
+    }
+
+    // as aap_lv2_restore_state_data() and aap_lv2_restore_binary_state() do.
+    bool restoreBinary(const std::vector<uint8_t> &data) {
+        if (!aap_lv2_binary_state_validate(data.data(), data.size()))
+            return false;
+        AAPLV2BinaryState state{data.data()};
+        if (iface && iface->restore) {
+            struct Retrieve {
+                const AAPLV2BinaryState *state;
+                std::vector<std::pair<LV2_URID, uint32_t>> keys{};
+                // (they have to stay until restore() returns.)
+                std::list<std::vector<uint8_t>> mappedValues{};
+            } retrieve{&state};
+            for (uint32_t i = 0; i < state.numProperties(); i++)
+                retrieve.keys.emplace_back(mapData.map(mapData.handle, state.string(state.property(i)->key)), i);
+            std::sort(retrieve.keys.begin(), retrieve.keys.end());
+            iface->restore(lilv_instance_get_handle(instance), [](LV2_State_Handle handle, uint32_t key, size_t *size,
+                                                                   uint32_t *type, uint32_t *flags) -> const void * {
+                auto r = (Retrieve *) handle;
+                auto it = std::lower_bound(r->keys.begin(), r->keys.end(), std::pair<LV2_URID, uint32_t>{key, 0});
+                if (it == r->keys.end() || it->first != key)
+                    return nullptr;
+                auto property = r->state->property(it->second);
+                const void *value = r->state->value(property);
+                if (property->flags & AAP_LV2_BINARY_STATE_PROPERTY_URIDS) {
+                    auto &mapped = r->mappedValues.emplace_back();
+                    if (!r->state->copyValue(property, mapped, [](const char *uri) { return mapData.map(mapData.handle, uri); }))
+                        return nullptr;
+                    value = mapped.data();
+                }
+                *size = property->size;
+                *type = mapData.map(mapData.handle, r->state->string(property->type));
+                *flags = property->flags & ~AAP_LV2_BINARY_STATE_PROPERTY_FLAGS;
+                return value;
+            }, &retrieve, 0, features);
+        }
+        for (uint32_t i = 0; i < state.numPorts(); i++) {
+            auto port = state.port(i);
+            if (auto value = findPort(state.string(port->symbol)))
+                *value = port->value;
+        }
+        return true;
+    }
+};
+#endif
+
+static void benchmarkStateFormats(const BenchmarkOptions &options) {
+#if AAP_LV2_HAVE_LILV
+    if (!options.plugin_uri) {
+        skipBenchmark("state formats", "no --plugin");
+        return;
+    }
+    auto world = lilv_world_new();
+    lilv_world_load_all(world);
+    auto plugin = findPlugin(world, options.plugin_uri);
+    if (!plugin) {
+        lilv_world_free(world);
+        skipBenchmark("state formats", "the plugin was not found");
+        return;
+    }
+    {
+        StateBenchmarkInstance source{world, plugin}, fromBinary{world, plugin}, fromTurtle{world, plugin};
+        std::vector<uint8_t> binary{};
+        char *turtle = nullptr;
+        if (!source.instance || !fromBinary.instance || !fromTurtle.instance)
+            skipBenchmark("state formats", "the plugin failed to instantiate");
+        else if (!source.saveBinary(binary))
+            skipBenchmark("state formats", "the state cannot be saved in the binary format");
+        else if (!fromBinary.restoreBinary(binary))
+            failBenchmark("state formats", "the binary state is corrupt");
+        else if (!(turtle = source.saveTurtle()) || !fromTurtle.restoreTurtle(turtle))
+            failBenchmark("state formats", "the state did not round-trip through Turtle");
+        else {
+            auto binaryState = fromBinary.capture();
+            auto turtleState = fromTurtle.capture();
+            bool equal = binaryState && turtleState && lilv_state_equals(binaryState, turtleState);
+            if (binaryState)
+                lilv_state_free(binaryState);
+            if (turtleState)
+                lilv_state_free(turtleState);
+            if (!equal)
+                failBenchmark("state formats", "the state restored from the binary format differs from the one restored from Turtle");
+            else {
+                auto iterations = options.iterations(1000);
+                char name[64];
+                snprintf(name, sizeof(name), "state: save, binary (%zu bytes)", binary.size());
+                runBenchmark(name, iterations, [&] {
+                    std::vector<uint8_t> data{};
+                    benchmark_sink = benchmark_sink + source.saveBinary(data) + data.size();
+                });
+                snprintf(name, sizeof(name), "state: save, Turtle (%zu bytes)", strlen(turtle));
+                runBenchmark(name, iterations, [&] {
+                    auto data = source.saveTurtle();
+                    benchmark_sink = benchmark_sink + (data ? strlen(data) : 0);
+                    lilv_free(data);
+                });
+                runBenchmark("state: load, binary", iterations, [&] {
+                    benchmark_sink = benchmark_sink + fromBinary.restoreBinary(binary);
+                });
+                runBenchmark("state: load, Turtle", iterations, [&] {
+                    benchmark_sink = benchmark_sink + fromTurtle.restoreTurtle(turtle);
+                });
+            }
+        }
+        lilv_free(turtle);
+    }
+    lilv_world_free(world);
+#else
+    skipBenchmark("state formats", "built without lilv");
+#endif
+}
+
+// Port symbol lookup, as restoring a state or a preset does for each port value: the sorted table
+// (AAPLV2SymbolTable) and a linear strcmp() scan over the ports.
+
+static void benchmarkSymbolLookup(const BenchmarkOptions &options) {
+    for (int numPorts : {16, 400}) {
+        std::vector<std::string> symbols{};
+        for (int i = 0; i < numPorts; i++)
+            symbols.emplace_back("port_" + std::to_string(i * 7919 % numPorts));
+        AAPLV2SymbolTable table{};
+        for (int i = 0; i < numPorts; i++)
+            table.add(symbols[i].c_str(), (uint32_t) i);
+        table.sort();
+        auto linearFind = [&](const char *symbol) {
+            for (int i = 0; i < numPorts; i++)
+                if (!strcmp(symbols[i].c_str(), symbol))
+                    return i;
+            return -1;
+        };
+        // (what a restore looks up: every port, in an order unrelated to the port indices.)
+        std::vector<std::string> queries{symbols.rbegin(), symbols.rend()};
+        for (int i = 0; i < numPorts; i++) {
+            auto q = queries[i].c_str();
+            if (table.find(q) != linearFind(q) || table.find(q) < 0) {
+                skipBenchmark("symbol lookup", "the table disagrees with the linear scan");
+                return;
+            }
+        }
+
+        char name[64];
+        auto iterations = options.iterations(1000000 / numPorts + 1000);
+        snprintf(name, sizeof(name), "symbol lookup: sorted table (%d ports, all)", numPorts);
+        runBenchmark(name, iterations, [&] {
+            for (auto &q : queries)
+                benchmark_sink = benchmark_sink + table.find(q.c_str());
+        });
+        snprintf(name, sizeof(name), "symbol lookup: linear strcmp (%d ports, all)", numPorts);
+        runBenchmark(name, iterations, [&] {
+            for (auto &q : queries)
+                benchmark_sink = benchmark_sink + linearFind(q.c_str());
+        });
+    }
+}
+
+// URID map contention (aap-lv2-urid-map.h): map() on several threads at once, as plugin instances and
+// their worker threads do. Lookups of mapped URIs are wait-free, and inserts of new URIs are serialized.
+// The time is per map() call on each thread (i.e. the wall time over the calls per thread).
+
+#if AAP_LV2_HAVE_LV2
+// Runs `body(thread)` on `numThreads` threads that start together, and returns the wall time.
+template <typename F>
+static int64_t runOnThreads(int numThreads, F &&body) {
+    std::atomic<bool> started{false};
+    std::vector<std::thread> threads{};
+    for (int t = 0; t < numThreads; t++)
+        threads.emplace_back([&, t] {
+            while (!started.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            body(t);
+        });
+    auto start = nowNs();
+    started.store(true, std::memory_order_release);
+    for (auto &thread : threads)
+        thread.join();
+    return nowNs() - start;
+}
+#endif
+
+static void benchmarkUridMap(const BenchmarkOptions &options) {
+#if AAP_LV2_HAVE_LV2
+    auto map = AAPLV2UridMap::instance();
+    const int numUris = 1000;
+    std::vector<std::string> uris{};
+    std::vector<LV2_URID> urids{};
+    for (int i = 0; i < numUris; i++) {
+        uris.emplace_back("urn:benchmark:urid#lookup" + std::to_string(i));
+        urids.emplace_back(map->map(uris.back().c_str()));
+    }
+    auto rounds = options.iterations(1000);
+    // (as many new URIs as a few plugins would map; the hash table has a fixed number of buckets.)
+    auto numInserts = options.iterations(1000);
+    for (int numThreads : {1, 2, 4, 8}) {
+        std::atomic<int> mismatches{0};
+        auto ns = runOnThreads(numThreads, [&](int thread) {
+            for (int r = 0; r < rounds; r++) {
+                for (int i = 0; i < numUris; i++) {
+                    // (each thread in another order, so that they do not move in lockstep.)
+                    auto index = (i + thread * 131) % numUris;
+                    if (map->map(uris[index].c_str()) != urids[index])
+                        mismatches++;
+                }
+            }
+        });
+        char name[64];
+        snprintf(name, sizeof(name), "URID map: lookup (%d threads)", numThreads);
+        if (mismatches)
+            skipBenchmark(name, "a URI was mapped to another URID");
+        else
+            reportBenchmark(name, ns, rounds * numUris);
+
+        // each thread maps the URIs that nobody mapped before.
+        std::vector<std::vector<std::string>> newUris(numThreads);
+        std::vector<std::vector<LV2_URID>> newUrids(numThreads, std::vector<LV2_URID>(numInserts));
+        for (int t = 0; t < numThreads; t++)
+            for (int i = 0; i < numInserts; i++)
+                newUris[t].emplace_back("urn:benchmark:urid#insert" + std::to_string(numThreads) + "/" +
+                                        std::to_string(t) + "/" + std::to_string(i));
+        ns = runOnThreads(numThreads, [&](int thread) {
+            for (int i = 0; i < numInserts; i++)
+                newUrids[thread][i] = map->map(newUris[thread][i].c_str());
+        });
+        snprintf(name, sizeof(name), "URID map: insert (%d threads)", numThreads);
+        bool roundTrips = true;
+        for (int t = 0; t < numThreads; t++)
+            for (int i = 0; i < numInserts; i++) {
+                auto uri = map->unmap(newUrids[t][i]);
+                roundTrips &= uri && newUris[t][i] == uri;
+            }
+        if (!roundTrips)
+            skipBenchmark(name, "a new URI did not round-trip");
+        else
+            reportBenchmark(name, ns, numInserts);
+    }
+#else
+    skipBenchmark("URID map", "built without the LV2 headers");
+#endif
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options{};
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick"))
+            options.quick = true;
+        else if (!strcmp(argv[i], "--plugin") && i + 1 < argc)
+            options.plugin_uri = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s [--quick] [--plugin <LV2 plugin URI>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    benchmarkInstantiation(options);
+    benchmarkPresets(options);
+    benchmarkUmpDemux(options);
+    benchmarkBinaryState(options);
+    benchmarkStateFormats(options);
+    benchmarkSymbolLookup(options);
+    benchmarkUridMap(options);
+    return benchmark_failed ? 1 : 0;
+}
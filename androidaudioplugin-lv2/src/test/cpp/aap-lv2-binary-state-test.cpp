@@ -0,0 +1,196 @@
+// Tests for the binary state format (aap-lv2-binary-state.h): URIDs in property values have to
+// survive a round trip into another process, where the same URIs are mapped to other URIDs.
+
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+#include "aap-lv2-binary-state.h"
+
+static int failures{0};
+
+#define EXPECT(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: expectation failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define ATOM(name) "http://lv2plug.in/ns/ext/atom#" name
+
+// A URID map of a process. `first` makes the URIDs differ between the processes.
+class TestUridMap {
+    std::map<std::string, uint32_t> urids{};
+    std::vector<std::string> uris{};
+    uint32_t first;
+
+public:
+    explicit TestUridMap(uint32_t firstUrid) : first(firstUrid) {}
+
+    uint32_t map(const char* uri) {
+        auto it = urids.find(uri);
+        if (it != urids.end())
+            return it->second;
+        uris.emplace_back(uri);
+        return urids[uri] = first + (uint32_t) uris.size() - 1;
+    }
+    const char* unmap(uint32_t urid) const {
+        return urid >= first && urid - first < uris.size() ? uris[urid - first].c_str() : nullptr;
+    }
+};
+
+static void append(std::vector<uint32_t>& words, std::initializer_list<uint32_t> values) {
+    words.insert(words.end(), values);
+}
+
+// An atom:Object (the body) of otype <urn:test#Thing>, with <urn:test#target> = atom:URID <urn:test#value>
+// and <urn:test#events> = atom:Sequence with an atom:URID event and an atom:Int event.
+static std::vector<uint32_t> createObjectBody(TestUridMap& m) {
+    std::vector<uint32_t> words{};
+    append(words, {0, m.map("urn:test#Thing")});
+    append(words, {m.map("urn:test#target"), 0, 4, m.map(ATOM("URID")), m.map("urn:test#value"), 0});
+    // (the sequence: unit, pad, then two events of 8 + 8 + 8 bytes)
+    append(words, {m.map("urn:test#events"), 0, 8 + 24 * 2, m.map(ATOM("Sequence")), m.map(ATOM("frameTime")), 0});
+    append(words, {10, 0, 4, m.map(ATOM("URID")), m.map("urn:test#event"), 0});
+    append(words, {20, 0, 4, m.map(ATOM("Int")), 12345, 0});
+    return words;
+}
+
+static std::vector<uint8_t> save(TestUridMap& m, const std::vector<uint32_t>& body) {
+    AAPLV2BinaryStateWriter writer{};
+    writer.addPort("gain", 0.5f);
+    writer.addProperty("urn:test#blob", "urn:test#Blob", 1, "abc", 4);
+    EXPECT(writer.addPropertyWithUrids("urn:test#object", ATOM("Object"), 1, body.data(), (uint32_t) (body.size() * 4),
+                                       [&](uint32_t urid) { return m.unmap(urid); }));
+    std::vector<uint8_t> data(writer.size());
+    writer.writeTo(data.data());
+    return data;
+}
+
+static void testRoundTrip() {
+    TestUridMap saving{100}, loading{5000};
+    auto body = createObjectBody(saving);
+    auto data = save(saving, body);
+    EXPECT(aap_lv2_binary_state_validate(data.data(), data.size()));
+
+    AAPLV2BinaryState state{data.data()};
+    EXPECT(state.numPorts() == 1 && state.numProperties() == 2);
+    auto blob = state.property(0);
+    EXPECT(!(blob->flags & AAP_LV2_BINARY_STATE_PROPERTY_URIDS));
+    auto object = state.property(1);
+    EXPECT(object->flags & AAP_LV2_BINARY_STATE_PROPERTY_URIDS);
+    // the stored bytes have no URIDs of the saving process.
+    EXPECT(memcmp(state.value(object), body.data(), object->size) != 0);
+
+    std::vector<uint8_t> value{};
+    EXPECT(state.copyValue(object, value, [&](const char* uri) { return loading.map(uri); }));
+    auto expected = createObjectBody(loading);
+    EXPECT(value.size() == expected.size() * 4 && !memcmp(value.data(), expected.data(), value.size()));
+}
+
+// Merging a delta into its base rewrites the URIDs into the string table of the merged state.
+static void testMerge() {
+    TestUridMap saving{100}, loading{5000};
+    auto baseData = save(saving, createObjectBody(saving));
+    AAPLV2BinaryStateWriter deltaWriter{};
+    deltaWriter.setDelta(aap_lv2_binary_state_hash(baseData.data(), baseData.size()));
+    deltaWriter.addPort("gain", 1.0f);
+    deltaWriter.addProperty("urn:test#blob", "urn:test#Blob", 1, "xyz", 4);
+    std::vector<uint8_t> deltaData(deltaWriter.size());
+    deltaWriter.writeTo(deltaData.data());
+
+    AAPLV2BinaryStateWriter mergedWriter{};
+    aap_lv2_binary_state_merge(AAPLV2BinaryState{baseData.data()}, AAPLV2BinaryState{deltaData.data()}, mergedWriter);
+    std::vector<uint8_t> merged(mergedWriter.size());
+    mergedWriter.writeTo(merged.data());
+    EXPECT(aap_lv2_binary_state_validate(merged.data(), merged.size()));
+
+    AAPLV2BinaryState state{merged.data()};
+    EXPECT(state.numProperties() == 2);
+    for (uint32_t i = 0; i < state.numProperties(); i++) {
+        auto p = state.property(i);
+        if (strcmp(state.string(p->key), "urn:test#object") != 0)
+            continue;
+        std::vector<uint8_t> value{};
+        EXPECT(state.copyValue(p, value, [&](const char* uri) { return loading.map(uri); }));
+        auto expected = createObjectBody(loading);
+        EXPECT(value.size() == expected.size() * 4 && !memcmp(value.data(), expected.data(), value.size()));
+    }
+}
+
+static void testRejected() {
+    TestUridMap saving{100};
+    AAPLV2BinaryStateWriter writer{};
+    auto unmap = [&](uint32_t urid) { return saving.unmap(urid); };
+    // a URID that the process never mapped
+    uint32_t unknown = 99;
+    EXPECT(!writer.addPropertyWithUrids("urn:test#a", ATOM("URID"), 1, &unknown, 4, unmap));
+    // an atom that claims to be longer than the value
+    std::vector<uint32_t> truncated{saving.map("urn:test#key"), 0, 64, saving.map(ATOM("Int"))};
+    EXPECT(!writer.addPropertyWithUrids("urn:test#b", ATOM("Property"), 1, truncated.data(), 16, unmap));
+    EXPECT(writer.numProperties() == 0);
+
+    // an encoded URID out of the string table is not mapped.
+    AAPLV2BinaryStateWriter other{};
+    uint32_t urid = saving.map("urn:test#value");
+    EXPECT(other.addPropertyWithUrids("urn:test#c", ATOM("URID"), 1, &urid, 4, unmap));
+    std::vector<uint8_t> data(other.size());
+    other.writeTo(data.data());
+    AAPLV2BinaryState state{data.data()};
+    auto p = state.property(0);
+    uint32_t outOfRange = 0xFFFFFF;
+    memcpy((uint8_t*) state.value(p), &outOfRange, 4);
+    std::vector<uint8_t> value{};
+    EXPECT(!state.copyValue(p, value, [&](const char* uri) { return saving.map(uri); }));
+}
+
+// A version 1 state (with a 48 byte header) is upgraded to the current version, and the other versions are rejected.
+static void testVersion1() {
+    AAPLV2BinaryStateWriter writer{};
+    writer.addPort("gain", 0.5f);
+    writer.addProperty("urn:test#blob", "urn:test#Blob", 1, "abc", 4);
+    std::vector<uint8_t> current(writer.size());
+    writer.writeTo(current.data());
+    AAPLV2BinaryState source{current.data()};
+    auto header = source.header();
+
+    // the same tables after the old header.
+    auto shift = (uint32_t) (sizeof(aap_lv2_binary_state_header_t) - sizeof(aap_lv2_binary_state_header_v1_t));
+    std::vector<uint8_t> v1(current.begin() + shift, current.end());
+    aap_lv2_binary_state_header_v1_t v1Header{{}, 1, (uint32_t) v1.size(),
+                                              header->num_ports, header->ports_offset - shift,
+                                              header->num_properties, header->properties_offset - shift,
+                                              header->values_offset - shift, header->values_size,
+                                              header->strings_offset - shift, header->strings_size};
+    memcpy(v1Header.magic, AAP_LV2_BINARY_STATE_MAGIC, 8);
+    memcpy(v1.data(), &v1Header, sizeof(v1Header));
+
+    EXPECT(!aap_lv2_binary_state_validate(v1.data(), v1.size()));
+    std::vector<uint8_t> upgraded{};
+    EXPECT(aap_lv2_binary_state_upgrade(v1.data(), v1.size(), upgraded));
+    EXPECT(aap_lv2_binary_state_validate(upgraded.data(), upgraded.size()));
+    AAPLV2BinaryState state{upgraded.data()};
+    EXPECT(state.header()->version == AAP_LV2_BINARY_STATE_VERSION);
+    EXPECT(state.numPorts() == 1 && !strcmp(state.string(state.port(0)->symbol), "gain") && state.port(0)->value == 0.5f);
+    EXPECT(state.numProperties() == 1 && !strcmp((const char*) state.value(state.property(0)), "abc"));
+
+    // the current version is not "upgraded", and an unknown one is neither.
+    EXPECT(!aap_lv2_binary_state_upgrade(current.data(), current.size(), upgraded));
+    v1Header.version = 3;
+    memcpy(v1.data(), &v1Header, sizeof(v1Header));
+    EXPECT(!aap_lv2_binary_state_validate(v1.data(), v1.size()));
+    EXPECT(!aap_lv2_binary_state_upgrade(v1.data(), v1.size(), upgraded));
+}
+
+int main() {
+    testRoundTrip();
+    testMerge();
+    testRejected();
+    testVersion1();
+    if (failures)
+        fprintf(stderr, "%d expectation(s) failed.\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+// Tests for the real-time safety checking mode (aap-lv2-rt-check.c, built into this executable
+// so that its interposed functions take precedence over libc and libstdc++).
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <dlfcn.h>
+#include "aap-lv2-rt-check.h"
+
+static int failures{0};
+
+#define EXPECT(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: expectation failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// called through these, so that the compiler does not elide the allocations.
+static void* (*volatile malloc_function)(size_t) = malloc;
+static void (*volatile free_function)(void*) = free;
+
+static void allocateInScope(AAPLV2RealtimeCounters* counters) {
+    auto previous = aap_lv2_rt_check_enter(counters);
+    auto p = malloc_function(16);
+    free_function(p);
+    auto q = ::operator new(16);
+    ::operator delete(q);
+    aap_lv2_rt_check_leave(previous);
+}
+
+static void testCounts() {
+    auto counters = aap_lv2_rt_check_counters_new();
+    allocateInScope(counters);
+    EXPECT(aap_lv2_rt_check_get_violation_count(counters, AAP_LV2_RT_VIOLATION_MALLOC) == 1);
+    EXPECT(aap_lv2_rt_check_get_violation_count(counters, AAP_LV2_RT_VIOLATION_FREE) == 1);
+    // the malloc() and free() within them are not counted again.
+    EXPECT(aap_lv2_rt_check_get_violation_count(counters, AAP_LV2_RT_VIOLATION_OPERATOR_NEW) == 1);
+    EXPECT(aap_lv2_rt_check_get_violation_count(counters, AAP_LV2_RT_VIOLATION_OPERATOR_DELETE) == 1);
+    EXPECT(aap_lv2_rt_check_get_violation_count(counters, -1) == 4);
+
+    // outside the scope
+    free_function(malloc_function(16));
+    EXPECT(aap_lv2_rt_check_get_violation_count(counters, -1) == 4);
+
+    // reporting does not reset them.
+    aap_lv2_rt_check_report(counters, "testCounts");
+    EXPECT(aap_lv2_rt_check_get_violation_count(counters, -1) == 4);
+    aap_lv2_rt_check_counters_free(counters);
+}
+
+static void testCountersPerInstance() {
+    auto a = aap_lv2_rt_check_counters_new();
+    auto b = aap_lv2_rt_check_counters_new();
+    allocateInScope(a);
+    allocateInScope(a);
+    EXPECT(aap_lv2_rt_check_get_violation_count(a, -1) == 8);
+    EXPECT(aap_lv2_rt_check_get_violation_count(b, -1) == 0);
+
+    // nested scopes count into the innermost one, and restore the outer one.
+    auto previous = aap_lv2_rt_check_enter(b);
+    allocateInScope(a);
+    free_function(malloc_function(16));
+    aap_lv2_rt_check_leave(previous);
+    EXPECT(aap_lv2_rt_check_get_violation_count(a, -1) == 12);
+    EXPECT(aap_lv2_rt_check_get_violation_count(b, -1) == 2);
+
+    aap_lv2_rt_check_counters_free(a);
+    aap_lv2_rt_check_counters_free(b);
+}
+
+// The call sites have to be the callers (here), not the code within operator new/delete.
+static void testCallSites() {
+    Dl_info self{};
+    EXPECT(dladdr((void*) &testCallSites, &self) && self.dli_fname);
+
+    auto counters = aap_lv2_rt_check_counters_new();
+    allocateInScope(counters);
+    for (auto kind : {AAP_LV2_RT_VIOLATION_MALLOC, AAP_LV2_RT_VIOLATION_OPERATOR_NEW, AAP_LV2_RT_VIOLATION_OPERATOR_DELETE}) {
+        void* sites[4];
+        auto numSites = aap_lv2_rt_check_get_violation_sites(counters, kind, sites, 4);
+        EXPECT(numSites == 1);
+        Dl_info info{};
+        if (numSites == 1 && dladdr(sites[0], &info) && info.dli_fname && self.dli_fname)
+            EXPECT(!strcmp(info.dli_fname, self.dli_fname));
+        else
+            EXPECT(!"the call site was not found");
+    }
+    aap_lv2_rt_check_counters_free(counters);
+}
+
+int main() {
+    testCounts();
+    testCountersPerInstance();
+    testCallSites();
+    if (failures)
+        fprintf(stderr, "%d expectation(s) failed.\n", failures);
+    return failures ? 1 : 0;
+}
@@ -11,6 +11,8 @@ apply { from ("${rootDir}/publish-root.gradle") }
 
 subprojects {
     val enable_asan: Boolean by extra(false)
+    // real-time safety checking mode in aap-lv2 process() (see androidaudioplugin-lv2/src/main/cpp/src/aap-lv2-rt-check.h)
+    val enable_rt_check: Boolean by extra(false)
 
     group = "org.androidaudioplugin"
     repositories {
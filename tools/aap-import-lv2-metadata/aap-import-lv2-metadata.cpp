@@ -13,6 +13,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <iostream>
+#include <set>
 #include <string>
 #include <serd/serd.h>
 #include <sord/sord.h>
@@ -21,6 +22,8 @@
 #include "lv2/atom/atom.h"
 #include "lv2/midi/midi.h"
 #include "lv2/presets/presets.h"
+#include "aap-lv2-index.h"
+#include "aap-lv2-descriptor-builder.h"
 
 #define RDF__A LILV_NS_RDF "type"
 
@@ -40,7 +43,8 @@ LilvNode
 	*port_property_uri_node,
 	*toggled_uri_node,
 	*integer_uri_node,
-	*presets_uri_node;
+	*presets_uri_node,
+	*see_also_uri_node;
 
 
 #define PORTCHECKER_SINGLE(_name_,_type_) inline bool _name_ (const LilvPlugin* plugin, const LilvPort* port) { return lilv_port_is_a (plugin, port, _type_); }
@@ -58,6 +62,7 @@ PORTCHECKER_AND (IS_CONTROL_OUT, IS_CONTROL_PORT, IS_OUTPUT_PORT)*/
 
 bool is_plugin_instrument(const LilvPlugin* plugin);
 char* escape_xml(const char* s);
+std::string bundle_dir_of_file_uri(const LilvNode* node);
 
 
 LilvWorld *world;
@@ -94,6 +99,7 @@ int main(int argc, const char **argv)
 	toggled_uri_node = lilv_new_uri (world, LV2_CORE__toggled);
 	integer_uri_node = lilv_new_uri (world, LV2_CORE__integer);
 	presets_uri_node = lilv_new_uri(world, LV2_PRESETS__Preset);
+	see_also_uri_node = lilv_new_uri(world, LILV_NS_RDFS "seeAlso");
 
 	char* lv2realpath = realpath(lv2dirName, NULL);
 	fprintf(stderr, "LV2 directory: %s\n", lv2realpath);
@@ -144,9 +150,22 @@ int main(int argc, const char **argv)
 	
 	fprintf(xmlFP, "<plugins xmlns=\"%s\" xmlns:pp=\"%s\">\n", AAP_CORE_URL, AAP_PORT_PROPERTIES_URL);
 
+	char *indexFilename = (char*) calloc(snprintf(NULL, 0, "%s/%s", lv2realpath, AAP_LV2_INDEX_FILENAME) + 1, 1);
+	sprintf(indexFilename, "%s/%s", lv2realpath, AAP_LV2_INDEX_FILENAME);
+	fprintf(stderr, "Writing plugin index file %s\n", indexFilename);
+	FILE *indexFP = fopen(indexFilename, "w");
+	if (!indexFP) {
+		fprintf(stderr, "Failed to create plugin index file: %s\n", indexFilename);
+		fprintf(stderr, "Error code: %d\n", errno);
+		return 1;
+	}
+	fprintf(indexFP, "%s\n", AAP_LV2_INDEX_HEADER);
+
 	int numPlugins = lilv_plugins_size(plugins);
 	char **pluginLv2Dirs = (char **) calloc(sizeof(char*) * numPlugins + 1, 1);
 	int numPluginDirEntries = 0;
+	int numDescriptors = 0;
+	AAPLV2DescriptorBuilder descriptorBuilder{world};
 
 	LILV_FOREACH(plugins, i, plugins) {		
 		const LilvPlugin *plugin = lilv_plugins_get(plugins, i);
@@ -284,6 +303,42 @@ int main(int argc, const char **argv)
 
 		fprintf(xmlFP, "  </plugin>\n");
 
+		// compiled descriptor, so that the bridge does not have to query port details via lilv.
+		char *descriptorPath = (char*) calloc(snprintf(NULL, 0, "%s/aap-lv2-descriptor-%d.bin", plugin_lv2dir, numDescriptors) + 1, 1);
+		sprintf(descriptorPath, "%s/aap-lv2-descriptor-%d.bin", plugin_lv2dir, numDescriptors++);
+		char *descriptorFilename = (char*) calloc(snprintf(NULL, 0, "%s/%s", lv2realpath, descriptorPath) + 1, 1);
+		sprintf(descriptorFilename, "%s/%s", lv2realpath, descriptorPath);
+		auto descriptor = descriptorBuilder.build(plugin);
+		FILE *descriptorFP = fopen(descriptorFilename, "wb");
+		if (!descriptorFP || fwrite(descriptor.data(), 1, descriptor.size(), descriptorFP) != descriptor.size()) {
+			fprintf(stderr, "Failed to write plugin descriptor file: %s\n", descriptorFilename);
+			fprintf(stderr, "Error code: %d\n", errno);
+			return 1;
+		}
+		fclose(descriptorFP);
+		free(descriptorFilename);
+
+		// Presets can be in other bundles (that declare lv2:appliesTo this plugin). The bridge loads
+		// only the indexed bundles, so we list them too.
+		std::set<std::string> presetBundles{};
+		LILV_FOREACH(nodes, pi, presets) {
+			auto preset = lilv_nodes_get(presets, pi);
+			auto files = lilv_world_find_nodes(world, preset, see_also_uri_node, NULL);
+			LILV_FOREACH(nodes, fi, files)
+				presetBundles.insert(bundle_dir_of_file_uri(lilv_nodes_get(files, fi)));
+			lilv_nodes_free(files);
+			presetBundles.insert(bundle_dir_of_file_uri(preset));
+		}
+		presetBundles.erase("");
+		presetBundles.erase(plugin_lv2dir);
+		lilv_nodes_free(presets);
+
+		fprintf(indexFP, "%s\t%s\t%s", lilv_node_as_uri(lilv_plugin_get_uri(plugin)), plugin_lv2dir, descriptorPath);
+		for (auto& presetBundle : presetBundles)
+			fprintf(indexFP, "\t%s", presetBundle.c_str());
+		fprintf(indexFP, "\n");
+		free(descriptorPath);
+
 		for(int p = 0; p < numPlugins; p++) {
 			if(!pluginLv2Dirs[p]) {
 				pluginLv2Dirs[p] = plugin_lv2dir;
@@ -298,6 +353,8 @@ int main(int argc, const char **argv)
 	fprintf(xmlFP, "</plugins>\n");
 	fclose(xmlFP);
 	free(xmlFilename);
+	fclose(indexFP);
+	free(indexFilename);
 	
 	lilv_world_free(world);
 	
@@ -337,3 +394,22 @@ char* escape_xml(const char* s)
 	stringpool[stringpool_entry++] = ret;
 	return ret;
 }
+
+// Returns the bundle directory name of a file URI (".../lv2/some.lv2/presets.ttl" -> "some.lv2"),
+// or an empty string if it is not a file URI.
+std::string bundle_dir_of_file_uri(const LilvNode* node)
+{
+	if (!lilv_node_is_uri(node) || strncmp(lilv_node_as_uri(node), "file:", 5))
+		return "";
+	char *path = lilv_file_uri_parse(lilv_node_as_uri(node), NULL);
+	if (!path)
+		return "";
+	std::string dir{path};
+	lilv_free(path);
+	auto slash = dir.rfind('/');
+	if (slash == std::string::npos || slash == 0)
+		return "";
+	dir.resize(slash);
+	slash = dir.rfind('/');
+	return slash == std::string::npos ? dir : dir.substr(slash + 1);
+}